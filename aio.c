@@ -0,0 +1,166 @@
+#include "aio.h"
+#include "sfs_types.h"
+#include "sfs_errors.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#define AIO_WORKERS 16
+#define AIO_MAX_REQUESTS 1024
+
+typedef struct
+{
+    byte in_use;
+    byte done;
+    AioOp op;
+    int fileID;
+    long offset;
+    char *buf;
+    int length;
+    int result;
+    SfsAioCallback cb;
+    void *arg;
+} AioRequest;
+
+static void *worker_main(void *unused);
+static void release(int token);
+
+static AioRequest requests[AIO_MAX_REQUESTS];
+
+/* Tokens waiting for a worker, in submission order. */
+static int queue[AIO_MAX_REQUESTS];
+static int q_head, q_len;
+
+/* Requests queued or running, including their callbacks. */
+static int outstanding;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t work_done = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t all_done = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[AIO_WORKERS];
+static int started;
+
+int aio_submit(AioOp op, int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg)
+{
+    int i;
+    pthread_mutex_lock(&lock);
+    if (!started) {
+        for (i = 0; i < AIO_WORKERS; i++)
+            pthread_create(&workers[i], NULL, worker_main, NULL);
+        started = 1;
+    }
+
+    for (i = 0; i < AIO_MAX_REQUESTS; i++) {
+        if (!requests[i].in_use) break;
+    }
+    if (i == AIO_MAX_REQUESTS) {
+        pthread_mutex_unlock(&lock);
+        return ERR_MAX_OPEN;
+    }
+
+    AioRequest *r = &requests[i];
+    r->in_use = 1;
+    r->done = 0;
+    r->op = op;
+    r->fileID = fileID;
+    r->offset = offset;
+    r->buf = buf;
+    r->length = length;
+    r->cb = cb;
+    r->arg = arg;
+
+    queue[(q_head + q_len) % AIO_MAX_REQUESTS] = i;
+    q_len++;
+    outstanding++;
+    pthread_cond_signal(&work_ready);
+    pthread_mutex_unlock(&lock);
+
+    return i;
+}
+
+int aio_poll(int token)
+{
+    if (token < 0 || token >= AIO_MAX_REQUESTS) return ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&lock);
+    AioRequest *r = &requests[token];
+    int result = ERR_NOT_FOUND;
+    if (r->in_use && r->cb == NULL) {
+        result = r->done ? r->result : ERR_PENDING;
+        if (r->done) release(token);
+    }
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+int aio_wait(int token)
+{
+    if (token < 0 || token >= AIO_MAX_REQUESTS) return ERR_NOT_FOUND;
+
+    pthread_mutex_lock(&lock);
+    AioRequest *r = &requests[token];
+    if (!r->in_use || r->cb != NULL) {
+        pthread_mutex_unlock(&lock);
+        return ERR_NOT_FOUND;
+    }
+    while (!r->done)
+        pthread_cond_wait(&work_done, &lock);
+    int result = r->result;
+    release(token);
+    pthread_mutex_unlock(&lock);
+
+    return result;
+}
+
+void aio_drain()
+{
+    pthread_mutex_lock(&lock);
+    while (outstanding > 0)
+        pthread_cond_wait(&all_done, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+void *worker_main(void *unused)
+{
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        while (q_len == 0)
+            pthread_cond_wait(&work_ready, &lock);
+        int token = queue[q_head];
+        q_head = (q_head + 1) % AIO_MAX_REQUESTS;
+        q_len--;
+        AioRequest r = requests[token];
+        pthread_mutex_unlock(&lock);
+
+        int result = r.op(r.fileID, r.offset, r.buf, r.length);
+
+        if (r.cb != NULL) {
+            r.cb(token, result, r.arg);
+            pthread_mutex_lock(&lock);
+            release(token);
+        }
+        else {
+            pthread_mutex_lock(&lock);
+            requests[token].result = result;
+            requests[token].done = 1;
+            pthread_cond_broadcast(&work_done);
+        }
+        if (--outstanding == 0)
+            pthread_cond_broadcast(&all_done);
+        pthread_mutex_unlock(&lock);
+    }
+
+    return NULL;
+}
+
+/* Must be called with the lock held. */
+void release(int token)
+{
+    requests[token].in_use = 0;
+    requests[token].done = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef __AIO_H
+#define __AIO_H
+
+#include "sfs_api.h"
+
+/* An operation run on a worker thread. Returns the result reported
+   for the request. */
+typedef int (*AioOp)(int fileID, long offset, char *buf, int length);
+
+/* Queues [op] to be run on the worker pool, starting the pool on first
+   use. [offset] is passed on to [op]. Returns a request token, or
+   ERR_MAX_OPEN if too many requests are outstanding. If [cb] is given it
+   is called on the worker once the operation finishes and the token is
+   released right after. */
+int aio_submit(AioOp op, int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg);
+
+/* Returns ERR_PENDING if the request has not finished, or else its
+   result, releasing the token. */
+int aio_poll(int token);
+
+/* Blocks until the request finishes, then returns its result and
+   releases the token. */
+int aio_wait(int token);
+
+/* Blocks until every request submitted so far has finished, including
+   its callback. Finished requests can still be polled or waited on.
+   Must not be called from a callback or with the file system lock
+   held, as the requests need both to finish. */
+void aio_drain();
+
+#endif
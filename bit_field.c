@@ -56,6 +56,35 @@ uint32_t bf_locate_first(BitField *b_field, int val)
     return -1;
 }
 
+uint32_t bf_locate_run(BitField *b_field, int val, uint32_t want, uint32_t *len)
+{
+    uint32_t best = -1, best_len = 0, start = 0, run = 0, i;
+    byte skip = (val == 1 ? 0 : 255);
+    for (i = 0; i < b_field->num_bytes * 8; i++) {
+        // Whole bytes without a matching bit end any run in progress.
+        if (i % 8 == 0 && b_field->bits[i / 8] == skip) {
+            run = 0;
+            i += 7;
+            continue;
+        }
+        byte chk = ((b_field->bits[i / 8]) & (1 << (i % 8))) >> (i % 8);
+        if (chk != val) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0)
+            start = i;
+        if (run > best_len) {
+            best = start;
+            best_len = run;
+            if (best_len == want) break;
+        }
+    }
+
+    *len = best_len;
+    return best;
+}
+
 uint32_t bf_num_one_bits(BitField *b_field)
 {
     uint32_t count = 0, i;
@@ -79,6 +108,24 @@ int bf_flip_bit(BitField *b_field, uint32_t index)
     return 0;
 }
 
+int bf_get_bit(BitField *b_field, uint32_t index)
+{
+    if (index >= b_field->num_bytes * 8)
+        return -1;
+    return (b_field->bits[index / 8] >> (index % 8)) & 1;
+}
+
+int bf_set_bit(BitField *b_field, uint32_t index, int val)
+{
+    if (index >= b_field->num_bytes * 8)
+        return -1;
+    if (val)
+        b_field->bits[index / 8] |= 1 << (index % 8);
+    else
+        b_field->bits[index / 8] &= ~(1 << (index % 8));
+    return 0;
+}
+
 void bf_destroy(BitField *b_field)
 {
     free(b_field->bits);
@@ -17,10 +17,20 @@ void bf_set_raw_bytes(BitField *b_field, byte *bytes);
 
 uint32_t bf_locate_first(BitField *b_field, int val);
 
+/* Returns the start of the first run of at least [want] bits equal to
+   [val], storing [want] in [len]. If there is no such run, the longest
+   run is returned instead with its length in [len]. Returns -1 if no
+   bit equals [val]. */
+uint32_t bf_locate_run(BitField *b_field, int val, uint32_t want, uint32_t *len);
+
 uint32_t bf_num_one_bits(BitField *b_field);
 
 int bf_flip_bit(BitField *b_field, uint32_t index);
 
+int bf_get_bit(BitField *b_field, uint32_t index);
+
+int bf_set_bit(BitField *b_field, uint32_t index, int val);
+
 void bf_destroy(BitField *b_field);
 
 void bf_print_hex(BitField *b_field);
@@ -0,0 +1,138 @@
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define MAX_OFFSET 65535
+#define HASH_BITS 12
+
+static uint32_t hash(const byte *p);
+static int put_length(byte *dst, int pos, int cap, int len);
+static int get_length(const byte *src, int *pos, int n, int len);
+static int put_sequence(byte *dst, int pos, int cap, const byte *lit,
+    int nlit, int offset, int mlen);
+
+/**
+ * Greedy matching: every position is hashed on its next four bytes and
+ * the last position with the same hash is tried as a match.
+*/
+int cmp_compress(const byte *src, int n, byte *dst, int cap)
+{
+    int table[1 << HASH_BITS];
+    int ip = 0, anchor = 0, op = 0;
+
+    memset(table, -1, sizeof(table));
+    while (ip + MIN_MATCH <= n) {
+        uint32_t h = hash(src + ip);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > MAX_OFFSET ||
+                memcmp(src + ref, src + ip, MIN_MATCH) != 0) {
+            ip++;
+            continue;
+        }
+
+        int len = MIN_MATCH;
+        while (ip + len < n && src[ref + len] == src[ip + len])
+            len++;
+        op = put_sequence(dst, op, cap, src + anchor, ip - anchor,
+            ip - ref, len);
+        if (op < 0) return -1;
+        ip += len;
+        anchor = ip;
+    }
+
+    // The stream always ends with a sequence of literals only.
+    return put_sequence(dst, op, cap, src + anchor, n - anchor, 0, 0);
+}
+
+int cmp_decompress(const byte *src, int n, byte *dst, int cap)
+{
+    int ip = 0, op = 0;
+
+    while (ip < n) {
+        int token = src[ip++];
+        int lit = get_length(src, &ip, n, token >> 4);
+        if (lit < 0 || ip + lit > n || op + lit > cap) return -1;
+        memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+        if (ip == n) break;
+
+        if (ip + 2 > n) return -1;
+        int offset = src[ip] | (src[ip + 1] << 8);
+        ip += 2;
+        int mlen = get_length(src, &ip, n, token & 15);
+        if (offset == 0 || offset > op || mlen < 0) return -1;
+        mlen += MIN_MATCH;
+        if (op + mlen > cap) return -1;
+
+        // The copy may overlap its own output, so go byte by byte.
+        while (mlen-- > 0) {
+            dst[op] = dst[op - offset];
+            op++;
+        }
+    }
+
+    return op;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+uint32_t hash(const byte *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Lengths of 15 and up spill into extra bytes after the token, 255 at a
+   time. Writes the extra bytes for [len]. */
+int put_length(byte *dst, int pos, int cap, int len)
+{
+    if (len < 15) return pos;
+    len -= 15;
+    while (len >= 255) {
+        if (pos >= cap) return -1;
+        dst[pos++] = 255;
+        len -= 255;
+    }
+    if (pos >= cap) return -1;
+    dst[pos++] = len;
+    return pos;
+}
+
+/* Reads the extra bytes of a length whose token nibble was [len]. */
+int get_length(const byte *src, int *pos, int n, int len)
+{
+    if (len < 15) return len;
+    int b;
+    do {
+        if (*pos >= n) return -1;
+        b = src[(*pos)++];
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+/* Appends a sequence. A zero [offset] marks the final, literals-only
+   one. Returns the new output position, or -1 if it does not fit. */
+int put_sequence(byte *dst, int pos, int cap, const byte *lit, int nlit,
+    int offset, int mlen)
+{
+    int mcode = offset ? mlen - MIN_MATCH : 0;
+    if (pos >= cap) return -1;
+    dst[pos++] = ((nlit < 15 ? nlit : 15) << 4) | (mcode < 15 ? mcode : 15);
+
+    pos = put_length(dst, pos, cap, nlit);
+    if (pos < 0 || pos + nlit > cap) return -1;
+    memcpy(dst + pos, lit, nlit);
+    pos += nlit;
+    if (!offset) return pos;
+
+    if (pos + 2 > cap) return -1;
+    dst[pos++] = offset & 0xff;
+    dst[pos++] = offset >> 8;
+    return put_length(dst, pos, cap, mcode);
+}
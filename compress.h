@@ -0,0 +1,18 @@
+#ifndef __COMPRESS_H
+#define __COMPRESS_H
+
+#include "sfs_types.h"
+
+/* A small LZ77 codec in the style of LZ4: a stream of sequences, each a
+   run of literals followed by a copy of earlier output. Made for inputs
+   of a few kilobytes; matches reach back at most 64 KB. */
+
+/* Compresses [n] bytes of [src] into [dst]. Returns the compressed
+   length, or -1 if it would not fit in [cap] bytes. */
+int cmp_compress(const byte *src, int n, byte *dst, int cap);
+
+/* Decompresses [n] bytes of [src] into [dst]. Returns the decompressed
+   length, or -1 if the input is corrupt or would overflow [cap]. */
+int cmp_decompress(const byte *src, int n, byte *dst, int cap);
+
+#endif
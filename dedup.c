@@ -0,0 +1,123 @@
+#include "dedup.h"
+#include "sfs_constants.h"
+#include "fat_cache.h"
+#include "free_block_list.h"
+
+#include "lib/disk_emu.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define DD_SLOTS 8192
+#define MAX_PROBES 8
+
+typedef struct
+{
+    uint64_t hash;
+    int data_block;
+} Slot;
+
+static uint64_t hash_block(const byte *data);
+static int still_valid(const Slot *s, const byte *data);
+static void clear_slot(Slot *s);
+
+/* Open addressing with short probe runs. A full run evicts its first
+   slot, which is fine since the index is only a cache. */
+static Slot slots[DD_SLOTS];
+static int enabled;
+
+/* The slot holding each data block, plus one, or 0 if it is not
+   indexed. Lets a freed block be dropped without a search. */
+static int slot_of[TOTAL_DATA_BLOCKS];
+
+void dd_reset()
+{
+    int i;
+    for (i = 0; i < DD_SLOTS; i++)
+        slots[i].data_block = NO_DATA;
+    memset(slot_of, 0, sizeof(slot_of));
+}
+
+void dd_set_enabled(int on)
+{
+    enabled = on;
+    if (!on) dd_reset();
+}
+
+int dd_enabled()
+{
+    return enabled;
+}
+
+int dd_lookup(const byte *data)
+{
+    uint64_t h = hash_block(data);
+    int i;
+    for (i = 0; i < MAX_PROBES; i++) {
+        Slot *s = &slots[(h + i) % DD_SLOTS];
+        if (s->data_block == NO_DATA) return NO_DATA;
+        if (s->hash != h) continue;
+        if (still_valid(s, data)) return s->data_block;
+        // The block was rewritten since it was indexed.
+        clear_slot(s);
+        return NO_DATA;
+    }
+    return NO_DATA;
+}
+
+void dd_insert(const byte *data, int data_block)
+{
+    uint64_t h = hash_block(data);
+    Slot *victim = &slots[h % DD_SLOTS];
+    int i;
+    for (i = 0; i < MAX_PROBES; i++) {
+        Slot *s = &slots[(h + i) % DD_SLOTS];
+        if (s->data_block == NO_DATA || s->hash == h) {
+            victim = s;
+            break;
+        }
+    }
+    clear_slot(victim);
+    dd_forget(data_block);
+    victim->hash = h;
+    victim->data_block = data_block;
+    slot_of[data_block - DATA_BLOCK_OFFSET] = victim - slots + 1;
+}
+
+void dd_forget(int data_block)
+{
+    int i = slot_of[data_block - DATA_BLOCK_OFFSET];
+    if (i > 0) clear_slot(&slots[i - 1]);
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* 64-bit FNV-1a, one word at a time. */
+uint64_t hash_block(const byte *data)
+{
+    uint64_t h = 14695981039346656037ull;
+    int i;
+    for (i = 0; i < BLOCK_SIZE; i += 8) {
+        uint64_t w;
+        memcpy(&w, data + i, sizeof(w));
+        h = (h ^ w) * 1099511628211ull;
+    }
+    return h;
+}
+
+/* Freed blocks leave the index, but a block can still be rewritten in
+   place, so a hit is only trusted after comparing the bytes on disk. */
+int still_valid(const Slot *s, const byte *data)
+{
+    byte buf[BLOCK_SIZE];
+    if (fbl_is_free(s->data_block - DATA_BLOCK_OFFSET)) return 0;
+    read_blocks(s->data_block, 1, buf);
+    return memcmp(buf, data, BLOCK_SIZE) == 0;
+}
+
+void clear_slot(Slot *s)
+{
+    if (s->data_block == NO_DATA) return;
+    slot_of[s->data_block - DATA_BLOCK_OFFSET] = 0;
+    s->data_block = NO_DATA;
+}
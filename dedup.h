@@ -0,0 +1,35 @@
+#ifndef __DEDUP_H
+#define __DEDUP_H
+
+#include "sfs_types.h"
+
+/* An in-memory index from the contents of data blocks to blocks already
+   on disk, so that a block being written can share an identical one.
+   Only blocks referenced by a file are indexed, and a block leaves the
+   index when it is freed, so a hit never points into a run that has
+   been reserved without a file, such as a snapshot's or defrag's. Hits
+   are still read back and compared, as blocks are rewritten in place.
+   The index starts empty on every mount and only learns blocks written
+   since. */
+
+/* Empties the index. */
+void dd_reset();
+
+/* Turns deduplication of newly written blocks on or off. Off by
+   default; turning it off also empties the index. */
+void dd_set_enabled(int on);
+
+/* Returns true if deduplication is on. */
+int dd_enabled();
+
+/* Returns a data block, as used in FAT entries, holding exactly the
+   BLOCK_SIZE bytes at [data], or NO_DATA. */
+int dd_lookup(const byte *data);
+
+/* Records that [data_block] now holds the bytes at [data]. */
+void dd_insert(const byte *data, int data_block);
+
+/* Drops [data_block] from the index, for when it is freed. */
+void dd_forget(int data_block);
+
+#endif
@@ -0,0 +1,164 @@
+#include "defrag.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+#include "fat_cache.h"
+#include "free_block_list.h"
+#include "refcount.h"
+
+#include "lib/disk_emu.h"
+
+#include <stdlib.h>
+
+static int still_there(DefragJob *job);
+static int count_data_blocks(int fat_root);
+static int has_shared_blocks(int fat_root);
+static void finish(DefragJob *job);
+static int run_taken(DefragJob *job, int n);
+
+int defrag_extents(int dir_index)
+{
+    return fat_count_extents(dir_get_fat_root(dir_index));
+}
+
+int defrag_begin(int dir_index, DefragJob *job)
+{
+    int got;
+
+    job->dir_index = dir_index;
+    job->fat_root = dir_get_fat_root(dir_index);
+    job->nblocks = count_data_blocks(job->fat_root);
+    job->done = 0;
+    job->pos = 0;
+    if (fat_count_extents(job->fat_root) <= 1) return 0;
+    // Moving a shared block would give this file a private copy of it,
+    // and a packed tail has to stay where its fragment block is.
+    if (has_shared_blocks(job->fat_root) ||
+            (dir_get_flags(dir_index) & DIR_PACKED))
+        return 0;
+
+    job->target = fbl_alloc_run(job->nblocks, &got);
+    if (job->target < 0) return 0;
+    if (got < job->nblocks) {
+        // Moving into a shorter run would not make the file contiguous.
+        job->nblocks = got;
+        finish(job);
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * The chain is walked again from the root on every step, as the file
+ * may have been written, truncated or removed since the last one. Each
+ * step resumes at the chain position where the last one stopped, not
+ * at the k-th data block, so a block punched out behind it cannot make
+ * an already moved block be moved again. Every slot of the run is
+ * filled at most once, and blocks beyond the run are left where they
+ * are.
+*/
+int defrag_step(DefragJob *job, int max_blocks)
+{
+    if (job->done >= job->nblocks || !still_there(job)) {
+        finish(job);
+        return 0;
+    }
+
+    int end = job->done + max_blocks;
+    if (end > job->nblocks) end = job->nblocks;
+
+    int *fats = malloc(sizeof(int) * (end - job->done));
+    int *dbs = malloc(sizeof(int) * (end - job->done));
+    int fat, pos = 0, n = 0;
+    for (fat = job->fat_root; fat != END_OF_FILE && n < end - job->done;
+            fat = fat_get_next_index(fat), pos++) {
+        int db = fat_get_data_block(fat);
+        if (pos < job->pos || db == NO_DATA) continue;
+        fats[n] = fat;
+        dbs[n] = db;
+        n++;
+    }
+    job->pos = pos;
+
+    if (n == 0 || run_taken(job, n)) {
+        // The file lost blocks since the job started, or something
+        // else took a block of the run, which must not be overwritten.
+        free(fats);
+        free(dbs);
+        finish(job);
+        return 0;
+    }
+
+    // Copy first, then repoint, so that the old blocks stay valid
+    // until the new FAT entries are flushed.
+    byte *buf = malloc(n * BLOCK_SIZE);
+    int i = 0, j;
+    while (i < n) {
+        for (j = i + 1; j < n && dbs[j] == dbs[j - 1] + 1; j++);
+        read_blocks(dbs[i], j - i, buf + i * BLOCK_SIZE);
+        i = j;
+    }
+    write_blocks(job->target + job->done + DATA_BLOCK_OFFSET, n, buf);
+    for (i = 0; i < n; i++) {
+        int block = job->target + job->done + i;
+        if (fat_is_shared(fats[i]))
+            fbl_set_free_index(block);
+        else if (dbs[i] != block + DATA_BLOCK_OFFSET)
+            fat_relocate_block(fats[i], block);
+    }
+
+    job->done += n;
+    free(buf);
+    free(fats);
+    free(dbs);
+    return n;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Returns true if the file the job was started on still exists. */
+int still_there(DefragJob *job)
+{
+    return dir_is_used(job->dir_index) &&
+        dir_get_fat_root(job->dir_index) == job->fat_root;
+}
+
+int count_data_blocks(int fat_root)
+{
+    int n = 0, fat;
+    for (fat = fat_root; fat != END_OF_FILE; fat = fat_get_next_index(fat)) {
+        if (fat_get_data_block(fat) != NO_DATA) n++;
+    }
+    return n;
+}
+
+int has_shared_blocks(int fat_root)
+{
+    int fat;
+    for (fat = fat_root; fat != END_OF_FILE; fat = fat_get_next_index(fat)) {
+        if (fat_is_shared(fat)) return 1;
+    }
+    return 0;
+}
+
+/* Drops the reservation on the part of the run that was not filled,
+   freeing each block unless something else took it meanwhile. */
+void finish(DefragJob *job)
+{
+    int i;
+    for (i = job->done; i < job->nblocks; i++)
+        fat_unref_block(job->target + i + DATA_BLOCK_OFFSET);
+    job->done = job->nblocks;
+}
+
+/* Returns true if any of the next [n] blocks of the run has a reference
+   besides the job's reservation, or is pinned by a read. */
+int run_taken(DefragJob *job, int n)
+{
+    int i;
+    for (i = job->done; i < job->done + n; i++) {
+        if (rc_get(job->target + i) > 1 || rc_pinned(job->target + i))
+            return 1;
+    }
+    return 0;
+}
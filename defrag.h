@@ -0,0 +1,35 @@
+#ifndef __DEFRAG_H
+#define __DEFRAG_H
+
+/* The move of one file's data blocks into a single reserved run. It
+   is carried out in steps, and the file may be used in between. */
+typedef struct
+{
+    int dir_index;
+    int fat_root;
+    int target;
+    int nblocks;
+    int done;
+    /* The position in the chain of the first entry not moved yet. */
+    int pos;
+} DefragJob;
+
+/* Returns the number of physically contiguous runs of data in the file
+   in directory slot [dir_index]. */
+int defrag_extents(int dir_index);
+
+/* Reserves a free run big enough for all of the file's data blocks.
+   Returns 1 if the file is fragmented and a run was found, or else 0
+   and [job] must not be stepped. */
+int defrag_begin(int dir_index, DefragJob *job);
+
+/* Copies up to [max_blocks] more of the file's blocks into the run and
+   points their FAT entries at the copies, freeing the old blocks. The
+   caches must be flushed before anything else runs. Returns the number
+   of blocks moved, or 0 once the job is over, at which point any part
+   of the run left unused (the file shrank or went away) is freed. The
+   job also ends, without writing, if a block it is about to fill has
+   been referenced or pinned by anything else. */
+int defrag_step(DefragJob *job, int max_blocks);
+
+#endif
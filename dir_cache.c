@@ -1,7 +1,8 @@
 #include "dir_cache.h"
 #include "sfs_types.h"
 #include "sfs_constants.h"
-#include "fat_cache.h"
+#include "meta_region.h"
+#include "bit_field.h"
 
 #include "lib/disk_emu.h"
 
@@ -9,131 +10,557 @@
 #include <stdlib.h>
 #include <string.h>
 
+#define MIN(a, b) (a < b ? a : b)
+
+/* Values of the first byte of a slot. A removed entry leaves a
+   tombstone, so that searches keep probing past it. */
+#define SLOT_FREE 0
+#define SLOT_USED 1
+#define SLOT_REMOVED 2
+
+/* The directory region holds a bitmap of the record heap's granules,
+   then the fixed-size attributes of every slot, then the heap of
+   variable-length records holding each entry's name and inline data. */
+#define NUM_SLOTS 1024
+#define MAP_BLOCKS 1
+#define ATTR_BLOCKS (NUM_SLOTS * sizeof(DirAttr) / BLOCK_SIZE)
+#define HEAP_BLOCKS (DIRECTORY_BLOCKS - MAP_BLOCKS - ATTR_BLOCKS)
+
+/* Records are made of runs of granules, and may span two heap blocks. */
+#define GRANULE 16
+#define HEAP_GRANULES (HEAP_BLOCKS * BLOCK_SIZE / GRANULE)
+#define MAX_RECORD_GRANULES (MAX_NAME_LEN / GRANULE)
+
+/* The number of directories whose sorted listing is kept. */
+#define SORTED_DIRS 4
+
 typedef struct
 {
     byte used;
-    char name[MAX_NAME_LEN];
-    long size;
+    byte flags;
+    /* The slot of the parent directory plus one, or 0 for the root. */
+    uint16_t parent;
     uint16_t fat_index;
-} DirEntry;
+    uint16_t tail_off;
+    /* 32 bits, to keep the attributes at 16 bytes and leave the heap room
+       for inline data. Every offset and length in the API is an int, so
+       no file can end past 2^32 - 2 bytes. */
+    uint32_t size;
+    /* The first granule and length of the entry's record. */
+    uint16_t rec;
+    byte rec_len;
+    /* The top byte of the name's hash, to skip most records that do not
+       match without reading them. */
+    byte tag;
+} DirAttr;
+
+/* The entries of one directory, in name order. */
+typedef struct
+{
+    int parent;
+    int n;
+    int *slots;
+} SortedDir;
+
+static DirAttr *entry(int dir_index);
+static DirAttr *slot(int dir_index);
+static void touch(int dir_index);
+static char *record(DirAttr *e);
+static void touch_record(DirAttr *e);
+static byte *inline_data(DirAttr *e);
+static int grow_record(DirAttr *e, int want);
+static int alloc_granules(int n);
+static void free_granules(int first, int n);
+static void load_map();
+static void clear_cache();
+static uint32_t hash(int parent, char *name);
+static void forget_sorted(int parent);
+static int compare_names(const void *a, const void *b);
 
-static int NUM_DIR_ENTRIES = DIR_BYTES / sizeof(DirEntry);
-static DirEntry *directory[DIR_BYTES / sizeof(DirEntry)];
-static DirEntry *iter;
-static int curr_iter;
+static MetaRegion *map_region, *attrs, *heap;
 
+/* Bit i is set while granule i of the heap belongs to a record. It is
+   read in the first time a record is allocated or freed. */
+static BitField *map;
+static int map_loaded;
+static int map_dirty;
+
+/* The number of slots holding an entry. */
+static int nused;
+
+/* Sorted listings of recently listed directories, replaced in turn.
+   A directory's listing is dropped when an entry comes or goes. */
+static SortedDir sorted[SORTED_DIRS];
+static int sorted_next;
+
+void dir_init()
+{
+    clear_cache();
+    mr_reset(map_region);
+    mr_reset(attrs);
+    mr_reset(heap);
+    map_loaded = 1;
+    map_dirty = 1;
+}
+
+/* The heap map is rebuilt from the attributes rather than read, since
+   after a crash it may not match them. */
 void dir_load()
 {
-    const int len = sizeof(DirEntry);
-	int i;
-    byte buf[DIR_BYTES], *ptr = buf;
-    read_blocks(DIR_START, DIRECTORY_BLOCKS, buf);
-    for (i = 0; i < DIR_BYTES; i += len, ptr += len)
-    {
-        // First byte tells us whether or not this slot is used.
-        if (buf[i] == 1) {
-            DirEntry *dir_entry = malloc(len);
-            memcpy(dir_entry, ptr, len);
-            directory[i / len] = dir_entry;
-        }
+    int i, j;
+    clear_cache();
+    mr_load_all(map_region);
+    mr_load_all(attrs);
+    mr_load_all(heap);
+    map_loaded = 1;
+    map_dirty = 1;
+    for (i = 0; i < NUM_SLOTS; i++) {
+        DirAttr *e = entry(i);
+        if (e == NULL) continue;
+        nused++;
+        for (j = e->rec; j < e->rec + e->rec_len; j++)
+            bf_set_bit(map, j, 1);
     }
 }
 
-void dir_flush()
+void dir_load_lazy(int used)
 {
-	byte dir_buf[DIR_BYTES] = {0}, *ptr = dir_buf;
-    int i;
-    for (i = 0; i < NUM_DIR_ENTRIES; i++, ptr += sizeof(DirEntry)) {
-        DirEntry *d = directory[i];
-        if (d != NULL)
-            memcpy(ptr, d, sizeof(DirEntry));
-    }
+    clear_cache();
+    nused = used;
+}
 
-    write_blocks(DIR_START, DIRECTORY_BLOCKS, dir_buf);
+void dir_load_copy(int start_block)
+{
+    int i;
+    clear_cache();
+    mr_relocate(map_region, start_block);
+    mr_relocate(attrs, start_block + MAP_BLOCKS);
+    mr_relocate(heap, start_block + MAP_BLOCKS + ATTR_BLOCKS);
+    mr_load_all(map_region);
+    mr_load_all(attrs);
+    mr_load_all(heap);
+    for (i = 0; i < NUM_SLOTS; i++)
+        nused += entry(i) != NULL;
 }
 
-void dir_iter_begin()
+void dir_flush()
 {
-    // Set the current pointer to the first non-null entry.
-    for (curr_iter = 0; curr_iter < NUM_DIR_ENTRIES; curr_iter++) {
-        iter = directory[curr_iter];
-        if (iter != NULL) break;
+    if (map_dirty) {
+        memcpy(mr_record(map_region, 0), bf_get_raw_bytes(map),
+            HEAP_GRANULES / 8);
+        mr_touch(map_region, 0);
+        map_dirty = 0;
     }
+    mr_flush(map_region, NULL);
+    mr_flush(attrs, NULL);
+    mr_flush(heap, NULL);
 }
 
-int dir_curr_iter()
+int dir_get_used()
 {
-    return curr_iter;
+    return nused;
 }
 
-int dir_iter_done()
+int dir_blocks_read()
 {
-    return curr_iter == NUM_DIR_ENTRIES ? 1 : 0;
+    return mr_blocks_read(map_region) + mr_blocks_read(attrs) +
+        mr_blocks_read(heap);
 }
 
-void dir_iter_next()
+int dir_next(int dir_index)
 {
-    for (++curr_iter; curr_iter < NUM_DIR_ENTRIES; curr_iter++) {
-        iter = directory[curr_iter];
-        if (iter != NULL) break;
+    int i;
+    for (i = dir_index + 1; i < NUM_SLOTS; i++) {
+        if (entry(i) != NULL) return i;
     }
+    return ERR_NOT_FOUND;
 }
 
-int dir_search(char *name)
+/**
+ * Entries are placed by a hash of their parent and name, with linear
+ * probing, so a search only reads the slots from the entry's home slot
+ * up to the first slot that has never been used. Only the records of
+ * entries whose hash tag matches are read to compare names.
+*/
+int dir_search(int parent, char *name)
 {
-    int i;
-    for (i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (directory[i] == NULL) 
-            continue;
-        else if (strncmp(name, directory[i]->name, MAX_NAME_LEN) == 0)
+    uint32_t h = hash(parent, name);
+    int i, n;
+    for (i = h % NUM_SLOTS, n = 0; n < NUM_SLOTS;
+            i = (i + 1) % NUM_SLOTS, n++) {
+        DirAttr *e = slot(i);
+        if (e->used == SLOT_FREE) break;
+        if (e->used == SLOT_USED && e->parent == parent + 1 &&
+                e->tag == h >> 24 &&
+                strncmp(name, record(e), MAX_NAME_LEN) == 0)
             return i;
     }
 
     return ERR_NOT_FOUND;
 }
 
-int dir_create_entry(char *name)
+/**
+ * The table is hashed, so a directory's entries are gathered with one
+ * pass over the slots and sorted. The result is kept until the
+ * directory changes, so a listing read in many batches sorts only once.
+*/
+int dir_sorted(int parent, int **slots)
 {
-    int f_index = fat_create_entry();
-    if (f_index == ERR_OUT_OF_SPACE)
-        return ERR_OUT_OF_SPACE;
-    int i;
-    for (i = 0; i < NUM_DIR_ENTRIES; i++) {
-        if (directory[i] == NULL) {
-            directory[i] = malloc(sizeof(DirEntry));
-            directory[i]->used = 1;
-            strncpy(directory[i]->name, name, MAX_NAME_LEN);
-            directory[i]->size = 0;
-            directory[i]->fat_index = fat_create_entry();
-            return i;
+    int i, n = 0;
+    for (i = 0; i < SORTED_DIRS; i++) {
+        if (sorted[i].slots != NULL && sorted[i].parent == parent) {
+            *slots = sorted[i].slots;
+            return sorted[i].n;
         }
     }
 
-    return ERR_OUT_OF_SPACE;
+    SortedDir *d = &sorted[sorted_next];
+    sorted_next = (sorted_next + 1) % SORTED_DIRS;
+    free(d->slots);
+    d->slots = malloc(sizeof(int) * (nused + 1));
+    for (i = dir_next(-1); i != ERR_NOT_FOUND; i = dir_next(i)) {
+        if (entry(i)->parent == parent + 1)
+            d->slots[n++] = i;
+    }
+    qsort(d->slots, n, sizeof(int), compare_names);
+    d->parent = parent;
+    d->n = n;
+    *slots = d->slots;
+    return n;
+}
+
+int dir_create_entry(int parent, char *name, int flags)
+{
+    uint32_t h = hash(parent, name);
+    int len = strnlen(name, MAX_NAME_LEN - 1);
+    int i;
+    if (nused == NUM_SLOTS) return ERR_OUT_OF_SPACE;
+
+    int rec_len = len / GRANULE + 1;
+    int rec = alloc_granules(rec_len);
+    if (rec < 0) return ERR_OUT_OF_SPACE;
+
+    for (i = h % NUM_SLOTS; entry(i) != NULL; i = (i + 1) % NUM_SLOTS);
+    DirAttr *e = slot(i);
+    memset(e, 0, sizeof(DirAttr));
+    e->used = SLOT_USED;
+    e->flags = flags & DIR_DIRECTORY ? flags : flags | DIR_INLINE;
+    e->parent = parent + 1;
+    e->rec = rec;
+    e->rec_len = rec_len;
+    e->tag = h >> 24;
+    char *r = record(e);
+    memset(r, 0, rec_len * GRANULE);
+    memcpy(r, name, len);
+    touch_record(e);
+    nused++;
+    touch(i);
+    forget_sorted(parent);
+    if (parent != DIR_ROOT)
+        dir_inc_size(parent, 1);
+    return i;
+}
+
+int dir_num_slots()
+{
+    return NUM_SLOTS;
+}
+
+int dir_is_used(int dir_index)
+{
+    return dir_index >= 0 && dir_index < NUM_SLOTS &&
+        entry(dir_index) != NULL;
+}
+
+int dir_get_parent(int dir_index)
+{
+    return entry(dir_index)->parent - 1;
 }
 
 int dir_get_fat_root(int dir_index)
 {
-    return directory[dir_index]->fat_index;
+    DirAttr *e = entry(dir_index);
+    return (e->flags & (DIR_INLINE | DIR_DIRECTORY)) ? END_OF_FILE :
+        e->fat_index;
+}
+
+/* Leaving inline storage gives the record's data granules back. */
+void dir_set_fat_root(int dir_index, int fat_index)
+{
+    DirAttr *e = entry(dir_index);
+    if (e->flags & DIR_INLINE) {
+        int keep = strnlen(record(e), MAX_NAME_LEN) / GRANULE + 1;
+        memset(inline_data(e), 0, dir_inline_capacity(dir_index));
+        touch_record(e);
+        free_granules(e->rec + keep, e->rec_len - keep);
+        e->rec_len = keep;
+        e->flags &= ~DIR_INLINE;
+    }
+    e->fat_index = fat_index;
+    touch(dir_index);
+}
+
+int dir_get_tail_off(int dir_index)
+{
+    return entry(dir_index)->tail_off;
+}
+
+void dir_set_tail_off(int dir_index, int off)
+{
+    entry(dir_index)->tail_off = off;
+    touch(dir_index);
+}
+
+int dir_inline_capacity(int dir_index)
+{
+    DirAttr *e = entry(dir_index);
+    return (byte*) record(e) + e->rec_len * GRANULE - inline_data(e);
+}
+
+int dir_reserve_inline(int dir_index, long n)
+{
+    DirAttr *e = entry(dir_index);
+    int name = inline_data(e) - (byte*) record(e);
+    if (n > MAX_RECORD_GRANULES * GRANULE - name) return 0;
+    int want = (name + n + GRANULE - 1) / GRANULE;
+    if (want <= e->rec_len) return 1;
+    if (!grow_record(e, want)) return 0;
+    touch(dir_index);
+    return 1;
+}
+
+void dir_read_inline(int dir_index, int off, byte *dst, int n)
+{
+    memcpy(dst, inline_data(entry(dir_index)) + off, n);
+}
+
+void dir_write_inline(int dir_index, int off, const byte *src, int n)
+{
+    DirAttr *e = entry(dir_index);
+    byte *data = inline_data(e) + off;
+    if (src == NULL)
+        memset(data, 0, n);
+    else
+        memcpy(data, src, n);
+    touch_record(e);
 }
 
 char *dir_get_name(int dir_index)
 {
-    return directory[dir_index]->name;
+    return record(entry(dir_index));
+}
+
+int dir_get_flags(int dir_index)
+{
+    return entry(dir_index)->flags;
+}
+
+void dir_set_flags(int dir_index, int flags)
+{
+    entry(dir_index)->flags = flags;
+    touch(dir_index);
 }
 
 long dir_get_size(int dir_index)
 {
-    return directory[dir_index]->size;
+    return entry(dir_index)->size;
 }
 
 void dir_inc_size(int dir_index, long delta)
 {
-    directory[dir_index]->size += delta;
+    entry(dir_index)->size += delta;
+    touch(dir_index);
+}
+
+void dir_set_size(int dir_index, long size)
+{
+    entry(dir_index)->size = size;
+    touch(dir_index);
 }
 
 void dir_remove(int dir_index)
 {
-    free(directory[dir_index]);
-    directory[dir_index] = NULL;
-}
\ No newline at end of file
+    DirAttr *e = entry(dir_index);
+    int parent = e->parent - 1;
+    forget_sorted(parent);
+    if (dir_is_used(parent) && (entry(parent)->flags & DIR_DIRECTORY))
+        dir_inc_size(parent, -1);
+    memset(record(e), 0, e->rec_len * GRANULE);
+    touch_record(e);
+    free_granules(e->rec, e->rec_len);
+    memset(e, 0, sizeof(DirAttr));
+    e->used = SLOT_REMOVED;
+    nused--;
+    touch(dir_index);
+
+    // Tombstones right before a never used slot end no probe sequence
+    // early, so they can be cleared.
+    int i = dir_index;
+    while (slot(i)->used == SLOT_REMOVED &&
+            slot((i + 1) % NUM_SLOTS)->used == SLOT_FREE) {
+        slot(i)->used = SLOT_FREE;
+        touch(i);
+        i = (i + NUM_SLOTS - 1) % NUM_SLOTS;
+    }
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Returns the slot's attributes, reading them from disk on first use, or
+   NULL if the slot holds no entry. */
+DirAttr *entry(int dir_index)
+{
+    DirAttr *e = slot(dir_index);
+    return e->used == SLOT_USED ? e : NULL;
+}
+
+/* Same as entry, but returns free slots and tombstones too. */
+DirAttr *slot(int dir_index)
+{
+    return (DirAttr*) mr_record(attrs, dir_index);
+}
+
+void touch(int dir_index)
+{
+    mr_touch(attrs, dir_index);
+}
+
+/* Returns the entry's record, the name and then any inline data. */
+char *record(DirAttr *e)
+{
+    mr_record(heap, e->rec + e->rec_len - 1);
+    return (char*) mr_record(heap, e->rec);
+}
+
+void touch_record(DirAttr *e)
+{
+    mr_touch(heap, e->rec);
+    mr_touch(heap, e->rec + e->rec_len - 1);
+}
+
+/* Inline data starts right after the name's terminator. */
+byte *inline_data(DirAttr *e)
+{
+    char *name = record(e);
+    return (byte*) name + strnlen(name, MAX_NAME_LEN) + 1;
+}
+
+/* Makes the record [want] granules long, in place if the granules after
+   it in its block are free, or else by moving it. Returns 1 on success. */
+int grow_record(DirAttr *e, int want)
+{
+    int i, extra = want - e->rec_len;
+    int end = e->rec + e->rec_len;
+
+    load_map();
+    int in_place = end + extra <= HEAP_GRANULES;
+    for (i = 0; in_place && i < extra; i++)
+        in_place = !bf_get_bit(map, end + i);
+    if (in_place) {
+        for (i = 0; i < extra; i++)
+            bf_set_bit(map, end + i, 1);
+        map_dirty = 1;
+        e->rec_len = want;
+        memset(record(e) + (want - extra) * GRANULE, 0, extra * GRANULE);
+        touch_record(e);
+        return 1;
+    }
+
+    int rec = alloc_granules(want);
+    if (rec < 0) return 0;
+    DirAttr moved = *e;
+    moved.rec = rec;
+    moved.rec_len = want;
+    char *dst = record(&moved);
+    memcpy(dst, record(e), e->rec_len * GRANULE);
+    memset(dst + e->rec_len * GRANULE, 0, extra * GRANULE);
+    memset(record(e), 0, e->rec_len * GRANULE);
+    touch_record(e);
+    free_granules(e->rec, e->rec_len);
+    *e = moved;
+    touch_record(e);
+    return 1;
+}
+
+/* Returns the first of [n] free granules in a row, marked as used, or
+   -1 if there are none. */
+int alloc_granules(int n)
+{
+    uint32_t len, i;
+    load_map();
+    uint32_t first = bf_locate_run(map, 0, n, &len);
+    if (first == (uint32_t) -1 || len < n) return -1;
+    for (i = first; i < first + n; i++)
+        bf_set_bit(map, i, 1);
+    map_dirty = 1;
+    return first;
+}
+
+void free_granules(int first, int n)
+{
+    int i;
+    load_map();
+    for (i = first; i < first + n; i++)
+        bf_set_bit(map, i, 0);
+    map_dirty = 1;
+}
+
+void load_map()
+{
+    if (map_loaded) return;
+    bf_set_raw_bytes(map, mr_record(map_region, 0));
+    map_loaded = 1;
+}
+
+/* Drops every cached block and points the regions back at the live
+   directory. */
+void clear_cache()
+{
+    if (attrs == NULL) {
+        map_region = mr_create(DIR_START, MAP_BLOCKS, BLOCK_SIZE);
+        attrs = mr_create(DIR_START + MAP_BLOCKS, ATTR_BLOCKS,
+            sizeof(DirAttr));
+        heap = mr_create(DIR_START + MAP_BLOCKS + ATTR_BLOCKS, HEAP_BLOCKS,
+            GRANULE);
+        map = bf_create(HEAP_GRANULES);
+    }
+    mr_relocate(map_region, DIR_START);
+    mr_relocate(attrs, DIR_START + MAP_BLOCKS);
+    mr_relocate(heap, DIR_START + MAP_BLOCKS + ATTR_BLOCKS);
+    bf_set_all_bits(map, 0);
+    map_loaded = 0;
+    map_dirty = 0;
+    nused = 0;
+    forget_sorted(ERR_NOT_FOUND);
+}
+
+/* FNV-1a over the name, seeded with the parent. */
+uint32_t hash(int parent, char *name)
+{
+    uint32_t h = 2166136261u ^ (uint32_t) (parent + 1);
+    int i;
+    for (i = 0; i < MAX_NAME_LEN && name[i] != '\0'; i++) {
+        h ^= (byte) name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Drops the sorted listing of [parent], or of every directory if it is
+   ERR_NOT_FOUND. */
+void forget_sorted(int parent)
+{
+    int i;
+    for (i = 0; i < SORTED_DIRS; i++) {
+        if (parent != ERR_NOT_FOUND && sorted[i].parent != parent)
+            continue;
+        free(sorted[i].slots);
+        sorted[i].slots = NULL;
+    }
+}
+
+int compare_names(const void *a, const void *b)
+{
+    return strcmp(dir_get_name(*(const int*) a),
+        dir_get_name(*(const int*) b));
+}
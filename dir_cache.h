@@ -2,6 +2,26 @@
 #define __DIR_CACHE_H
 
 #include "sfs_errors.h"
+#include "sfs_types.h"
+
+/* The file's data is stored in compressed clusters. */
+#define DIR_COMPRESSED 0x01
+
+/* The file's data is stored in the entry itself, in its record after
+   the name, and the file has no FAT chain. */
+#define DIR_INLINE 0x02
+
+/* The partial last block of the file is packed into a fragment block
+   shared with other files, at the offset returned by dir_get_tail_off. */
+#define DIR_PACKED 0x04
+
+/* The entry is a directory. Its size is the number of entries in it,
+   and it has no data. */
+#define DIR_DIRECTORY 0x08
+
+/* Stands for the root directory, which has no entry of its own, where a
+   parent directory is expected. */
+#define DIR_ROOT -1
 
 /* Initialize the cache. */
 void dir_init();
@@ -9,42 +29,104 @@ void dir_init();
 /* Load the on-disk directory into memory. */
 void dir_load();
 
+/* Prepares the cache for a disk whose directory blocks are read in only
+   as entries are needed. [used] is the saved number of slots in use. */
+void dir_load_lazy(int used);
+
+/* Loads the copy of the directory stored at [start_block], such as a
+   snapshot's, in place of the live one. It must not be flushed. */
+void dir_load_copy(int start_block);
+
 /* Writes the contents of the cached directory to disk. */
 void dir_flush();
 
-/* Initializes an iterator for traversing the directory. */
-void dir_iter_begin();
+/* Returns the number of slots in use, to be saved for dir_load_lazy. */
+int dir_get_used();
+
+/* Returns the number of directory blocks read since the last load. */
+int dir_blocks_read();
+
+/* Returns the first used slot after [dir_index], or -1 to start from the
+   beginning, or ERR_NOT_FOUND past the last one. It keeps no state, so
+   several walks can be under way at once. */
+int dir_next(int dir_index);
+
+/* Points [slots] at the entries of the directory [parent], or DIR_ROOT,
+   sorted by name, and returns how many there are. The array belongs to
+   the cache and stays valid until an entry is created in or removed
+   from the directory, or the directory is loaded again. */
+int dir_sorted(int parent, int **slots);
 
-/* Returns true if there are no more elements left. */
-int dir_iter_done();
+/* Searches the directory [parent], or DIR_ROOT, for an entry with the
+   given name. Only the slots from the one the name hashes to up to the
+   first never used slot are read. Returns a directory index if found,
+   or else returns ERR_NOT_FOUND. */
+int dir_search(int parent, char *name);
 
-/* Sets the iterator to the next element. */
-void dir_iter_next();
+/* Creates a new, empty entry with the given name and DIR_* [flags] in
+   the directory [parent], which must not have one by that name yet. A
+   new file starts out with DIR_INLINE. Returns the directory index if
+   successful, or ERR_OUT_OF_SPACE if there is no space in the
+   directory. */
+int dir_create_entry(int parent, char *name, int flags);
 
-int dir_curr_iter();
+/* Returns the number of slots in the directory. */
+int dir_num_slots();
 
-/* Searches the directory for a file with the given name. Returns a
-   directory index if found, or else returns ERR_NOT_FOUND. */
-int dir_search(char *name);
+/* Returns true if the slot holds a file. */
+int dir_is_used(int dir_index);
 
-/* Creates a new file entry in the directory with the given name
-   and index to the FAT root for the file. Returns the directory
-   index if successful, or ERR_OUT_OF_SPACE if there is no space
-   in the directory. */
-int dir_create_entry(char *name);
+/* Returns the directory holding the entry, or DIR_ROOT. */
+int dir_get_parent(int dir_index);
 
-/* Returns the root fat index for the file pointed to by dir_index. */
+/* Returns the root fat index for the file pointed to by dir_index, or
+   END_OF_FILE for an inline file or a directory. */
 int dir_get_fat_root(int dir_index);
 
-/* Returns the name of the file pointed to by dir_index. */
+/* Points the file at a different FAT chain, making it a regular file
+   if it was inline. */
+void dir_set_fat_root(int dir_index, int fat_index);
+
+/* Returns where in its fragment block a packed tail starts. */
+int dir_get_tail_off(int dir_index);
+
+void dir_set_tail_off(int dir_index, int off);
+
+/* Returns the number of bytes of data the entry holds room for inline. */
+int dir_inline_capacity(int dir_index);
+
+/* Makes room for [n] bytes of inline data, growing the entry's record
+   if needed. Returns 0 if the record cannot be made that big, in which
+   case the data has to move out to blocks. */
+int dir_reserve_inline(int dir_index, long n);
+
+/* Copies [n] bytes at [off] of the entry's inline data into [dst]. */
+void dir_read_inline(int dir_index, int off, byte *dst, int n);
+
+/* Copies [n] bytes of [src], or zeros if it is NULL, to [off] of the
+   entry's inline data. */
+void dir_write_inline(int dir_index, int off, const byte *src, int n);
+
+/* Returns the name of the file pointed to by dir_index. It stays valid
+   until the entry's inline data grows or the entry is removed. */
 char *dir_get_name(int dir_index);
 
-/* Returns the size of the file pointed to by dir_index in bytes. */
+/* Returns the DIR_* flags of the file. */
+int dir_get_flags(int dir_index);
+
+void dir_set_flags(int dir_index, int flags);
+
+/* Returns the size of the file pointed to by dir_index in bytes. Sizes
+   are stored in 32 bits on disk, which the int offsets and lengths of
+   the API cannot go past. */
 long dir_get_size(int dir_index);
 
 /* Increment the size (in bytes) of the file pointed to by dir_index. */
 void dir_inc_size(int dir_index, long delta);
 
+/* Set the size (in bytes) of the file pointed to by dir_index. */
+void dir_set_size(int dir_index, long size);
+
 void dir_remove(int dir_index);
 
 #endif
\ No newline at end of file
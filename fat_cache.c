@@ -2,6 +2,10 @@
 #include "sfs_types.h"
 #include "sfs_constants.h"
 #include "free_block_list.h"
+#include "dedup.h"
+#include "refcount.h"
+#include "meta_region.h"
+#include "slab.h"
 
 #include "lib/disk_emu.h"
 
@@ -11,118 +15,403 @@
 typedef struct
 {
     byte used;
+    byte flags;
     int data_block;
     int next;
 } FatEntry;
 
+/* Entries allocated at a time by the cache. */
+#define FAT_POOL_CHUNK 512
+
 /* Number of fat entries should be equal to number of data blocks. */
 #define _FAT_BYTES (sizeof(FatEntry) * TOTAL_DATA_BLOCKS)
 #define _FAT_BLOCKS (_FAT_BYTES / BLOCK_SIZE)
 
 const int FAT_BYTES = _FAT_BYTES;
 const int FAT_BLOCKS = _FAT_BLOCKS;
-const int DATA_BLOCK_OFFSET = FAT_START + _FAT_BLOCKS + FREE_LIST_LEN;
+const int DATA_BLOCK_OFFSET = FAT_START + _FAT_BLOCKS + FREE_LIST_LEN +
+    REFCOUNT_LEN;
 
 #undef _FAT_BYTES
 #undef _FAT_BLOCKS
 
+static FatEntry *entry(int fat_index);
+static void touch(int fat_index);
+static void store_entry(int fat_index, byte *dst);
+static void clear_cache(int is_loaded);
+static void free_chain(int fat_index);
+static void unref_block(int data_block);
+static void free_block(int data_block);
+
 /* There can be at most as many FAT entries as there are data blocks. */
 static FatEntry *fat_table[TOTAL_DATA_BLOCKS];
 
+/* Whether fat_table[i] reflects the disk. Entries are read in on first
+   use after a lazy load. */
+static byte loaded[TOTAL_DATA_BLOCKS];
+static MetaRegion *region;
+
+/* Where the cached entries live. They are dropped all at once when the
+   cache is cleared. */
+static Slab *pool;
+
+/* Where the search for a free entry starts. Every entry below it is
+   known to be in use. */
+static int free_hint;
+
+void fat_init()
+{
+    clear_cache(1);
+    mr_reset(region);
+}
+
 void fat_load()
 {
-    const int len = sizeof(FatEntry);
-	int i;
-    byte *buf = malloc(FAT_BYTES), *ptr = buf;
-    read_blocks(FAT_START, FAT_BLOCKS, buf);
-    for (i = 0; i < FAT_BYTES; i += len, ptr += len)
-    {
-        // First byte tells us whether or not this slot is used.
-        if (buf[i] == 1) {
-            FatEntry *fat_entry = malloc(len);
-            memcpy(fat_entry, ptr, len);
-            fat_table[i / len] = fat_entry;
-        }
-    }
-    free(buf);
+    int i;
+    clear_cache(0);
+    mr_load_all(region);
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++)
+        entry(i);
 }
 
-void fat_flush()
+void fat_load_copy(int start_block)
 {
-	byte *buf = calloc(FAT_BYTES, 1), *ptr = buf;
     int i;
-    for (i = 0; i < TOTAL_DATA_BLOCKS; i++, ptr += sizeof(FatEntry)) {
-        FatEntry *f = fat_table[i];
-        if (f != NULL)
-            memcpy(ptr, f, sizeof(FatEntry));
-    }
+    clear_cache(0);
+    mr_relocate(region, start_block);
+    mr_load_all(region);
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++)
+        entry(i);
+}
 
-    write_blocks(FAT_START, FAT_BLOCKS, buf);
-    free(buf);
+int fat_image_data_block(const byte *image, int fat_index)
+{
+    FatEntry f;
+    memcpy(&f, image + (long) fat_index * sizeof(FatEntry), sizeof(FatEntry));
+    return f.used == 1 ? f.data_block : NO_DATA;
+}
+
+void fat_load_lazy(int hint)
+{
+    clear_cache(0);
+    mr_unload(region);
+    free_hint = hint;
+}
+
+void fat_flush()
+{
+    mr_flush(region, store_entry);
+}
+
+int fat_get_free_hint()
+{
+    return free_hint;
+}
+
+int fat_blocks_read()
+{
+    return mr_blocks_read(region);
 }
 
 int fat_create_entry()
 {
     int i;
-    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
-        if (fat_table[i] == NULL) break;
+    for (i = free_hint; i < TOTAL_DATA_BLOCKS; i++) {
+        if (entry(i) == NULL) break;
     }
 
+    free_hint = i;
     if (i == TOTAL_DATA_BLOCKS) return ERR_OUT_OF_SPACE;
 
-    FatEntry *fat = malloc(sizeof(FatEntry));
+    FatEntry *fat = slab_alloc(pool);
     fat->used = 1;
+    fat->flags = 0;
     fat->data_block = NO_DATA;
     fat->next = END_OF_FILE;
     fat_table[i] = fat;
+    touch(i);
 
     return i;
 }
 
+int fat_is_used(int fat_index)
+{
+    return entry(fat_index) != NULL;
+}
+
+void fat_drop_entry(int fat_index)
+{
+    slab_free(pool, entry(fat_index));
+    fat_table[fat_index] = NULL;
+    if (fat_index < free_hint)
+        free_hint = fat_index;
+    touch(fat_index);
+}
+
 int fat_get_tail(int fat_index)
 {
-    while (fat_table[fat_index]->next != END_OF_FILE) 
-        fat_index = fat_table[fat_index]->next;
+    while (entry(fat_index)->next != END_OF_FILE) 
+        fat_index = entry(fat_index)->next;
     return fat_index;
 }
 
 int fat_get_data_block(int fat_index)
 {
-    return fat_table[fat_index]->data_block;
+    return entry(fat_index)->data_block;
 }
 
 int fat_get_next_index(int fat_index)
 {
-    return fat_table[fat_index]->next;
+    return entry(fat_index)->next;
 }
 
 void fat_set_next_index(int fat_index, int next)
 {
-    fat_table[fat_index]->next = next;
+    entry(fat_index)->next = next;
+    touch(fat_index);
 }
 
-int fat_alloc_block(int fat_index)
+int fat_get_flags(int fat_index)
 {
-    // Find a free data block from the free list.
-    int db = fbl_get_free_index();
+    return entry(fat_index)->flags;
+}
 
-    if (db < 0) {
+void fat_set_flags(int fat_index, int flags)
+{
+    if (entry(fat_index)->flags == flags) return;
+    entry(fat_index)->flags = flags;
+    touch(fat_index);
+}
+
+int fat_alloc_block(int home, int fat_index)
+{
+    if (fat_alloc_blocks(home, &fat_index, 1) == 0)
         return ERR_OUT_OF_SPACE;
+    return 0;
+}
+
+int fat_alloc_blocks(int home, int *fat_indices, int n)
+{
+    int done = 0;
+    while (done < n) {
+        int got, i;
+        int db = home < 0 ? fbl_alloc_run(n - done, &got) :
+            fbl_alloc_run_in(home, n - done, &got);
+        if (db < 0) break;
+
+        for (i = 0; i < got; i++) {
+            entry(fat_indices[done + i])->data_block = db + i + DATA_BLOCK_OFFSET;
+            touch(fat_indices[done + i]);
+        }
+        done += got;
     }
 
-    fat_table[fat_index]->data_block = db + DATA_BLOCK_OFFSET;
+    return done;
+}
 
-    return 0;
+void fat_rebuild_free_list(const int *extra_refs)
+{
+    static int refs[TOTAL_DATA_BLOCKS];
+    int i;
+    memcpy(refs, extra_refs, sizeof(refs));
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+        if (entry(i) != NULL && fat_table[i]->data_block != NO_DATA)
+            refs[fat_table[i]->data_block - DATA_BLOCK_OFFSET]++;
+    }
+
+    fbl_init();
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+        // A block pinned by a read in flight is freed when unpinned.
+        if (refs[i] > 0 || rc_pinned(i))
+            fbl_mark_used(i);
+        else
+            dd_forget(i + DATA_BLOCK_OFFSET);
+        rc_set(i, refs[i]);
+    }
+}
+
+int fat_count_extents(int fat_root)
+{
+    int extents = 0, prev = NO_DATA, fat_index;
+    for (fat_index = fat_root; fat_index != END_OF_FILE;
+            fat_index = entry(fat_index)->next) {
+        int db = entry(fat_index)->data_block;
+        if (db != NO_DATA && db != prev + 1)
+            extents++;
+        prev = db;
+    }
+    return extents;
+}
+
+int fat_count_blocks(int fat_root)
+{
+    int blocks = 0, fat_index;
+    for (fat_index = fat_root; fat_index != END_OF_FILE;
+            fat_index = entry(fat_index)->next)
+        blocks += entry(fat_index)->data_block != NO_DATA;
+    return blocks;
+}
+
+void fat_relocate_block(int fat_index, int block)
+{
+    FatEntry *f = entry(fat_index);
+    unref_block(f->data_block);
+    f->data_block = block + DATA_BLOCK_OFFSET;
+    touch(fat_index);
+}
+
+int fat_is_shared(int fat_index)
+{
+    int db = entry(fat_index)->data_block;
+    return db != NO_DATA && (rc_get(db - DATA_BLOCK_OFFSET) > 1 ||
+        rc_pinned(db - DATA_BLOCK_OFFSET));
+}
+
+void fat_link_block(int fat_index, int data_block)
+{
+    FatEntry *f = entry(fat_index);
+    rc_ref(data_block - DATA_BLOCK_OFFSET);
+    unref_block(f->data_block);
+    f->data_block = data_block;
+    f->flags = 0;
+    touch(fat_index);
+}
+
+void fat_unref_block(int data_block)
+{
+    unref_block(data_block);
+}
+
+void fat_pin_block(int data_block)
+{
+    rc_pin(data_block - DATA_BLOCK_OFFSET);
+}
+
+void fat_unpin_block(int data_block)
+{
+    if (rc_unpin(data_block - DATA_BLOCK_OFFSET) == 0)
+        free_block(data_block);
+}
+
+void fat_release_block(int fat_index)
+{
+    FatEntry *f = entry(fat_index);
+    if (f->data_block == NO_DATA) return;
+    unref_block(f->data_block);
+    f->data_block = NO_DATA;
+    f->flags = 0;
+    touch(fat_index);
+}
+
+void fat_truncate(int fat_index)
+{
+    free_chain(entry(fat_index)->next);
+    entry(fat_index)->next = END_OF_FILE;
+    touch(fat_index);
 }
 
 void fat_clean_entry(int fat_root)
 {
-    int fat_index = fat_root;
+    free_chain(fat_root);
+}
+
+int fat_clone_chain(int fat_root)
+{
+    int root = END_OF_FILE, prev = END_OF_FILE, fat;
+    for (fat = fat_root; fat != END_OF_FILE; fat = entry(fat)->next) {
+        int copy = fat_create_entry();
+        if (copy == ERR_OUT_OF_SPACE) {
+            if (root != END_OF_FILE) free_chain(root);
+            return ERR_OUT_OF_SPACE;
+        }
+
+        FatEntry *f = entry(copy);
+        f->flags = entry(fat)->flags;
+        f->data_block = entry(fat)->data_block;
+        if (f->data_block != NO_DATA)
+            rc_ref(f->data_block - DATA_BLOCK_OFFSET);
+        if (prev == END_OF_FILE)
+            root = copy;
+        else
+            fat_set_next_index(prev, copy);
+        prev = copy;
+    }
+    return root;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Returns the cached entry, reading it from disk on first use. NULL
+   means the slot is free. */
+FatEntry *entry(int fat_index)
+{
+    if (!loaded[fat_index]) {
+        byte *raw = mr_record(region, fat_index);
+        // First byte tells us whether or not this slot is used.
+        if (raw[0] == 1) {
+            fat_table[fat_index] = slab_alloc(pool);
+            memcpy(fat_table[fat_index], raw, sizeof(FatEntry));
+        }
+        loaded[fat_index] = 1;
+    }
+    return fat_table[fat_index];
+}
+
+void touch(int fat_index)
+{
+    mr_touch(region, fat_index);
+}
+
+void store_entry(int fat_index, byte *dst)
+{
+    if (!loaded[fat_index]) return;
+    if (fat_table[fat_index] == NULL)
+        memset(dst, 0, sizeof(FatEntry));
+    else
+        memcpy(dst, fat_table[fat_index], sizeof(FatEntry));
+}
+
+/* Drops every cached entry. [is_loaded] says whether the now empty
+   slots are known to be free or still have to be read from disk. */
+void clear_cache(int is_loaded)
+{
+    if (region == NULL) {
+        region = mr_create(FAT_START, FAT_BLOCKS, sizeof(FatEntry));
+        pool = slab_create(sizeof(FatEntry), FAT_POOL_CHUNK);
+    }
+    mr_relocate(region, FAT_START);
+    slab_release(pool);
+    memset(fat_table, 0, sizeof(fat_table));
+    memset(loaded, is_loaded, sizeof(loaded));
+    free_hint = 0;
+}
+
+void free_chain(int fat_index)
+{
     while (fat_index != END_OF_FILE) {
-        FatEntry *f = fat_table[fat_index];
-        fbl_set_free_index(f->data_block);
+        FatEntry *f = entry(fat_index);
+        fat_release_block(fat_index);
         fat_table[fat_index] = NULL;
+        if (fat_index < free_hint)
+            free_hint = fat_index;
+        touch(fat_index);
         fat_index = f->next;
-        free(f);
+        slab_free(pool, f);
     }
-}
\ No newline at end of file
+}
+
+/* Drops one reference to the data block and frees it once nothing
+   points to it any more. */
+void unref_block(int data_block)
+{
+    if (data_block == NO_DATA) return;
+    if (rc_unref(data_block - DATA_BLOCK_OFFSET) == 0)
+        free_block(data_block);
+}
+
+/* Returns a block that lost its last reference to the free list. */
+void free_block(int data_block)
+{
+    dd_forget(data_block);
+    fbl_set_free_index(data_block - DATA_BLOCK_OFFSET);
+}
@@ -2,6 +2,15 @@
 #define __FAT_CACHE_H
 
 #include "sfs_errors.h"
+#include "sfs_types.h"
+
+/* The entry's data block is reserved but has never been written, so
+   its contents must read as zeros. */
+#define FAT_UNWRITTEN 0x01
+
+/* The entry starts a compressed cluster, whose data is packed into the
+   data blocks of the cluster's first entries. */
+#define FAT_COMPRESSED 0x02
 
 /* Initialize the cache. */
 void fat_init();
@@ -9,6 +18,25 @@ void fat_init();
 /* Load the on-disk FAT into memory. */
 void fat_load();
 
+/* Prepares the cache for a disk whose FAT blocks are read in only as
+   entries are needed. [hint] is a previously saved free entry hint. */
+void fat_load_lazy(int hint);
+
+/* Returns an entry index below which every entry is in use, to be saved
+   for fat_load_lazy. */
+int fat_get_free_hint();
+
+/* Loads the copy of the FAT stored at [start_block], such as a
+   snapshot's, in place of the live one. It must not be flushed. */
+void fat_load_copy(int start_block);
+
+/* Returns the data block of entry [fat_index] in [image], a copy of the
+   on-disk FAT, or NO_DATA if the entry is free or has none. */
+int fat_image_data_block(const byte *image, int fat_index);
+
+/* Returns the number of FAT blocks read since the last load. */
+int fat_blocks_read();
+
 /* Writes the contents of the cached FAT to disk. */
 void fat_flush();
 
@@ -18,6 +46,13 @@ void fat_flush();
    more room in the table. */
 int fat_create_entry();
 
+/* Returns true if the entry is in use. */
+int fat_is_used(int fat_index);
+
+/* Frees the entry alone, leaving its data block and the rest of its
+   chain alone. Used to reclaim entries that nothing points to. */
+void fat_drop_entry(int fat_index);
+
 /* Traverses the chain of FAT entries starting at fat_index,
    returning the final index in the chain. */
 int fat_get_tail(int fat_index);
@@ -31,8 +66,78 @@ int fat_get_next_index(int fat_index);
 /* Set the next fat index in the chain. */
 void fat_set_next_index(int fat_index, int next);
 
-int fat_alloc_block(int fat_index);
+/* Returns the FAT_* flags of the entry. */
+int fat_get_flags(int fat_index);
+
+/* Replaces the FAT_* flags of the entry. */
+void fat_set_flags(int fat_index, int flags);
+
+/* Attaches a free data block to the entry, from the allocation group
+   [home] when it has one free, as fat_alloc_blocks does. Returns 0 on
+   success or ERR_OUT_OF_SPACE. */
+int fat_alloc_block(int home, int fat_index);
+
+/* Attaches data blocks to the [n] entries in order, placing them in as
+   few physically contiguous runs as the free list allows. Returns the
+   number of entries that got a block. The blocks come from allocation
+   group [home] while it has room, or from the first fit on the whole
+   volume if [home] is negative. */
+int fat_alloc_blocks(int home, int *fat_indices, int n);
 
+/* Points the entry at the already reserved data block [block], counted
+   from the start of the data region, and frees its old block. The
+   caller copies the data across first. */
+void fat_relocate_block(int fat_index, int block);
+
+/* Returns true if the entry's data block is also referenced by other
+   entries or pinned by a read in flight, so it must be copied before it
+   is written. */
+int fat_is_shared(int fat_index);
+
+/* Points the entry at [data_block], as returned by fat_get_data_block,
+   taking a reference to it and dropping the one to its old block. */
+void fat_link_block(int fat_index, int data_block);
+
+/* Drops one reference to [data_block], as returned by
+   fat_get_data_block, freeing the block when none are left. Used after
+   an entry has been pointed elsewhere by fat_alloc_blocks. */
+void fat_unref_block(int data_block);
+
+/* Pins [data_block] while it is read without the file system lock, so
+   that it is not freed or written in place under the reader. */
+void fat_pin_block(int data_block);
+
+/* Drops a pin, freeing the block if its file let go of it meanwhile. */
+void fat_unpin_block(int data_block);
+
+/* Drops the entry's reference to its data block, leaving a hole. The
+   block goes back to the free list unless other entries share it. */
+void fat_release_block(int fat_index);
+
+/* Frees every entry after fat_index in its chain, along with their data
+   blocks, making fat_index the tail. */
+void fat_truncate(int fat_index);
+
+/* Frees the whole chain starting at fat_root, along with its data
+   blocks. */
 void fat_clean_entry(int fat_root);
 
+/* Builds a new chain with the same data blocks and flags as the one
+   starting at fat_root, taking a reference to each block. Returns the
+   new root, or ERR_OUT_OF_SPACE with nothing changed. */
+int fat_clone_chain(int fat_root);
+
+/* Rebuilds the free list and the reference counts from scratch, marking
+   exactly the data blocks referenced by FAT entries as used. Each block
+   also has [extra_refs] references from outside the FAT. */
+void fat_rebuild_free_list(const int *extra_refs);
+
+/* Returns the number of physically contiguous runs of data blocks in
+   the chain starting at fat_root. */
+int fat_count_extents(int fat_root);
+
+/* Returns the number of entries in the chain starting at fat_root that
+   have a data block. */
+int fat_count_blocks(int fat_root);
+
 #endif
\ No newline at end of file
@@ -3,44 +3,135 @@
 #include "sfs_constants.h"
 #include "dir_cache.h"
 #include "fat_cache.h"
+#include "compress.h"
+#include "dedup.h"
+#include "fragment.h"
+#include "free_block_list.h"
+#include "slab.h"
 
 #include "lib/disk_emu.h"
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
 #define MIN(a, b) (a < b ? a : b)
+#define MAX(a, b) (a > b ? a : b)
 #define MAX_OPEN 1000
 
+/* Compressed files are stored in clusters of this many logical blocks,
+   each compressed on its own so that any offset can be reached by
+   walking the chain to the start of its cluster. */
+#define CLUSTER_BLOCKS 8
+#define CLUSTER_BYTES (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+/* A compressed cluster starts with the length of the compressed data. */
+#define CLUSTER_HEADER 2
+
+/* The block map of an open file is kept in pages of this many FAT
+   indices, allocated as the file is walked. */
+#define MAP_PAGE 128
+#define MAP_PAGES ((TOTAL_DATA_BLOCKS + MAP_PAGE - 1) / MAP_PAGE)
+
+/* sfs_copy_range moves data in chunks of this many blocks, reading the
+   next chunk while the current one is written. */
+#define COPY_CHUNK_BLOCKS 32
+#define COPY_CHUNK_BYTES (COPY_CHUNK_BLOCKS * BLOCK_SIZE)
+
+/* Descriptors and block map pages allocated at a time. */
+#define DESC_POOL_CHUNK 16
+#define PAGE_POOL_CHUNK 16
+
+/* A position in an open file. [curr_fat] caches the fat index of
+   logical block [curr_block] so that sequential access does not have
+   to walk the chain from the root every time. */
 typedef struct
 {
-
+    long offset;
     int curr_fat;
-    uint16_t byte_address;
+    int curr_block;
 } FilePtr;
 
 typedef struct 
 {
     uint16_t fat_root;
-    char name[MAX_NAME_LEN];
+    int dir_index;
+    /* The allocation group the file's data blocks are taken from. */
+    int home;
     FilePtr read_ptr, write_ptr;    
+
+    /* Appends waiting to be written at write_ptr, or NULL when the
+       descriptor is not buffered. */
+    byte *wbuf;
+    int wbuf_cap;
+    int wbuf_len;
+
+    /* The fat index of each of the first [mapped] logical blocks, so
+       that a block seen once is found again without walking the chain.
+       Two lookups at most, like an inode with one level of indirection. */
+    int *block_map[MAP_PAGES];
+    int mapped;
 } FileDescriptor;
 
-static void write_data_block(FileDescriptor *f, byte **ptr, int length);
-static void read_data_block(FileDescriptor *f, byte **ptr, int length);
+/* One chunk of a copy, read in on a thread of its own. */
+typedef struct
+{
+    ReadPlan plan;
+    byte *buf;
+    pthread_t thread;
+} CopyChunk;
+
+static FileDescriptor *get_desc(int fileID);
+static int seek_block(FileDescriptor *f, FilePtr *p, int block, int extend);
+static int iov_total(SfsIoVec *iov, int iovcnt);
+static void iov_copy(byte *dst, SfsIoVec *iov, int iovcnt, int skip, int n);
+static int write_iov(FileDescriptor *f, SfsIoVec *iov, int iovcnt);
+static int buffered_write(FileDescriptor *f, SfsIoVec *iov, int iovcnt);
+static int commit(FileDescriptor *f);
+static void zero_range(int home, int fat, int from, int to);
+static void write_runs(int *dbs, int nblocks, byte *buf);
+static void dedup_blocks(int *fats, int *dbs, int nblocks, byte *buf);
+static int contains(int *dbs, int nblocks, int db);
+static void read_runs(int *dbs, int nblocks, byte *buf);
+static int is_compressed(FileDescriptor *f);
+static int is_inline(FileDescriptor *f);
+static int spill(FileDescriptor *f);
+static void pack_tail(FileDescriptor *f);
+static int unpack_tail(FileDescriptor *f);
+static int move_tail(int home, int tail, int off, int len);
+static void init_desc(FileDescriptor *desc, int dir_index);
+static int plan_read(FileDescriptor *f, FilePtr *p, int length,
+    ReadPlan *plan);
+static FileDescriptor *new_desc();
+static void free_desc(FileDescriptor *desc);
+static void map_block(FileDescriptor *f, int block, int fat);
+static void unmap_from(FileDescriptor *f, int block);
+static void *read_ahead(void *chunk);
+static void load_cluster(FileDescriptor *f, FilePtr *p, int c, byte *buf);
+static int store_cluster(FileDescriptor *f, FilePtr *p, int c, byte *buf,
+    int len);
+static void read_clusters(FileDescriptor *f, long off, int length,
+    byte *dst);
+static int write_clusters(FileDescriptor *f, long off, int length,
+    byte *src);
 
 static FileDescriptor *fdesc_table[MAX_OPEN];
 
-int fdesc_search(char *name)
+/* Where descriptors and their block map pages come from. Both are
+   released in bulk once every file is closed. */
+static Slab *desc_pool;
+static Slab *page_pool;
+
+int fdesc_search(int dir_index)
 {
     int i;
     for (i = 0; i < MAX_OPEN; i++) {
         if (fdesc_table[i] == NULL) {
             continue;
         }
-        if (strncmp(name, fdesc_table[i]->name, MAX_NAME_LEN) == 0) {
+        if (fdesc_table[i]->dir_index == dir_index) {
             return i;
         }
     }
@@ -57,16 +148,8 @@ int fdesc_create(int dir_index)
 
     if (i == MAX_OPEN) return ERR_MAX_OPEN;
 
-    int fat_index = dir_get_fat_root(dir_index);
-
-    FileDescriptor *desc = malloc(sizeof(FileDescriptor));
-    strncpy(desc->name, dir_get_name(dir_index), MAX_NAME_LEN);
-    desc->fat_root = fat_index;
-    desc->read_ptr.curr_fat = fat_index;
-    desc->read_ptr.byte_address = 0;
-    desc->write_ptr.curr_fat = fat_get_tail(fat_index);
-    desc->write_ptr.byte_address = dir_get_size(dir_index) % BLOCK_SIZE;
-
+    FileDescriptor *desc = new_desc();
+    init_desc(desc, dir_index);
     fdesc_table[i] = desc;
 
     return i;
@@ -74,148 +157,1228 @@ int fdesc_create(int dir_index)
 
 int fdesc_remove(int fileID)
 {
-    if (fileID >= MAX_OPEN || fileID < 0) return ERR_NOT_FOUND;
-    FileDescriptor *f = fdesc_table[fileID];
+    FileDescriptor *f = get_desc(fileID);
     if (f == NULL) return ERR_NOT_FOUND;
-    free(f);
+    commit(f);
+    if (frag_enabled())
+        pack_tail(f);
+    free_desc(f);
     fdesc_table[fileID] = NULL;
     return 0;
 }
 
+void fdesc_remove_all()
+{
+    int i;
+    for (i = 0; i < MAX_OPEN; i++)
+        fdesc_remove(i);
+    if (desc_pool != NULL) {
+        slab_release(desc_pool);
+        slab_release(page_pool);
+    }
+}
+
 int fdesc_write(int fileID, char *buf, int length)
 {
-    if (fileID >= MAX_OPEN || fileID < 0) return ERR_NOT_FOUND;
-    FileDescriptor *f = fdesc_table[fileID];
+    SfsIoVec iov = {buf, length};
+    return fdesc_writev(fileID, &iov, 1);
+}
+
+int fdesc_read(int fileID, char *buf, int length)
+{
+    SfsIoVec iov = {buf, length};
+    return fdesc_readv(fileID, &iov, 1);
+}
+
+int fdesc_writev(int fileID, SfsIoVec *iov, int iovcnt)
+{
+    FileDescriptor *f = get_desc(fileID);
     if (f == NULL) return ERR_NOT_FOUND;
 
-    int curr_fat = f->write_ptr.curr_fat;
-    int curr_db = fat_get_data_block(curr_fat);
-
-    byte *ptr = (byte*) buf;
-    int num_init_write = 0;
-    /* If write pointer is in the middle of a block, fill up
-       the block first. We need to treat this case specially because
-       we have to read existing data. */
-    if (f->write_ptr.byte_address > 0) {
-        byte tmp[BLOCK_SIZE] = {0};
-        read_blocks(curr_db, 1, tmp);
-        int fill = BLOCK_SIZE - f->write_ptr.byte_address;
-        num_init_write = MIN(length, fill);
-        memcpy(tmp + f->write_ptr.byte_address, ptr, num_init_write);
-        ptr += num_init_write;
-        write_blocks(curr_db, 1, tmp);
-        f->write_ptr.byte_address += num_init_write;
-    }
-
-    int bytes_left = length - num_init_write;
-
-    while (bytes_left > 0) {
-        if (f->write_ptr.byte_address == BLOCK_SIZE) {
-            f->write_ptr.byte_address = 0;
-            int next;
-            // Prepare next fat entry if there is still data to write.
-            if (fat_get_next_index(f->write_ptr.curr_fat) == END_OF_FILE && bytes_left > 0) {
-                next = fat_create_entry();
-                if (next == ERR_OUT_OF_SPACE) {
-                    puts("Could not allocate new fat entry. Not writing further data.");
-                    goto updateSize;
-                }
-                fat_set_next_index(f->write_ptr.curr_fat, next);
-            }
-            f->write_ptr.curr_fat = next;
-            curr_db = fat_get_data_block(f->write_ptr.curr_fat);
+    if (f->wbuf != NULL)
+        return buffered_write(f, iov, iovcnt);
+    return write_iov(f, iov, iovcnt);
+}
+
+int fdesc_readv(int fileID, SfsIoVec *iov, int iovcnt)
+{
+    ReadPlan plan;
+    int result = fdesc_plan_read(fileID, iov_total(iov, iovcnt), &plan);
+    if (result <= 0) return result;
+    return fdesc_exec_read(&plan, iov, iovcnt);
+}
+
+int fdesc_plan_read(int fileID, int length, ReadPlan *plan)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    commit(f);
+    return plan_read(f, &f->read_ptr, length, plan);
+}
+
+int fdesc_plan_read_at(int fileID, long off, int length, ReadPlan *plan)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    if (off < 0) return ERR_UNKNOWN;
+    commit(f);
+
+    FilePtr p = f->read_ptr;
+    p.offset = off;
+    int result = plan_read(f, &p, length, plan);
+    if (result > 0 && plan->dbs != NULL) {
+        int i;
+        for (i = 0; i < plan->nblocks; i++) {
+            if (plan->dbs[i] != NO_DATA)
+                fat_pin_block(plan->dbs[i]);
         }
+        plan->pinned = 1;
+    }
+    return result;
+}
 
-        if (curr_db == NO_DATA) {
-            if (fat_alloc_block(f->write_ptr.curr_fat) == ERR_OUT_OF_SPACE) {
-                puts("Could not allocate block. Not writing further data.");
-                goto updateSize;
-            }
+int fdesc_exec_read(ReadPlan *plan, SfsIoVec *iov, int iovcnt)
+{
+    byte *stage = plan->data;
+    if (stage == NULL) {
+        stage = malloc(plan->nblocks * BLOCK_SIZE);
+        read_runs(plan->dbs, plan->nblocks, stage);
+        if (plan->tail_off > 0) {
+            byte *last = stage + (plan->nblocks - 1) * BLOCK_SIZE;
+            memmove(last, last + plan->tail_off, BLOCK_SIZE - plan->tail_off);
         }
-        
-        int bytes = MIN(bytes_left, BLOCK_SIZE);
-        write_data_block(f, &ptr, bytes);
-        bytes_left -= bytes;
     }
 
-    goto updateSize;
-updateSize:
-    dir_inc_size(dir_search(f->name), length - bytes_left);
-    return 0;
+    byte *ptr = stage + plan->skip;
+    int left = plan->length, i;
+    for (i = 0; i < iovcnt && left > 0; i++) {
+        int bytes = MIN(iov[i].len, left);
+        memcpy(iov[i].base, ptr, bytes);
+        ptr += bytes;
+        left -= bytes;
+    }
+
+    free(stage);
+    if (!plan->pinned) {
+        free(plan->dbs);
+        plan->dbs = NULL;
+    }
+    plan->data = NULL;
+    return plan->length;
 }
 
-int fdesc_read(int fileID, char *buf, int length)
+void fdesc_unpin_read(ReadPlan *plan)
+{
+    int i;
+    for (i = 0; i < plan->nblocks; i++) {
+        if (plan->dbs[i] != NO_DATA)
+            fat_unpin_block(plan->dbs[i]);
+    }
+    free(plan->dbs);
+    plan->dbs = NULL;
+    plan->pinned = 0;
+}
+
+int fdesc_read_at(int fileID, long off, byte *buf, int length)
 {
-    if (fileID >= MAX_OPEN || fileID < 0) return ERR_NOT_FOUND;
-    FileDescriptor *f = fdesc_table[fileID];
+    FileDescriptor *f = get_desc(fileID);
     if (f == NULL) return ERR_NOT_FOUND;
+    long saved = f->read_ptr.offset;
+    f->read_ptr.offset = off;
+    int read = fdesc_read(fileID, (char*) buf, length);
+    f->read_ptr.offset = saved;
+    return read;
+}
 
-    byte *ptr = (byte*) buf;
-    int bytes_left = length;
+int fdesc_write_at(int fileID, long off, const byte *buf, int length)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    commit(f);
+    long saved = f->write_ptr.offset;
+    f->write_ptr.offset = off;
+    SfsIoVec iov = {(char*) buf, length};
+    int written = write_iov(f, &iov, 1);
+    f->write_ptr.offset = saved;
+    return written;
+}
 
-    while (bytes_left > 0) {
-        if (f->read_ptr.byte_address == BLOCK_SIZE) {
-            f->read_ptr.byte_address = 0;
+int fdesc_seek(int fileID, int loc)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    commit(f);
 
-            if (fat_get_next_index(f->read_ptr.curr_fat) == END_OF_FILE) {
-                return ERR_UNKNOWN;
-            }
+    /* The cached chain positions stay valid; they are only used as a
+       starting point when they precede the block being looked up. */
+    f->read_ptr.offset = loc;
+    f->write_ptr.offset = loc;
+    return 0;
+}
+
+int fdesc_allocate(int fileID, long offset, long len)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    if (len <= 0 || offset < 0) return 0;
+    if (is_compressed(f)) return ERR_UNKNOWN;
+    commit(f);
+
+    // An inline file's entry grows to hold the range, if it can.
+    if (is_inline(f)) {
+        if (dir_reserve_inline(f->dir_index, offset + len)) return 0;
+        if (spill(f) != 0) return ERR_OUT_OF_SPACE;
+    }
+    if (unpack_tail(f) != 0) return ERR_OUT_OF_SPACE;
 
-            f->read_ptr.curr_fat = fat_get_next_index(f->read_ptr.curr_fat);
+    int first = offset / BLOCK_SIZE;
+    int nblocks = (offset + len - 1) / BLOCK_SIZE - first + 1;
+    int *missing = malloc(nblocks * sizeof(int));
+    int i, need = 0, result = 0;
+    FilePtr p = f->write_ptr;
+
+    for (i = 0; i < nblocks; i++) {
+        int fat = seek_block(f, &p, first + i, 1);
+        if (fat == ERR_OUT_OF_SPACE) {
+            result = ERR_OUT_OF_SPACE;
+            break;
         }
-        
-        if (f->read_ptr.curr_fat == END_OF_FILE || fat_get_data_block(f->read_ptr.curr_fat) == NO_DATA) {
-            return ERR_UNKNOWN;
+        if (fat_get_data_block(fat) == NO_DATA)
+            missing[need++] = fat;
+    }
+
+    int got = fat_alloc_blocks(f->home, missing, need);
+    for (i = 0; i < got; i++)
+        fat_set_flags(missing[i], fat_get_flags(missing[i]) | FAT_UNWRITTEN);
+    if (got < need)
+        result = ERR_OUT_OF_SPACE;
+
+    free(missing);
+    return result;
+}
+
+int fdesc_truncate(int fileID, long length)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    if (length < 0) return ERR_UNKNOWN;
+    commit(f);
+
+    long size = dir_get_size(f->dir_index);
+    if (is_inline(f)) {
+        if (dir_reserve_inline(f->dir_index, length)) {
+            // Inline bytes past the end are kept zero, so growing is free.
+            if (length < size)
+                dir_write_inline(f->dir_index, length, NULL, size - length);
+            dir_set_size(f->dir_index, length);
+            return 0;
         }
+        if (spill(f) != 0) return ERR_OUT_OF_SPACE;
+    }
+    if (unpack_tail(f) != 0) return ERR_OUT_OF_SPACE;
 
-        int bytes = MIN(bytes_left, BLOCK_SIZE);
-        if (bytes > BLOCK_SIZE - f->read_ptr.byte_address) {
-            bytes = BLOCK_SIZE - f->read_ptr.byte_address;
+    int keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    FilePtr p = {0, f->fat_root, 0};
+
+    /* A compressed cluster cut in two is read in before the chain is
+       cut, since its data may sit in the entries being freed, and is
+       stored again afterwards. */
+    byte *cluster = NULL;
+    int tail = length % CLUSTER_BYTES;
+    if (is_compressed(f) && length < size && tail != 0) {
+        FilePtr q = p;
+        cluster = calloc(1, CLUSTER_BYTES);
+        load_cluster(f, &q, length / CLUSTER_BYTES, cluster);
+        memset(cluster + tail, 0, CLUSTER_BYTES - tail);
+    }
+
+    /* Only the part of the chain past the new end is walked and freed.
+       The root entry always stays since the directory points at it. */
+    if (keep == 0) {
+        fat_release_block(f->fat_root);
+        fat_truncate(f->fat_root);
+    }
+    else {
+        int last = seek_block(f, &p, keep - 1, 0);
+        if (last != END_OF_FILE) {
+            fat_truncate(last);
+            if (length < size && length % BLOCK_SIZE != 0 && cluster == NULL)
+                zero_range(f->home, last, length % BLOCK_SIZE, BLOCK_SIZE);
         }
-        read_data_block(f, &ptr, bytes);
-        bytes_left -= bytes;
+    }
+    unmap_from(f, MAX(keep, 1));
+    if (cluster != NULL) {
+        FilePtr q = {0, f->fat_root, 0};
+        store_cluster(f, &q, length / CLUSTER_BYTES, cluster, tail);
+        free(cluster);
     }
 
+    if (f->read_ptr.curr_block >= keep) {
+        f->read_ptr.curr_fat = f->fat_root;
+        f->read_ptr.curr_block = 0;
+    }
+    if (f->write_ptr.curr_block >= keep) {
+        f->write_ptr.curr_fat = f->fat_root;
+        f->write_ptr.curr_block = 0;
+    }
+
+    dir_set_size(f->dir_index, length);
     return 0;
 }
 
-int fdesc_seek(int fileID, int loc)
+int fdesc_punch(int fileID, long offset, long len)
 {
-    if (fileID >= MAX_OPEN || fileID < 0) return ERR_NOT_FOUND;
-    FileDescriptor *f = fdesc_table[fileID];
+    FileDescriptor *f = get_desc(fileID);
     if (f == NULL) return ERR_NOT_FOUND;
+    commit(f);
 
-    int fat_index = f->fat_root;
-    int num_blocks = loc / BLOCK_SIZE, i;
+    long size = dir_get_size(f->dir_index);
+    long end = offset + len;
+    if (end > size) end = size;
+    if (offset < 0 || offset >= end) return 0;
 
-    for (i = 0; (i < num_blocks && fat_index != END_OF_FILE); i++) {
-        fat_index = fat_get_next_index(fat_index);
+    if (is_inline(f)) {
+        dir_write_inline(f->dir_index, offset, NULL, end - offset);
+        return 0;
+    }
+    if (unpack_tail(f) != 0) return ERR_OUT_OF_SPACE;
+    if (is_compressed(f)) {
+        write_clusters(f, offset, end - offset, NULL);
+        return 0;
     }
 
-    f->read_ptr.curr_fat = fat_index;
-    f->write_ptr.curr_fat = fat_index;
+    FilePtr p = {0, f->fat_root, 0};
+    int block;
+    for (block = offset / BLOCK_SIZE; block <= (end - 1) / BLOCK_SIZE; block++) {
+        int fat = seek_block(f, &p, block, 0);
+        if (fat == END_OF_FILE) break;
+
+        long start = (long) block * BLOCK_SIZE;
+        int from = offset > start ? offset - start : 0;
+        int to = end < start + BLOCK_SIZE ? end - start : BLOCK_SIZE;
+        if (from == 0 && to == BLOCK_SIZE)
+            fat_release_block(fat);
+        else
+            zero_range(f->home, fat, from, to);
+    }
+
+    return 0;
+}
+
+int fdesc_set_buffer(int fileID, int nblocks)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+
+    int result = commit(f);
+    free(f->wbuf);
+    f->wbuf = nblocks > 0 ? malloc(nblocks * BLOCK_SIZE) : NULL;
+    f->wbuf_cap = nblocks > 0 ? nblocks * BLOCK_SIZE : 0;
+    return result;
+}
 
-    f->read_ptr.byte_address = (loc % BLOCK_SIZE);
-    f->write_ptr.byte_address = (loc % BLOCK_SIZE);
+int fdesc_buffered(int fileID)
+{
+    FileDescriptor *f = get_desc(fileID);
+    return f == NULL ? 0 : f->wbuf_len;
+}
+
+int fdesc_set_compression(int fileID, int on)
+{
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    commit(f);
+    if (dir_get_size(f->dir_index) > 0) return ERR_UNKNOWN;
+    if (on && is_inline(f) && spill(f) != 0) return ERR_OUT_OF_SPACE;
+
+    int flags = dir_get_flags(f->dir_index);
+    dir_set_flags(f->dir_index,
+        on ? flags | DIR_COMPRESSED : flags & ~DIR_COMPRESSED);
     return 0;
 }
 
-void write_data_block(FileDescriptor *f, byte **ptr, int length)
+int fdesc_sync(int fileID)
 {
-    byte tmp[BLOCK_SIZE] = {0};
-    memcpy(tmp, *ptr, length);
-    int db = fat_get_data_block(f->write_ptr.curr_fat);
-    write_blocks(db, 1, *ptr);
-    f->write_ptr.byte_address += length;
-    (*ptr) += length;
+    FileDescriptor *f = get_desc(fileID);
+    if (f == NULL) return ERR_NOT_FOUND;
+    return commit(f);
 }
 
-void read_data_block(FileDescriptor *f, byte **ptr, int length)
+void fdesc_sync_all()
 {
-    byte tmp[BLOCK_SIZE] = {0};
-    int db = fat_get_data_block(f->read_ptr.curr_fat);
+    int i;
+    for (i = 0; i < MAX_OPEN; i++)
+        fdesc_sync(i);
+}
+
+void fdesc_reload_all()
+{
+    int i;
+    for (i = 0; i < MAX_OPEN; i++) {
+        FileDescriptor *f = fdesc_table[i];
+        if (f == NULL) continue;
+        f->fat_root = dir_get_fat_root(f->dir_index);
+        f->read_ptr.curr_fat = END_OF_FILE;
+        f->write_ptr.curr_fat = END_OF_FILE;
+        unmap_from(f, 0);
+    }
+}
+
+/**
+ * The clone's chain shares every data block of the source, so only FAT
+ * entries are written. A packed tail is the exception: it is moved to a
+ * block of its own, as the fragment table tracks one file per tail. An
+ * inline file is copied through the write path, which spills it to a
+ * block if the clone's longer name leaves too little room in the entry.
+*/
+int fdesc_clone(int src_index, int dst_index)
+{
+    int flags = dir_get_flags(src_index);
+    long size = dir_get_size(src_index);
+
+    if (flags & DIR_INLINE) {
+        FileDescriptor *d = new_desc();
+        byte buf[MAX_NAME_LEN];
+        dir_read_inline(src_index, 0, buf, size);
+        init_desc(d, dst_index);
+        SfsIoVec iov = {(char*) buf, size};
+        int written = write_iov(d, &iov, 1);
+        free_desc(d);
+        return written == size ? 0 : ERR_OUT_OF_SPACE;
+    }
+
+    int root = fat_clone_chain(dir_get_fat_root(src_index));
+    if (root == ERR_OUT_OF_SPACE) return ERR_OUT_OF_SPACE;
+    if (flags & DIR_PACKED) {
+        int len = size % BLOCK_SIZE, off = dir_get_tail_off(src_index);
+        int home = fbl_home_group(dst_index);
+        if (move_tail(home, fat_get_tail(root), off, len) != 0) {
+            fat_clean_entry(root);
+            return ERR_OUT_OF_SPACE;
+        }
+    }
+
+    dir_set_fat_root(dst_index, root);
+    dir_set_flags(dst_index, flags & ~DIR_PACKED);
+    dir_set_size(dst_index, size);
+    return 0;
+}
+
+/**
+ * Two chunk buffers are used in turn: while one is written to the
+ * destination, the next chunk of the source is read into the other on
+ * a helper thread. Only the device reads run on that thread; the read is
+ * planned here, with the caches, before it starts. Writes to the
+ * destination do not change the source's blocks, as a block the two
+ * files share is copied before it is written. Within one file the
+ * ranges must not overlap, and the chunks are copied one at a time.
+*/
+int fdesc_copy_range(int src_id, long src_off, int dst_id, long dst_off,
+    long len)
+{
+    FileDescriptor *s = get_desc(src_id), *d = get_desc(dst_id);
+    if (s == NULL || d == NULL) return ERR_NOT_FOUND;
+    if (src_off < 0 || dst_off < 0) return ERR_UNKNOWN;
+    commit(s);
+    commit(d);
+
+    long size = dir_get_size(s->dir_index);
+    if (src_off + len > size) len = size - src_off;
+    if (len <= 0) return 0;
+    if (s == d && src_off < dst_off + len && dst_off < src_off + len)
+        return ERR_UNKNOWN;
+    if (!is_compressed(d))
+        fdesc_allocate(dst_id, dst_off, len);
+
+    long read_off = s->read_ptr.offset, write_off = d->write_ptr.offset;
+    s->read_ptr.offset = src_off;
+    d->write_ptr.offset = dst_off;
+
+    CopyChunk chunks[2];
+    chunks[0].buf = malloc(COPY_CHUNK_BYTES);
+    chunks[1].buf = malloc(COPY_CHUNK_BYTES);
+    long planned = fdesc_plan_read(src_id, MIN(len, COPY_CHUNK_BYTES),
+        &chunks[0].plan);
+    pthread_create(&chunks[0].thread, NULL, read_ahead, &chunks[0]);
+
+    long done = 0;
+    int i;
+    for (i = 0; done < len; i ^= 1) {
+        CopyChunk *c = &chunks[i], *next = &chunks[i ^ 1];
+        pthread_join(c->thread, NULL);
+        int bytes = c->plan.length;
+
+        int more = planned < len;
+        if (more) {
+            planned += fdesc_plan_read(src_id,
+                MIN(len - planned, COPY_CHUNK_BYTES), &next->plan);
+            if (s != d)
+                pthread_create(&next->thread, NULL, read_ahead, next);
+        }
+
+        SfsIoVec iov = {(char*) c->buf, bytes};
+        int written = write_iov(d, &iov, 1);
+        done += written;
+        if (more && s == d)
+            pthread_create(&next->thread, NULL, read_ahead, next);
+        if (written < bytes) {
+            if (more) pthread_join(next->thread, NULL);
+            break;
+        }
+    }
+
+    s->read_ptr.offset = read_off;
+    d->write_ptr.offset = write_off;
+    free(chunks[0].buf);
+    free(chunks[1].buf);
+    return done;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Reads a planned chunk of a copy into its buffer. */
+void *read_ahead(void *chunk)
+{
+    CopyChunk *c = chunk;
+    SfsIoVec iov = {(char*) c->buf, c->plan.length};
+    fdesc_exec_read(&c->plan, &iov, 1);
+    return NULL;
+}
+
+/**
+ * Resolves [length] bytes at [p] into [plan] and advances [p]. Inline
+ * and compressed files are copied out right away; other files are
+ * planned as a list of data blocks to read later.
+*/
+int plan_read(FileDescriptor *f, FilePtr *p, int length, ReadPlan *plan)
+{
+    long size = dir_get_size(f->dir_index);
+    long off = p->offset;
+    if (off + length > size)
+        length = size - off;
+    if (length <= 0) return 0;
+
+    plan->skip = 0;
+    plan->pinned = 0;
+    plan->length = length;
+    plan->tail_off = 0;
+    if (is_inline(f)) {
+        plan->dbs = NULL;
+        plan->nblocks = 0;
+        plan->data = malloc(length);
+        dir_read_inline(f->dir_index, off, plan->data, length);
+        p->offset = off + length;
+        return length;
+    }
+    if (is_compressed(f)) {
+        // Decompressing needs the caches, so it is done right here.
+        plan->dbs = NULL;
+        plan->nblocks = 0;
+        plan->data = malloc(length);
+        read_clusters(f, off, length, plan->data);
+        p->offset = off + length;
+        return length;
+    }
+
+    int first = off / BLOCK_SIZE;
+    int nblocks = (off + length - 1) / BLOCK_SIZE - first + 1;
+    int *dbs = malloc(nblocks * sizeof(int));
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        int fat = seek_block(f, p, first + i, 0);
+        if (fat == END_OF_FILE) {
+            // The file was extended past its chain; the rest is a hole.
+            for (; i < nblocks; i++)
+                dbs[i] = NO_DATA;
+            break;
+        }
+        dbs[i] = (fat_get_flags(fat) & FAT_UNWRITTEN) ? NO_DATA
+            : fat_get_data_block(fat);
+    }
+
+    p->offset = off + length;
+    if ((dir_get_flags(f->dir_index) & DIR_PACKED) &&
+            first + nblocks - 1 == (size - 1) / BLOCK_SIZE)
+        plan->tail_off = dir_get_tail_off(f->dir_index);
+
+    plan->dbs = dbs;
+    plan->nblocks = nblocks;
+    plan->skip = off % BLOCK_SIZE;
+    plan->data = NULL;
+    return length;
+}
+
+
+void init_desc(FileDescriptor *desc, int dir_index)
+{
+    int fat_index = dir_get_fat_root(dir_index);
+    desc->fat_root = fat_index;
+    desc->dir_index = dir_index;
+    desc->home = fbl_home_group(dir_index);
+    desc->read_ptr.offset = 0;
+    desc->read_ptr.curr_fat = fat_index;
+    desc->read_ptr.curr_block = 0;
+    desc->write_ptr.offset = dir_get_size(dir_index);
+    desc->write_ptr.curr_fat = fat_index;
+    desc->write_ptr.curr_block = 0;
+    desc->wbuf = NULL;
+    desc->wbuf_cap = 0;
+    desc->wbuf_len = 0;
+    memset(desc->block_map, 0, sizeof(desc->block_map));
+    desc->mapped = 0;
+}
+
+FileDescriptor *new_desc()
+{
+    if (desc_pool == NULL) {
+        desc_pool = slab_create(sizeof(FileDescriptor), DESC_POOL_CHUNK);
+        page_pool = slab_create(MAP_PAGE * sizeof(int), PAGE_POOL_CHUNK);
+    }
+    return slab_alloc(desc_pool);
+}
+
+void free_desc(FileDescriptor *desc)
+{
+    int i;
+    for (i = 0; i < MAP_PAGES; i++)
+        slab_free(page_pool, desc->block_map[i]);
+    free(desc->wbuf);
+    slab_free(desc_pool, desc);
+}
+
+/* Records that logical block [block], the first one not yet mapped, is
+   at fat index [fat]. */
+void map_block(FileDescriptor *f, int block, int fat)
+{
+    int **page = &f->block_map[block / MAP_PAGE];
+    if (*page == NULL)
+        *page = slab_alloc(page_pool);
+    (*page)[block % MAP_PAGE] = fat;
+    f->mapped = block + 1;
+}
+
+/* Forgets the mapping of every block from [block] on, after the chain
+   was cut there or replaced. */
+void unmap_from(FileDescriptor *f, int block)
+{
+    if (block < f->mapped)
+        f->mapped = block;
+}
+
+FileDescriptor *get_desc(int fileID)
+{
+    if (fileID >= MAX_OPEN || fileID < 0) return NULL;
+    return fdesc_table[fileID];
+}
+
+/**
+ * Returns the fat index of logical block [block] in the file. A block
+ * in the block map is looked up directly. Otherwise the chain is walked
+ * from the last mapped block, or from the position cached in [p] if
+ * that is further along, mapping the blocks passed on the way. If
+ * [extend] is set, entries without data are appended to the chain as
+ * needed, otherwise END_OF_FILE is returned when the chain is too short.
+*/
+int seek_block(FileDescriptor *f, FilePtr *p, int block, int extend)
+{
+    int fat = f->fat_root, i = 0;
+    if (block < f->mapped) {
+        fat = f->block_map[block / MAP_PAGE][block % MAP_PAGE];
+        i = block;
+    }
+    else if (f->mapped > 0) {
+        i = f->mapped - 1;
+        fat = f->block_map[i / MAP_PAGE][i % MAP_PAGE];
+    }
+    if (p->curr_fat != END_OF_FILE && p->curr_block <= block &&
+            p->curr_block > i) {
+        fat = p->curr_fat;
+        i = p->curr_block;
+    }
+    if (i == f->mapped)
+        map_block(f, i, fat);
+
+    while (i < block) {
+        int next = fat_get_next_index(fat);
+        if (next == END_OF_FILE) {
+            if (!extend) return END_OF_FILE;
+            next = fat_create_entry();
+            if (next == ERR_OUT_OF_SPACE) return ERR_OUT_OF_SPACE;
+            fat_set_next_index(fat, next);
+        }
+        fat = next;
+        i++;
+        if (i == f->mapped)
+            map_block(f, i, fat);
+    }
+
+    p->curr_fat = fat;
+    p->curr_block = block;
+    return fat;
+}
+
+int iov_total(SfsIoVec *iov, int iovcnt)
+{
+    int i, total = 0;
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].len;
+    return total;
+}
+
+/**
+ * Writes the buffers in [iov] at the write pointer. Runs an allocation
+ * pass over every block the write touches, stages whole blocks and then
+ * writes each run of consecutive data blocks with one device request.
+ * Blocks shared with other entries are never written in place; they
+ * get a new data block in the allocation pass like missing ones.
+*/
+int write_iov(FileDescriptor *f, SfsIoVec *iov, int iovcnt)
+{
+    int length = iov_total(iov, iovcnt);
+    if (length <= 0) return 0;
+
+    long size = dir_get_size(f->dir_index);
+    long off = f->write_ptr.offset;
+
+    if (is_inline(f)) {
+        if (dir_reserve_inline(f->dir_index, off + length)) {
+            long pos = off;
+            int i;
+            for (i = 0; i < iovcnt; i++) {
+                dir_write_inline(f->dir_index, pos, (byte*) iov[i].base,
+                    iov[i].len);
+                pos += iov[i].len;
+            }
+            f->write_ptr.offset = pos;
+            if (pos > size)
+                dir_set_size(f->dir_index, pos);
+            return length;
+        }
+        if (spill(f) != 0) {
+            puts("Could not allocate new fat entry. Not writing further data.");
+            return 0;
+        }
+    }
+    if (unpack_tail(f) != 0) {
+        puts("Could not allocate block. Not writing further data.");
+        return 0;
+    }
+
+    if (is_compressed(f)) {
+        byte *src = malloc(length);
+        iov_copy(src, iov, iovcnt, 0, length);
+        int written = write_clusters(f, off, length, src);
+        free(src);
+        f->write_ptr.offset = off + written;
+        if (off + written > size)
+            dir_set_size(f->dir_index, off + written);
+        return written;
+    }
+
+    int first = off / BLOCK_SIZE;
+    int nblocks = (off + length - 1) / BLOCK_SIZE - first + 1;
+    int head = off % BLOCK_SIZE;
+
+    int *fats = malloc(nblocks * sizeof(int));
+    int *dbs = malloc(nblocks * sizeof(int));
+    int *missing = malloc(nblocks * sizeof(int));
+    int *old = malloc(nblocks * sizeof(int));
+    byte *fresh = calloc(nblocks, 1);
+
+    /* Allocation pass: extend the chain over every block touched by the
+       write, then give all the blocks that have no data yet their data
+       blocks in one allocator call, so that they come out physically
+       contiguous. If we run out of space part way, only the blocks we
+       got are written. */
+    int n, i, need = 0;
+    for (n = 0; n < nblocks; n++) {
+        fats[n] = seek_block(f, &f->write_ptr, first + n, 1);
+        if (fats[n] == ERR_OUT_OF_SPACE) {
+            puts("Could not allocate new fat entry. Not writing further data.");
+            break;
+        }
+        if (fat_get_data_block(fats[n]) == NO_DATA) {
+            missing[need++] = fats[n];
+            fresh[n] = 1;
+        }
+        else if (fat_is_shared(fats[n])) {
+            // Copy on write. Partial blocks are staged from the old one.
+            missing[need++] = fats[n];
+            old[n] = fat_get_data_block(fats[n]);
+            fresh[n] = (fat_get_flags(fats[n]) & FAT_UNWRITTEN) ? 4 : 3;
+        }
+        else if (fat_get_flags(fats[n]) & FAT_UNWRITTEN) {
+            // Reserved blocks hold garbage, so never read them back.
+            fresh[n] = 2;
+        }
+    }
+
+    int got = fat_alloc_blocks(f->home, missing, need);
+    if (got < need) {
+        puts("Could not allocate block. Not writing further data.");
+        for (i = 0, n = 0; ; n++) {
+            if (fresh[n] != 0 && fresh[n] != 2 && i++ == got) break;
+        }
+    }
+    for (i = 0; i < n; i++) {
+        if (fresh[i] >= 2)
+            fat_set_flags(fats[i], fat_get_flags(fats[i]) & ~FAT_UNWRITTEN);
+        if (fresh[i] >= 3)
+            fat_unref_block(old[i]);
+        dbs[i] = fat_get_data_block(fats[i]);
+    }
+    free(missing);
+
+    int written = MIN(length, n * BLOCK_SIZE - head);
+    if (written <= 0) {
+        free(fats);
+        free(dbs);
+        free(old);
+        free(fresh);
+        return 0;
+    }
+
+    /* Stage whole blocks. Partially covered blocks at either end keep
+       their existing contents unless they were just allocated. */
+    byte *stage = calloc(n, BLOCK_SIZE);
+    long end = off + written;
+    if (head > 0 && (!fresh[0] || fresh[0] == 3))
+        read_blocks(fresh[0] ? old[0] : dbs[0], 1, stage);
+    if (end % BLOCK_SIZE != 0 && (!fresh[n - 1] || fresh[n - 1] == 3)
+        && (n > 1 || head == 0)
+        && (long) (first + n - 1) * BLOCK_SIZE < size)
+        read_blocks(fresh[n - 1] ? old[n - 1] : dbs[n - 1], 1,
+            stage + (n - 1) * BLOCK_SIZE);
+
+    iov_copy(stage + head, iov, iovcnt, 0, written);
+
+    if (dd_enabled())
+        dedup_blocks(fats, dbs, n, stage);
+    write_runs(dbs, n, stage);
+    if (dd_enabled()) {
+        for (i = 0; i < n; i++) {
+            if (dbs[i] != NO_DATA)
+                dd_insert(stage + i * BLOCK_SIZE, dbs[i]);
+        }
+    }
+
+    f->write_ptr.offset = end;
+    if (end > size)
+        dir_set_size(f->dir_index, end);
+
+    free(stage);
+    free(fats);
+    free(dbs);
+    free(old);
+    free(fresh);
+    return written;
+}
+
+/**
+ * Adds the buffers in [iov] to the descriptor's write buffer. The buffer
+ * is committed as soon as it reaches a block boundary past its capacity,
+ * taking whole blocks of the new data with it; the remainder stays
+ * buffered. Returns the number of bytes accepted.
+*/
+int buffered_write(FileDescriptor *f, SfsIoVec *iov, int iovcnt)
+{
+    int length = iov_total(iov, iovcnt);
+    long start = f->write_ptr.offset;
+    int limit = f->wbuf_cap - start % BLOCK_SIZE;
+
+    if (f->wbuf_len + length < limit) {
+        iov_copy(f->wbuf + f->wbuf_len, iov, iovcnt, 0, length);
+        f->wbuf_len += length;
+        return length;
+    }
+
+    int pending = f->wbuf_len;
+    int cut = (start + pending + length) / BLOCK_SIZE * BLOCK_SIZE - start;
+    SfsIoVec *all = malloc((iovcnt + 1) * sizeof(SfsIoVec));
+    int n = 1, left = cut - pending, i;
+    all[0].base = (char*) f->wbuf;
+    all[0].len = pending;
+    for (i = 0; i < iovcnt && left > 0; i++, n++) {
+        all[n].base = iov[i].base;
+        all[n].len = MIN(iov[i].len, left);
+        left -= all[n].len;
+    }
+
+    f->wbuf_len = 0;
+    int written = write_iov(f, all, n);
+    free(all);
+    if (written < cut)
+        return written > pending ? written - pending : 0;
+
+    f->wbuf_len = pending + length - cut;
+    iov_copy(f->wbuf, iov, iovcnt, cut - pending, f->wbuf_len);
+    return length;
+}
+
+/* Writes out anything in the descriptor's write buffer. Returns the
+   number of bytes written. */
+int commit(FileDescriptor *f)
+{
+    if (f->wbuf_len == 0) return 0;
+
+    SfsIoVec iov = {(char*) f->wbuf, f->wbuf_len};
+    f->wbuf_len = 0;
+    return write_iov(f, &iov, 1);
+}
+
+/* Zeros bytes [from, to) of the entry's data block, if it has one. A
+   shared block is copied first, into the allocation group [home]. */
+void zero_range(int home, int fat, int from, int to)
+{
+    int db = fat_get_data_block(fat);
+    if (db == NO_DATA || (fat_get_flags(fat) & FAT_UNWRITTEN)) return;
+
+    byte tmp[BLOCK_SIZE];
     read_blocks(db, 1, tmp);
-    memcpy(*ptr, tmp + f->read_ptr.byte_address, length);
-    f->read_ptr.byte_address += length;
-    (*ptr) += length;
-}
\ No newline at end of file
+    memset(tmp + from, 0, to - from);
+    if (fat_is_shared(fat)) {
+        if (fat_alloc_block(home, fat) != 0) return;
+        fat_unref_block(db);
+        db = fat_get_data_block(fat);
+    }
+    write_blocks(db, 1, tmp);
+}
+
+/* Copies [n] bytes out of [iov] into [dst], skipping the first [skip]. */
+void iov_copy(byte *dst, SfsIoVec *iov, int iovcnt, int skip, int n)
+{
+    int i;
+    for (i = 0; i < iovcnt && n > 0; i++) {
+        if (skip >= iov[i].len) {
+            skip -= iov[i].len;
+            continue;
+        }
+        int bytes = MIN(iov[i].len - skip, n);
+        memcpy(dst, iov[i].base + skip, bytes);
+        dst += bytes;
+        n -= bytes;
+        skip = 0;
+    }
+}
+
+/* Writes [buf] to the given data blocks, issuing one device request per
+   run of physically consecutive blocks. Blocks set to NO_DATA are
+   skipped. */
+void write_runs(int *dbs, int nblocks, byte *buf)
+{
+    int i = 0;
+    while (i < nblocks) {
+        if (dbs[i] == NO_DATA) {
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < nblocks && dbs[j] == dbs[j - 1] + 1) j++;
+        write_blocks(dbs[i], j - i, buf + i * BLOCK_SIZE);
+        i = j;
+    }
+}
+
+/**
+ * Points every staged block whose contents are already on disk at the
+ * existing copy instead, and sets its entry in [dbs] to NO_DATA so it
+ * is not written. A match among the blocks about to be written is not
+ * used, since its contents are about to change.
+*/
+void dedup_blocks(int *fats, int *dbs, int nblocks, byte *buf)
+{
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        int hit = dd_lookup(buf + i * BLOCK_SIZE);
+        if (hit == NO_DATA || (hit != dbs[i] && contains(dbs, nblocks, hit)))
+            continue;
+        if (hit != dbs[i])
+            fat_link_block(fats[i], hit);
+        dbs[i] = NO_DATA;
+    }
+}
+
+int contains(int *dbs, int nblocks, int db)
+{
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        if (dbs[i] == db) return 1;
+    }
+    return 0;
+}
+
+/* Reads the given data blocks into [buf], coalescing consecutive blocks
+   into one device request. Blocks without data read as zeros. */
+void read_runs(int *dbs, int nblocks, byte *buf)
+{
+    int i = 0;
+    while (i < nblocks) {
+        if (dbs[i] == NO_DATA) {
+            memset(buf + i * BLOCK_SIZE, 0, BLOCK_SIZE);
+            i++;
+            continue;
+        }
+        int j = i + 1;
+        while (j < nblocks && dbs[j] == dbs[j - 1] + 1) j++;
+        read_blocks(dbs[i], j - i, buf + i * BLOCK_SIZE);
+        i = j;
+    }
+}
+
+int is_compressed(FileDescriptor *f)
+{
+    return dir_get_flags(f->dir_index) & DIR_COMPRESSED;
+}
+
+int is_inline(FileDescriptor *f)
+{
+    return dir_get_flags(f->dir_index) & DIR_INLINE;
+}
+
+/**
+ * Moves the partial last block of a regular file into a fragment block,
+ * freeing its own block, or turns its own block into a new fragment
+ * block if no fragment block has room. Blocks that are reserved but
+ * unwritten or shared are left alone.
+*/
+void pack_tail(FileDescriptor *f)
+{
+    long size = dir_get_size(f->dir_index);
+    int len = size % BLOCK_SIZE;
+    if (len == 0 || (dir_get_flags(f->dir_index) &
+            (DIR_INLINE | DIR_COMPRESSED | DIR_PACKED)))
+        return;
+
+    FilePtr p = {0, f->fat_root, 0};
+    int tail = seek_block(f, &p, (size - 1) / BLOCK_SIZE, 0);
+    if (tail == END_OF_FILE) return;
+    int db = fat_get_data_block(tail);
+    if (db == NO_DATA || (fat_get_flags(tail) & FAT_UNWRITTEN) ||
+            fat_is_shared(tail))
+        return;
+
+    int off;
+    int frag = frag_alloc(len, db, &off);
+    if (frag == NO_DATA) return;
+    if (frag != db) {
+        byte buf[BLOCK_SIZE], tmp[BLOCK_SIZE];
+        read_blocks(db, 1, tmp);
+        read_blocks(frag, 1, buf);
+        memcpy(buf + off, tmp, len);
+        write_blocks(frag, 1, buf);
+        fat_link_block(tail, frag);
+    }
+    dir_set_tail_off(f->dir_index, off);
+    dir_set_flags(f->dir_index, dir_get_flags(f->dir_index) | DIR_PACKED);
+}
+
+/* Moves a packed tail back into a block of its own, before the file is
+   changed. Returns 0, or ERR_OUT_OF_SPACE with the tail left packed. */
+int unpack_tail(FileDescriptor *f)
+{
+    int flags = dir_get_flags(f->dir_index);
+    if (!(flags & DIR_PACKED)) return 0;
+
+    long size = dir_get_size(f->dir_index);
+    int len = size % BLOCK_SIZE, off = dir_get_tail_off(f->dir_index);
+    FilePtr p = {0, f->fat_root, 0};
+    int tail = seek_block(f, &p, (size - 1) / BLOCK_SIZE, 0);
+    int frag = fat_get_data_block(tail);
+
+    if (move_tail(f->home, tail, off, len) != 0) return ERR_OUT_OF_SPACE;
+    frag_release(frag, off, len);
+    dir_set_tail_off(f->dir_index, 0);
+    dir_set_flags(f->dir_index, flags & ~DIR_PACKED);
+    return 0;
+}
+
+/**
+ * Moves the [len] bytes at [off] of the entry's fragment block to the
+ * start of a block of its own. A tail alone in its fragment block keeps
+ * the block. Otherwise the entry gets a new block in the allocation
+ * group [home] and drops its share of the fragment. Returns 0, or
+ * ERR_OUT_OF_SPACE.
+*/
+int move_tail(int home, int tail, int off, int len)
+{
+    int frag = fat_get_data_block(tail);
+    byte buf[BLOCK_SIZE];
+    read_blocks(frag, 1, buf);
+    memmove(buf, buf + off, len);
+    memset(buf + len, 0, BLOCK_SIZE - len);
+
+    if (fat_is_shared(tail)) {
+        if (fat_alloc_block(home, tail) != 0) return ERR_OUT_OF_SPACE;
+        fat_unref_block(frag);
+    }
+    write_blocks(fat_get_data_block(tail), 1, buf);
+    return 0;
+}
+
+/**
+ * Moves an inline file's data out of its directory entry into a new
+ * chain, for when it outgrows the entry. The data fits in one block.
+ * Returns 0, or ERR_OUT_OF_SPACE with the file left inline.
+*/
+int spill(FileDescriptor *f)
+{
+    long size = dir_get_size(f->dir_index);
+    int root = fat_create_entry();
+    if (root == ERR_OUT_OF_SPACE) return ERR_OUT_OF_SPACE;
+
+    if (size > 0) {
+        byte buf[BLOCK_SIZE];
+        if (fat_alloc_block(f->home, root) != 0) {
+            fat_clean_entry(root);
+            return ERR_OUT_OF_SPACE;
+        }
+        memset(buf, 0, BLOCK_SIZE);
+        dir_read_inline(f->dir_index, 0, buf, size);
+        write_blocks(fat_get_data_block(root), 1, buf);
+    }
+
+    dir_set_fat_root(f->dir_index, root);
+    f->fat_root = root;
+    unmap_from(f, 0);
+    f->read_ptr.curr_fat = root;
+    f->read_ptr.curr_block = 0;
+    f->write_ptr.curr_fat = root;
+    f->write_ptr.curr_block = 0;
+    return 0;
+}
+
+/* Reads cluster [c] of the file into [buf], which must hold a whole
+   cluster. Whatever the cluster does not cover reads as zeros. */
+void load_cluster(FileDescriptor *f, FilePtr *p, int c, byte *buf)
+{
+    int dbs[CLUSTER_BLOCKS], n, m = 0, flags = 0;
+    memset(buf, 0, CLUSTER_BYTES);
+
+    for (n = 0; n < CLUSTER_BLOCKS; n++) {
+        int fat = seek_block(f, p, c * CLUSTER_BLOCKS + n, 0);
+        if (fat == END_OF_FILE) break;
+        if (n == 0) flags = fat_get_flags(fat);
+        dbs[n] = (fat_get_flags(fat) & FAT_UNWRITTEN) ? NO_DATA
+            : fat_get_data_block(fat);
+        if (dbs[n] != NO_DATA && m == n) m++;
+    }
+    if (n == 0) return;
+
+    if (!(flags & FAT_COMPRESSED)) {
+        read_runs(dbs, n, buf);
+        return;
+    }
+
+    byte tmp[CLUSTER_BYTES];
+    read_runs(dbs, m, tmp);
+    int clen = tmp[0] | (tmp[1] << 8);
+    if (clen > m * BLOCK_SIZE - CLUSTER_HEADER ||
+            cmp_decompress(tmp + CLUSTER_HEADER, clen, buf, CLUSTER_BYTES) < 0) {
+        printf("Corrupt compressed cluster %d, reading zeros.\n", c);
+        memset(buf, 0, CLUSTER_BYTES);
+    }
+}
+
+/**
+ * Replaces cluster [c] with the first [len] bytes of [buf]. The old data
+ * blocks of the cluster are freed and the data is stored compressed in
+ * the cluster's first entries if that saves at least one block, or else
+ * as is. Returns 0, or ERR_OUT_OF_SPACE.
+*/
+int store_cluster(FileDescriptor *f, FilePtr *p, int c, byte *buf, int len)
+{
+    int fats[CLUSTER_BLOCKS], dbs[CLUSTER_BLOCKS], i;
+    int nent = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+    for (i = 0; i < CLUSTER_BLOCKS; i++) {
+        int fat = seek_block(f, p, c * CLUSTER_BLOCKS + i, i < nent);
+        if (fat == ERR_OUT_OF_SPACE) return ERR_OUT_OF_SPACE;
+        if (fat == END_OF_FILE) break;
+        fat_release_block(fat);
+        fats[i] = fat;
+    }
+
+    byte tmp[CLUSTER_BYTES];
+    int clen = nent > 1 ? cmp_compress(buf, len, tmp + CLUSTER_HEADER,
+        (nent - 1) * BLOCK_SIZE - CLUSTER_HEADER) : -1;
+    int m = nent;
+    byte *data = buf;
+    if (clen >= 0) {
+        m = (clen + CLUSTER_HEADER + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        tmp[0] = clen & 0xff;
+        tmp[1] = clen >> 8;
+        data = tmp;
+    }
+
+    int got = fat_alloc_blocks(f->home, fats, m);
+    if (got < m) {
+        for (i = 0; i < got; i++)
+            fat_release_block(fats[i]);
+        return ERR_OUT_OF_SPACE;
+    }
+    if (clen >= 0)
+        fat_set_flags(fats[0], FAT_COMPRESSED);
+    for (i = 0; i < m; i++)
+        dbs[i] = fat_get_data_block(fats[i]);
+    write_runs(dbs, m, data);
+    return 0;
+}
+
+/* Reads [length] bytes at [off] of a compressed file into [dst]. */
+void read_clusters(FileDescriptor *f, long off, int length, byte *dst)
+{
+    byte *buf = malloc(CLUSTER_BYTES);
+    long end = off + length, pos = off;
+
+    while (pos < end) {
+        int c = pos / CLUSTER_BYTES;
+        long cstart = (long) c * CLUSTER_BYTES;
+        int bytes = MIN(end, cstart + CLUSTER_BYTES) - pos;
+        load_cluster(f, &f->read_ptr, c, buf);
+        memcpy(dst + (pos - off), buf + (pos - cstart), bytes);
+        pos += bytes;
+    }
+
+    free(buf);
+}
+
+/**
+ * Writes [length] bytes of [src] (zeros if it is NULL) at [off] of a
+ * compressed file, rewriting every cluster the range touches. Returns
+ * the number of bytes written.
+*/
+int write_clusters(FileDescriptor *f, long off, int length, byte *src)
+{
+    byte *buf = malloc(CLUSTER_BYTES);
+    long size = dir_get_size(f->dir_index);
+    long end = off + length, pos = off;
+
+    while (pos < end) {
+        int c = pos / CLUSTER_BYTES;
+        long cstart = (long) c * CLUSTER_BYTES;
+        int from = pos - cstart;
+        int to = MIN(end, cstart + CLUSTER_BYTES) - cstart;
+        int old_len = size <= cstart ? 0 : MIN(size - cstart, CLUSTER_BYTES);
+
+        // Load through a copy of the cursor, so that the store does not
+        // have to walk back from past the end of the cluster.
+        FilePtr q = f->write_ptr;
+        if (from > 0 || to < old_len)
+            load_cluster(f, &q, c, buf);
+        else
+            memset(buf, 0, CLUSTER_BYTES);
+        if (src != NULL)
+            memcpy(buf + from, src + (pos - off), to - from);
+        else
+            memset(buf + from, 0, to - from);
+
+        if (store_cluster(f, &f->write_ptr, c, buf, MAX(old_len, to)) < 0) {
+            puts("Could not allocate block. Not writing further data.");
+            break;
+        }
+        pos = cstart + to;
+    }
+
+    free(buf);
+    return pos - off;
+}
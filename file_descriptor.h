@@ -2,11 +2,13 @@
 #define __FILE_DESCRIPTOR_H
 
 #include "sfs_errors.h"
+#include "sfs_types.h"
+#include "sfs_api.h"
 
 /* Searches the file descriptor table for an open file with
-   the given name. Returns the file descriptor ID if found,
-   or ERR_NOT_FOUND otherwise. */
-int fdesc_search(char *name);
+   the given directory entry. Returns the file descriptor ID if
+   found, or ERR_NOT_FOUND otherwise. */
+int fdesc_search(int dir_index);
 
 /* Creates a new file descriptor entry in the table and returns
    the fileID if sucessful. Returns ERR_MAX_OPEN otherwise. */
@@ -16,10 +18,129 @@ int fdesc_create(int dir_index);
    on a successful remove, or ERR_NOT_FOUND otherwise. */
 int fdesc_remove(int fileID);
 
+/* Removes every file descriptor, committing buffered writes. */
+void fdesc_remove_all();
+
+/* Writes [length] bytes at the write pointer. Returns the number
+   of bytes written, or ERR_NOT_FOUND for a bad fileID. */
 int fdesc_write(int fileID, char *buf, int length);
 
+/* Reads up to [length] bytes at the read pointer, stopping at the
+   end of the file. Returns the number of bytes read. */
 int fdesc_read(int fileID, char *buf, int length);
 
+/* Same as fdesc_write, but the data is gathered from [iovcnt] buffers
+   and written as one operation. */
+int fdesc_writev(int fileID, SfsIoVec *iov, int iovcnt);
+
+/* Same as fdesc_read, but the data is scattered into [iovcnt] buffers. */
+int fdesc_readv(int fileID, SfsIoVec *iov, int iovcnt);
+
+/* A read resolved down to data blocks. Planning needs the caches, but
+   executing a plan only touches the device, so it can be done without
+   holding the file system lock. */
+typedef struct
+{
+    int *dbs;
+    int nblocks;
+    int skip;
+    int length;
+
+    /* The bytes themselves, already read and decompressed, for files
+       that are compressed; NULL otherwise. */
+    byte *data;
+
+    /* Where the last block's data starts within its data block, which
+       is not 0 for a tail packed into a fragment block. */
+    int tail_off;
+
+    /* Set when the data blocks are pinned until fdesc_unpin_read. */
+    int pinned;
+} ReadPlan;
+
+/* Resolves the next [length] bytes at the read pointer into [plan] and
+   advances the pointer. Returns the number of bytes planned; a plan is
+   only filled in when this is positive. */
+int fdesc_plan_read(int fileID, int length, ReadPlan *plan);
+
+/* Same as fdesc_plan_read, but plans [length] bytes at [off] and leaves
+   the read pointer alone. The planned data blocks are pinned, so they
+   still hold the file's data when the plan is executed without the
+   lock; the caller releases them with fdesc_unpin_read. */
+int fdesc_plan_read_at(int fileID, long off, int length, ReadPlan *plan);
+
+/* Reads the planned blocks into [iov] and releases the plan, apart from
+   the pins of a pinned one. Returns the number of bytes read. */
+int fdesc_exec_read(ReadPlan *plan, SfsIoVec *iov, int iovcnt);
+
+/* Drops the pins of an executed plan from fdesc_plan_read_at. Must be
+   called with the lock held. */
+void fdesc_unpin_read(ReadPlan *plan);
+
+/* Same as fdesc_read and fdesc_write, but at [off] instead of the
+   file's pointers, which are left where they were. */
+int fdesc_read_at(int fileID, long off, byte *buf, int length);
+int fdesc_write_at(int fileID, long off, const byte *buf, int length);
+
 int fdesc_seek(int fileID, int loc);
 
+/* Reserves data blocks for every block overlapping [offset, offset + len)
+   without writing them, placing new ones in one contiguous run. Reserved
+   blocks read as zeros until written. The file size is not changed, so
+   appends fill the reserved range. Returns 0, or ERR_OUT_OF_SPACE if
+   only part of the range could be reserved, or ERR_UNKNOWN for a
+   compressed file. */
+int fdesc_allocate(int fileID, long offset, long len);
+
+/* Sets the file size to [length]. Blocks past the new end are freed,
+   walking only the trailing part of the chain; growing the file leaves
+   a hole that reads as zeros. Returns 0 on success. */
+int fdesc_truncate(int fileID, long length);
+
+/* Frees the data blocks entirely inside [offset, offset + len) and zeros
+   the partially covered ones, leaving the size unchanged. Returns 0 on
+   success. */
+int fdesc_punch(int fileID, long offset, long len);
+
+/* Buffers up to [nblocks] blocks of writes in memory, committing them
+   when the buffer fills or on seek, read, close or sync. Zero turns
+   buffering off. Anything already buffered is committed first; returns
+   the number of bytes that were committed. */
+int fdesc_set_buffer(int fileID, int nblocks);
+
+/* Returns the number of bytes waiting in the write buffer, or 0 if the
+   file is not open. Only committing them makes a read or seek change
+   any metadata. */
+int fdesc_buffered(int fileID);
+
+/* Turns compression of the file's data on or off. Only allowed while the
+   file is empty; returns 0, or ERR_UNKNOWN if it is not. */
+int fdesc_set_compression(int fileID, int on);
+
+/* Makes the empty file [dst_index] a copy of [src_index] that shares
+   its data blocks, which are copied on the first write by either file.
+   Buffered writes to the source must be committed first. Returns 0 or
+   ERR_OUT_OF_SPACE. */
+int fdesc_clone(int src_index, int dst_index);
+
+/* Copies [len] bytes at [src_off] of one open file to [dst_off] of
+   another, or of the same one if the ranges do not overlap, without
+   moving either file's pointers. The destination range is reserved
+   before anything is copied. Returns the number of bytes copied, which
+   stops short at the end of the source or when the disk fills up, or
+   ERR_NOT_FOUND or ERR_UNKNOWN for bad arguments. */
+int fdesc_copy_range(int src_id, long src_off, int dst_id, long dst_off,
+    long len);
+
+/* Commits the write buffer. Returns the number of bytes written. */
+int fdesc_sync(int fileID);
+
+/* Commits the write buffers of every open file. */
+void fdesc_sync_all();
+
+/* Re-reads every open file's FAT root from the directory and drops the
+   cached chain positions, after the chains were changed underneath the
+   descriptors. */
+void fdesc_reload_all();
+
 #endif
\ No newline at end of file
@@ -0,0 +1,151 @@
+#include "file_map.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "sfs_api.h"
+#include "file_descriptor.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define MIN(a, b) (a < b ? a : b)
+#define FMAP_MAX 64
+
+typedef struct
+{
+    byte *addr;
+    size_t size;
+    int fileID;
+    long offset;
+    long len;
+    int prot;
+
+    /* The contents as last read or synced, for writable mappings. */
+    byte *clean;
+} FileMap;
+
+static FileMap *find(void *addr);
+static void drop(FileMap *m);
+
+static FileMap maps[FMAP_MAX];
+
+/**
+ * The whole range is read with one call, which resolves the chain once
+ * and reads each contiguous extent with a single multi-block read. After
+ * that, scanning the mapping costs no calls at all.
+*/
+void *fmap_map(int fileID, long offset, long len, int prot)
+{
+    int i;
+    for (i = 0; i < FMAP_MAX; i++) {
+        if (maps[i].addr == NULL) break;
+    }
+    if (i == FMAP_MAX || len <= 0 || offset < 0) return NULL;
+
+    FileMap *m = &maps[i];
+    m->size = len;
+    m->addr = mmap(NULL, m->size, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m->addr == MAP_FAILED) {
+        m->addr = NULL;
+        return NULL;
+    }
+
+    int read = fdesc_read_at(fileID, offset, m->addr, len);
+    if (read <= 0) {
+        drop(m);
+        return NULL;
+    }
+    m->fileID = fileID;
+    m->offset = offset;
+    m->len = read;
+    m->prot = prot;
+    m->clean = NULL;
+    if (prot & SFS_PROT_WRITE) {
+        m->clean = malloc(read);
+        memcpy(m->clean, m->addr, read);
+    }
+    else {
+        mprotect(m->addr, m->size, PROT_READ);
+    }
+    return m->addr;
+}
+
+/**
+ * The mapping is compared with its clean copy a block's worth at a time,
+ * measured from the start of the mapping, and each run of changed
+ * pieces is written back with one call.
+*/
+int fmap_sync(void *addr)
+{
+    FileMap *m = find(addr);
+    if (m == NULL) return ERR_NOT_FOUND;
+    if (m->clean == NULL) return 0;
+
+    long pos = 0;
+    while (pos < m->len) {
+        int n = MIN(BLOCK_SIZE, m->len - pos);
+        if (memcmp(m->addr + pos, m->clean + pos, n) == 0) {
+            pos += n;
+            continue;
+        }
+
+        long end = pos + n;
+        while (end < m->len) {
+            n = MIN(BLOCK_SIZE, m->len - end);
+            if (memcmp(m->addr + end, m->clean + end, n) == 0) break;
+            end += n;
+        }
+        fdesc_write_at(m->fileID, m->offset + pos, m->addr + pos, end - pos);
+        memcpy(m->clean + pos, m->addr + pos, end - pos);
+        pos = end;
+    }
+    return 0;
+}
+
+int fmap_unmap(void *addr)
+{
+    FileMap *m = find(addr);
+    if (m == NULL) return ERR_NOT_FOUND;
+    fmap_sync(addr);
+    drop(m);
+    return 0;
+}
+
+void fmap_release_file(int fileID)
+{
+    int i;
+    for (i = 0; i < FMAP_MAX; i++) {
+        if (maps[i].addr != NULL && maps[i].fileID == fileID)
+            fmap_unmap(maps[i].addr);
+    }
+}
+
+void fmap_release_all()
+{
+    int i;
+    for (i = 0; i < FMAP_MAX; i++) {
+        if (maps[i].addr != NULL)
+            fmap_unmap(maps[i].addr);
+    }
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+FileMap *find(void *addr)
+{
+    int i;
+    if (addr == NULL) return NULL;
+    for (i = 0; i < FMAP_MAX; i++) {
+        if (maps[i].addr == addr) return &maps[i];
+    }
+    return NULL;
+}
+
+void drop(FileMap *m)
+{
+    munmap(m->addr, m->size);
+    free(m->clean);
+    m->addr = NULL;
+    m->clean = NULL;
+}
@@ -0,0 +1,30 @@
+#ifndef __FILE_MAP_H
+#define __FILE_MAP_H
+
+#include "sfs_errors.h"
+
+/* Memory mappings of open files. A mapping is a page aligned copy of a
+   range of the file, read in extent by extent when it is made. Writable
+   mappings also keep a clean copy, so that syncing writes back only the
+   blocks that were changed. */
+
+/* Maps [len] bytes at [offset] of the file, stopping at its end. [prot]
+   is a mask of SFS_PROT_* flags; a mapping without SFS_PROT_WRITE is
+   made read-only. Returns the address, or NULL if the range is empty or
+   too many mappings are open. */
+void *fmap_map(int fileID, long offset, long len, int prot);
+
+/* Writes the changed parts of the mapping at [addr] back to its file.
+   Returns 0, or ERR_NOT_FOUND if [addr] is not a mapping. */
+int fmap_sync(void *addr);
+
+/* Syncs and drops the mapping at [addr]. Returns 0 or ERR_NOT_FOUND. */
+int fmap_unmap(void *addr);
+
+/* Syncs and drops every mapping of the file. */
+void fmap_release_file(int fileID);
+
+/* Syncs and drops every mapping. */
+void fmap_release_all();
+
+#endif
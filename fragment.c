@@ -0,0 +1,152 @@
+#include "fragment.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+#include "fat_cache.h"
+#include "refcount.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define FRAG_MAX_BLOCKS 512
+#define UNITS (BLOCK_SIZE / FRAG_UNIT)
+
+/* One fragment block. Bit i of [used] covers unit i. */
+typedef struct
+{
+    int data_block;
+    uint8_t used;
+    uint8_t tails;
+} FragBlock;
+
+static void build();
+static FragBlock *find(int data_block);
+static uint8_t mask(int off, int len);
+static void add_tail(FragBlock *b, int off, int len);
+
+static FragBlock blocks[FRAG_MAX_BLOCKS];
+static int nblocks;
+static int built;
+static int enabled;
+
+void frag_reset()
+{
+    nblocks = 0;
+    built = 0;
+}
+
+void frag_set_enabled(int on)
+{
+    enabled = on;
+}
+
+int frag_enabled()
+{
+    return enabled;
+}
+
+/**
+ * First fit over the fragment blocks. A block is skipped if anything
+ * besides its tails refers to it, which deduplication can cause, since
+ * packing into it rewrites it in place.
+*/
+int frag_alloc(int len, int own_block, int *off)
+{
+    int units = (len + FRAG_UNIT - 1) / FRAG_UNIT, i, u;
+    if (units >= UNITS) return NO_DATA;
+    build();
+
+    for (i = 0; i < nblocks; i++) {
+        FragBlock *b = &blocks[i];
+        if (rc_get(b->data_block - DATA_BLOCK_OFFSET) != b->tails) continue;
+        for (u = 0; u + units <= UNITS; u++) {
+            if (!(b->used & mask(u * FRAG_UNIT, len))) {
+                *off = u * FRAG_UNIT;
+                add_tail(b, *off, len);
+                return b->data_block;
+            }
+        }
+    }
+
+    if (nblocks == FRAG_MAX_BLOCKS) return NO_DATA;
+    FragBlock *b = &blocks[nblocks++];
+    b->data_block = own_block;
+    b->used = 0;
+    b->tails = 0;
+    *off = 0;
+    add_tail(b, 0, len);
+    return own_block;
+}
+
+void frag_release(int data_block, int off, int len)
+{
+    if (!built) return;
+    FragBlock *b = find(data_block);
+    if (b == NULL) return;
+
+    b->used &= ~mask(off, len);
+    b->tails--;
+    if (b->tails == 0)
+        *b = blocks[--nblocks];
+}
+
+void frag_release_file(int dir_index)
+{
+    if (!(dir_get_flags(dir_index) & DIR_PACKED)) return;
+    int tail = fat_get_tail(dir_get_fat_root(dir_index));
+    frag_release(fat_get_data_block(tail), dir_get_tail_off(dir_index),
+        dir_get_size(dir_index) % BLOCK_SIZE);
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Collects the packed tails of every file. The directory iterator is
+   left alone, as the caller may be in the middle of using it. */
+void build()
+{
+    int dir_index;
+    if (built) return;
+    built = 1;
+    nblocks = 0;
+
+    for (dir_index = 0; dir_index < dir_num_slots(); dir_index++) {
+        if (!dir_is_used(dir_index) ||
+                !(dir_get_flags(dir_index) & DIR_PACKED))
+            continue;
+
+        int db = fat_get_data_block(fat_get_tail(dir_get_fat_root(dir_index)));
+        FragBlock *b = find(db);
+        if (b == NULL) {
+            if (nblocks == FRAG_MAX_BLOCKS) continue;
+            b = &blocks[nblocks++];
+            b->data_block = db;
+            b->used = 0;
+            b->tails = 0;
+        }
+        add_tail(b, dir_get_tail_off(dir_index),
+            dir_get_size(dir_index) % BLOCK_SIZE);
+    }
+}
+
+FragBlock *find(int data_block)
+{
+    int i;
+    for (i = 0; i < nblocks; i++) {
+        if (blocks[i].data_block == data_block) return &blocks[i];
+    }
+    return NULL;
+}
+
+/* Returns the units covered by [len] bytes at [off]. */
+uint8_t mask(int off, int len)
+{
+    int first = off / FRAG_UNIT;
+    int units = (len + FRAG_UNIT - 1) / FRAG_UNIT;
+    return ((1 << units) - 1) << first;
+}
+
+void add_tail(FragBlock *b, int off, int len)
+{
+    b->used |= mask(off, len);
+    b->tails++;
+}
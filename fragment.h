@@ -0,0 +1,42 @@
+#ifndef __FRAGMENT_H
+#define __FRAGMENT_H
+
+/* Fragment blocks hold the partial last blocks (tails) of several
+   files, packed at FRAG_UNIT aligned offsets. A packed tail is found
+   through the file's last FAT entry, which points at the fragment
+   block, the offset saved in its directory entry and the file size.
+   Each tail holds one reference to its fragment block, so the block is
+   freed with its last tail.
+
+   Which parts of which fragment blocks are in use is only kept in
+   memory. It is rebuilt from the directory the first time it is needed
+   after a mount. */
+
+#define FRAG_UNIT 64
+
+/* Forgets every fragment block, to be rebuilt on next use. */
+void frag_reset();
+
+/* Turns tail packing of files being closed on or off. Off by default. */
+void frag_set_enabled(int on);
+
+/* Returns true if tail packing is on. */
+int frag_enabled();
+
+/* Finds room for a tail of [len] bytes in a fragment block and sets
+   [off] to where it goes. If none has room, [own_block], the tail's
+   current data block, becomes a new fragment block with the tail at
+   offset 0. Data blocks are as used in FAT entries. Returns the data
+   block, or NO_DATA if the tail cannot be packed or is too long for
+   packing to save anything. */
+int frag_alloc(int len, int own_block, int *off);
+
+/* Frees the room taken by a tail of [len] bytes at [off] of
+   [data_block]. */
+void frag_release(int data_block, int off, int len);
+
+/* Frees the room taken by the packed tail of the file, which is about
+   to be removed. */
+void frag_release_file(int dir_index);
+
+#endif
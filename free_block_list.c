@@ -5,55 +5,259 @@
 
 #include "lib/disk_emu.h"
 
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
-static BitField *bfield;
+#define GROUP_BYTES (FBL_GROUP_BLOCKS / 8)
+
+/* One allocation group. Each is kept on its own cache line so that
+   threads working in neighbouring groups do not share one. */
+typedef struct
+{
+    pthread_mutex_t lock;
+    BitField *bits;
+    uint32_t nfree;
+    /* Set whenever the group's bitmap differs from the one on disk. */
+    int dirty;
+} __attribute__((aligned(64))) AllocGroup;
+
+static AllocGroup groups[FBL_GROUPS];
+
+/* The whole bitmap in one piece, gathered from the groups for the disk
+   and for runs that may span several groups. */
+static BitField *whole;
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+static void lock_all();
+static void unlock_all();
+static void gather();
+static void scatter(byte *bytes);
+static AllocGroup *group_of(uint32_t index);
+static void take(AllocGroup *g, uint32_t start, uint32_t len);
 
 void fbl_init()
 {
-    bfield = bf_create(TOTAL_DATA_BLOCKS);
-    bf_set_all_bits(bfield, 1);
+    static int ready;
+    int i;
+    if (!ready) {
+        for (i = 0; i < FBL_GROUPS; i++)
+            pthread_mutex_init(&groups[i].lock, NULL);
+        ready = 1;
+    }
+
+    fbl_destroy();
+    whole = bf_create(TOTAL_DATA_BLOCKS);
+    for (i = 0; i < FBL_GROUPS; i++) {
+        groups[i].bits = bf_create(FBL_GROUP_BLOCKS);
+        bf_set_all_bits(groups[i].bits, 1);
+        groups[i].nfree = FBL_GROUP_BLOCKS;
+        groups[i].dirty = 1;
+    }
 }
 
 void fbl_load()
 {
     byte buf[BLOCK_SIZE] = {0};
+    int i;
     read_blocks(FREE_LIST_START, 1, buf);
+    scatter(buf);
+    for (i = 0; i < FBL_GROUPS; i++)
+        groups[i].dirty = 0;
 }
 
 void fbl_flush()
 {
-    write_blocks(FREE_LIST_START, 1, bf_get_raw_bytes(bfield));
+    int i, dirty = 0;
+    for (i = 0; i < FBL_GROUPS; i++) {
+        dirty |= groups[i].dirty;
+        groups[i].dirty = 0;
+    }
+    if (!dirty) return;
+    write_blocks(FREE_LIST_START, 1, fbl_get_raw());
 }
 
 int fbl_get_free_index()
 {
-    uint32_t ret = bf_locate_first(bfield, 1);
-    bf_flip_bit(bfield, ret);
-    return ret;
+    int got;
+    return fbl_alloc_run(1, &got);
+}
+
+int fbl_alloc_run(int want, int *got)
+{
+    uint32_t len, i;
+    lock_all();
+    gather();
+    uint32_t start = bf_locate_run(whole, 1, want, &len);
+    // Split the run at the group boundaries it crosses.
+    for (i = 0; i < len; ) {
+        AllocGroup *g = group_of(start + i);
+        uint32_t n = FBL_GROUP_BLOCKS - (start + i) % FBL_GROUP_BLOCKS;
+        if (n > len - i) n = len - i;
+        take(g, start + i, n);
+        i += n;
+    }
+    unlock_all();
+
+    if (len == 0) return -1;
+    *got = len;
+    return start;
+}
+
+int fbl_alloc_run_in(int home, int want, int *got)
+{
+    int i;
+    for (i = 0; i < FBL_GROUPS; i++) {
+        int gi = (home + i) % FBL_GROUPS;
+        AllocGroup *g = &groups[gi];
+        // A racy peek is fine: a full group is skipped without locking,
+        // and the count is checked again under the lock.
+        if (g->nfree == 0) continue;
+
+        pthread_mutex_lock(&g->lock);
+        uint32_t len, start = 0;
+        if (g->nfree > 0)
+            start = bf_locate_run(g->bits, 1, want, &len) +
+                gi * FBL_GROUP_BLOCKS;
+        else
+            len = 0;
+        if (len > 0)
+            take(g, start, len);
+        pthread_mutex_unlock(&g->lock);
+
+        if (len > 0) {
+            *got = len;
+            return start;
+        }
+    }
+    return -1;
+}
+
+int fbl_home_group(int dir_index)
+{
+    return (dir_index < 0 ? 0 : dir_index) % FBL_GROUPS;
+}
+
+uint32_t fbl_group_num_free(int group)
+{
+    return groups[group].nfree;
 }
 
 void fbl_set_free_index(uint32_t index) {
-    bf_flip_bit(bfield, index);
+    AllocGroup *g = group_of(index);
+    uint32_t bit = index % FBL_GROUP_BLOCKS;
+    pthread_mutex_lock(&g->lock);
+    if (!bf_get_bit(g->bits, bit)) {
+        bf_set_bit(g->bits, bit, 1);
+        g->nfree++;
+    }
+    g->dirty = 1;
+    pthread_mutex_unlock(&g->lock);
+}
+
+void fbl_mark_used(uint32_t index)
+{
+    AllocGroup *g = group_of(index);
+    pthread_mutex_lock(&g->lock);
+    if (bf_get_bit(g->bits, index % FBL_GROUP_BLOCKS))
+        take(g, index, 1);
+    g->dirty = 1;
+    pthread_mutex_unlock(&g->lock);
+}
+
+int fbl_is_free(uint32_t index)
+{
+    return bf_get_bit(group_of(index)->bits, index % FBL_GROUP_BLOCKS);
 }
 
 uint32_t fbl_get_num_free()
 {
-    return bf_num_one_bits(bfield);
+    uint32_t count = 0;
+    int i;
+    for (i = 0; i < FBL_GROUPS; i++)
+        count += groups[i].nfree;
+    return count;
 }
 
 byte *fbl_get_raw()
 {
-    return bf_get_raw_bytes(bfield);
+    lock_all();
+    gather();
+    unlock_all();
+    return bf_get_raw_bytes(whole);
 }
 
 void fbl_set_raw(byte *bytes)
 {
-    bf_set_raw_bytes(bfield, bytes);
+    int i;
+    scatter(bytes);
+    for (i = 0; i < FBL_GROUPS; i++)
+        groups[i].dirty = 1;
 }
 
 void fbl_destroy()
 {
-    bf_destroy(bfield);
+    int i;
+    if (whole == NULL) return;
+    bf_destroy(whole);
+    whole = NULL;
+    for (i = 0; i < FBL_GROUPS; i++) {
+        bf_destroy(groups[i].bits);
+        groups[i].bits = NULL;
+    }
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Locks every group, always in the same order. */
+void lock_all()
+{
+    int i;
+    for (i = 0; i < FBL_GROUPS; i++)
+        pthread_mutex_lock(&groups[i].lock);
+}
+
+void unlock_all()
+{
+    int i;
+    for (i = FBL_GROUPS - 1; i >= 0; i--)
+        pthread_mutex_unlock(&groups[i].lock);
+}
+
+/* Copies the group bitmaps into the whole one. */
+void gather()
+{
+    byte *raw = bf_get_raw_bytes(whole);
+    int i;
+    for (i = 0; i < FBL_GROUPS; i++)
+        memcpy(raw + i * GROUP_BYTES, bf_get_raw_bytes(groups[i].bits),
+            GROUP_BYTES);
+}
+
+/* Splits a whole bitmap into the groups and recounts their free blocks. */
+void scatter(byte *bytes)
+{
+    int i;
+    lock_all();
+    for (i = 0; i < FBL_GROUPS; i++) {
+        bf_set_raw_bytes(groups[i].bits, bytes + i * GROUP_BYTES);
+        groups[i].nfree = bf_num_one_bits(groups[i].bits);
+    }
+    unlock_all();
+}
+
+AllocGroup *group_of(uint32_t index)
+{
+    return &groups[index / FBL_GROUP_BLOCKS];
+}
+
+/* Marks [len] free blocks of the group from volume index [start] as
+   used. The group must be locked. */
+void take(AllocGroup *g, uint32_t start, uint32_t len)
+{
+    uint32_t i;
+    for (i = 0; i < len; i++)
+        bf_flip_bit(g->bits, start % FBL_GROUP_BLOCKS + i);
+    g->nfree -= len;
+    g->dirty = 1;
 }
\ No newline at end of file
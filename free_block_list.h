@@ -4,8 +4,17 @@
 #include <stdint.h>
 
 #include "sfs_types.h"
+#include "sfs_constants.h"
 #include "bit_field.h"
 
+/* The data region is split into allocation groups, each with its own
+   bitmap, free count and lock. Writers allocating in different groups
+   never contend with each other, and their files stay apart on disk.
+   The API still holds one lock over every call, so writers going through
+   sfs_fwrite take turns; for them only the placement is gained. */
+#define FBL_GROUPS 32
+#define FBL_GROUP_BLOCKS (TOTAL_DATA_BLOCKS / FBL_GROUPS)
+
 typedef struct _FreeBlockList FreeBlockList;
 
 void fbl_init();
@@ -16,8 +25,31 @@ void fbl_flush();
 
 int fbl_get_free_index();
 
+/* Marks a run of up to [want] consecutive free blocks as used, preferring
+   the first run that is long enough. Returns the first index of the run
+   and stores its length in [got], or returns -1 if the disk is full. */
+int fbl_alloc_run(int want, int *got);
+
+/* Like fbl_alloc_run, but takes the run from group [home] while it has
+   any free block, then from the groups after it in turn. The run never
+   crosses a group boundary. Only the group searched is locked, so it is
+   safe to call from several threads at once. */
+int fbl_alloc_run_in(int home, int want, int *got);
+
+/* Returns the home group of the file in directory slot [dir_index]. */
+int fbl_home_group(int dir_index);
+
+/* Returns the number of free blocks in [group]. */
+uint32_t fbl_group_num_free(int group);
+
 void fbl_set_free_index(uint32_t index);
 
+/* Marks the block as in use. */
+void fbl_mark_used(uint32_t index);
+
+/* Returns true if the block is free. */
+int fbl_is_free(uint32_t index);
+
 uint32_t fbl_get_num_free();
 
 byte *fbl_get_raw();
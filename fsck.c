@@ -0,0 +1,373 @@
+#include "fsck.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+#include "fat_cache.h"
+#include "free_block_list.h"
+#include "refcount.h"
+#include "snapshot.h"
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FSCK_MAX_THREADS 64
+#define FSCK_MAX_PASSES 4
+#define NO_OWNER INT_MAX
+
+/* Entries and blocks handed to a thread at a time by the leak scan. */
+#define SCAN_CHUNK 256
+
+/* One file being checked. [cut] is the logical block at which its chain
+   goes bad, or -1 if the whole chain is good. */
+typedef struct
+{
+    int dir_index;
+    int root;
+    int cut;
+    int nblocks;
+} FileCheck;
+
+static int check_pass(int repair, int nthreads, SfsFsckReport *r);
+static int check_dirs(int repair);
+static void run_pool(void *(*fn)(void *), int nthreads);
+static int next_job();
+static void claim(int *owner, int index, int file);
+static void *walk_main(void *unused);
+static void *verify_main(void *unused);
+static void *count_main(void *unused);
+static void *scan_main(void *unused);
+static long room(FileCheck *c);
+static void repair_file(FileCheck *c);
+
+static FileCheck *files;
+static int nfiles;
+
+/* Lowest file index whose chain reaches each FAT entry. */
+static int fat_owner[TOTAL_DATA_BLOCKS];
+static byte fat_used[TOTAL_DATA_BLOCKS];
+
+/* Reached entries pointing at each data block, and its stored count.
+   The references held by snapshots are counted in up front. */
+static int block_refs[TOTAL_DATA_BLOCKS];
+static int snap_refs[TOTAL_DATA_BLOCKS];
+static int refcount[TOTAL_DATA_BLOCKS];
+
+static int job;
+static SfsFsckReport *report;
+
+int fsck_run(int repair, int nthreads, SfsFsckReport *r)
+{
+    struct timespec t0, t1;
+    int pass, found;
+
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > FSCK_MAX_THREADS) nthreads = FSCK_MAX_THREADS;
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    memset(r, 0, sizeof(SfsFsckReport));
+    found = check_pass(repair, nthreads, r);
+
+    // Cutting chains leaves their tails behind as leaked entries, so
+    // repairing takes another pass or two to settle.
+    r->remaining = found;
+    for (pass = 1; repair && r->remaining > 0 && pass < FSCK_MAX_PASSES;
+            pass++) {
+        SfsFsckReport again;
+        memset(&again, 0, sizeof(again));
+        r->remaining = check_pass(1, nthreads, &again);
+    }
+    if (repair && r->remaining > 0) {
+        SfsFsckReport last;
+        memset(&last, 0, sizeof(last));
+        r->remaining = check_pass(0, nthreads, &last);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    r->seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    return found;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/**
+ * Checks everything once. The caches are faulted in up front on this
+ * thread, after which the workers only read them. Chains are walked in
+ * parallel claiming the entries they reach, then re-walked to cut them
+ * at the first entry claimed by a lower file. The references to each
+ * block from the entries that are left are counted on top of those held
+ * by snapshots, which are taken as they are, and finally every
+ * entry and block is checked against the claims, the free list and the
+ * stored reference counts. Repairs are done here, single threaded.
+*/
+int check_pass(int repair, int nthreads, SfsFsckReport *r)
+{
+    int i, d;
+
+    r->bad_dirs = check_dirs(repair);
+    nfiles = 0;
+    for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d))
+        nfiles++;
+    files = malloc(sizeof(FileCheck) * (nfiles + 1));
+    nfiles = 0;
+    for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d)) {
+        if (dir_get_flags(d) & DIR_DIRECTORY) continue;
+        FileCheck *c = &files[nfiles++];
+        c->dir_index = d;
+        c->root = dir_get_fat_root(c->dir_index);
+        c->cut = -1;
+        c->nblocks = 0;
+    }
+    memset(snap_refs, 0, sizeof(snap_refs));
+    snap_count_refs(snap_refs);
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+        fat_used[i] = fat_is_used(i);
+        fat_owner[i] = NO_OWNER;
+        block_refs[i] = snap_refs[i];
+        refcount[i] = rc_get(i);
+    }
+
+    report = r;
+    r->files = nfiles;
+    r->entries = TOTAL_DATA_BLOCKS;
+    run_pool(walk_main, nthreads);
+    run_pool(verify_main, nthreads);
+    run_pool(count_main, nthreads);
+    run_pool(scan_main, nthreads);
+
+    for (i = 0; i < nfiles; i++) {
+        FileCheck *c = &files[i];
+        int too_big = dir_get_size(c->dir_index) > room(c);
+        if (too_big && c->cut < 0)
+            r->bad_sizes++;
+        if (repair && (too_big || c->cut >= 0))
+            repair_file(c);
+    }
+
+    if (repair) {
+        for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+            if (fat_used[i] && fat_owner[i] == NO_OWNER)
+                fat_drop_entry(i);
+        }
+        fat_rebuild_free_list(snap_refs);
+    }
+
+    free(files);
+    return r->bad_dirs + r->bad_chains + r->cross_linked + r->bad_sizes +
+        r->leaked_entries + r->leaked_blocks + r->unmarked_blocks +
+        r->bad_refcounts;
+}
+
+/**
+ * Finds entries whose parent is not a directory in use, and directories
+ * whose entry count is off. Repairing drops the lost entries, whose
+ * chains are then freed as leaked, until none are left (a lost directory
+ * loses what is in it too), and recounts every directory.
+*/
+int check_dirs(int repair)
+{
+    int n = dir_num_slots(), found = 0, lost, i, d;
+    int *children = malloc(sizeof(int) * n);
+
+    do {
+        lost = 0;
+        memset(children, 0, sizeof(int) * n);
+        for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d)) {
+            int parent = dir_get_parent(d);
+            if (parent == DIR_ROOT)
+                continue;
+            if (dir_is_used(parent) &&
+                    (dir_get_flags(parent) & DIR_DIRECTORY)) {
+                children[parent]++;
+                continue;
+            }
+            lost++;
+            if (repair)
+                dir_remove(d);
+        }
+        if (found == 0) found = lost;
+    } while (repair && lost > 0);
+
+    for (i = 0; i < n; i++) {
+        if (!dir_is_used(i) || !(dir_get_flags(i) & DIR_DIRECTORY) ||
+                dir_get_size(i) == children[i])
+            continue;
+        found++;
+        if (repair)
+            dir_set_size(i, children[i]);
+    }
+    free(children);
+    return found;
+}
+
+void run_pool(void *(*fn)(void *), int nthreads)
+{
+    pthread_t threads[FSCK_MAX_THREADS];
+    int i;
+
+    job = 0;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&threads[i], NULL, fn, NULL);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+}
+
+int next_job()
+{
+    return __atomic_fetch_add(&job, 1, __ATOMIC_RELAXED);
+}
+
+/* Records [file] as the owner of owner[index] unless a lower file
+   already is. */
+void claim(int *owner, int index, int file)
+{
+    int seen = __atomic_load_n(&owner[index], __ATOMIC_RELAXED);
+    while (file < seen &&
+        !__atomic_compare_exchange_n(&owner[index], &seen, file, 0,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/* Walks each chain up to the first link that is out of range, points
+   at a free entry or loops back on the chain, claiming what it passes. */
+void *walk_main(void *unused)
+{
+    // Entry i was visited by file j if seen[i] == j + 1.
+    int *seen = calloc(TOTAL_DATA_BLOCKS, sizeof(int));
+    int bad = 0, j;
+
+    while ((j = next_job()) < nfiles) {
+        FileCheck *c = &files[j];
+        int fat = c->root, i = 0;
+        while (fat != END_OF_FILE) {
+            if (fat < 0 || fat >= TOTAL_DATA_BLOCKS || !fat_used[fat] ||
+                    seen[fat] == j + 1) {
+                c->cut = i;
+                break;
+            }
+            int db = fat_get_data_block(fat);
+            if (db != NO_DATA && (db < DATA_BLOCK_OFFSET ||
+                    db >= DATA_BLOCK_OFFSET + TOTAL_DATA_BLOCKS)) {
+                c->cut = i;
+                break;
+            }
+
+            seen[fat] = j + 1;
+            claim(fat_owner, fat, j);
+            fat = fat_get_next_index(fat);
+            i++;
+        }
+        c->nblocks = i;
+        if (c->cut >= 0) bad++;
+    }
+
+    __atomic_fetch_add(&report->bad_chains, bad, __ATOMIC_RELAXED);
+    free(seen);
+    return NULL;
+}
+
+/* Cuts each chain at the first entry that a lower file also reaches.
+   That file keeps it. Files may share data blocks, but not entries. */
+void *verify_main(void *unused)
+{
+    int crossed = 0, j;
+
+    while ((j = next_job()) < nfiles) {
+        FileCheck *c = &files[j];
+        int fat = c->root, i;
+        for (i = 0; i < c->nblocks; i++) {
+            if (fat_owner[fat] != j) {
+                c->cut = i;
+                c->nblocks = i;
+                crossed++;
+                break;
+            }
+            fat = fat_get_next_index(fat);
+        }
+    }
+
+    __atomic_fetch_add(&report->cross_linked, crossed, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Counts the references to each data block from the entries that stay
+   in some chain. */
+void *count_main(void *unused)
+{
+    int j;
+
+    while ((j = next_job()) < nfiles) {
+        FileCheck *c = &files[j];
+        int fat = c->root, i;
+        for (i = 0; i < c->nblocks; i++) {
+            int db = fat_get_data_block(fat);
+            if (db != NO_DATA)
+                __atomic_fetch_add(&block_refs[db - DATA_BLOCK_OFFSET], 1,
+                    __ATOMIC_RELAXED);
+            fat = fat_get_next_index(fat);
+        }
+    }
+    return NULL;
+}
+
+/* Finds entries and blocks that no chain reaches but are in use, blocks
+   that a chain reaches but the free list has as free, and blocks whose
+   stored reference count is off. A free block counts as one. */
+void *scan_main(void *unused)
+{
+    int leaked_entries = 0, leaked_blocks = 0, unmarked = 0, bad_counts = 0;
+    int start, i;
+
+    while ((start = next_job() * SCAN_CHUNK) < TOTAL_DATA_BLOCKS) {
+        for (i = start; i < start + SCAN_CHUNK; i++) {
+            if (fat_used[i] && fat_owner[i] == NO_OWNER)
+                leaked_entries++;
+            int reached = block_refs[i] > 0;
+            int is_free = fbl_is_free(i);
+            if (reached && is_free)
+                unmarked++;
+            else if (!reached && !is_free)
+                leaked_blocks++;
+            if (refcount[i] != (reached ? block_refs[i] : 1))
+                bad_counts++;
+        }
+    }
+
+    __atomic_fetch_add(&report->leaked_entries, leaked_entries,
+        __ATOMIC_RELAXED);
+    __atomic_fetch_add(&report->leaked_blocks, leaked_blocks,
+        __ATOMIC_RELAXED);
+    __atomic_fetch_add(&report->unmarked_blocks, unmarked, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&report->bad_refcounts, bad_counts, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+/* Ends the file's chain before its first bad block, giving it a new
+   empty chain if the root itself is bad, and shrinks the file to fit. */
+void repair_file(FileCheck *c)
+{
+    if (c->cut == 0) {
+        int root = fat_create_entry();
+        if (root == ERR_OUT_OF_SPACE) return;
+        dir_set_fat_root(c->dir_index, root);
+    }
+    else if (c->cut > 0) {
+        int fat = c->root, i;
+        for (i = 1; i < c->cut; i++)
+            fat = fat_get_next_index(fat);
+        fat_set_next_index(fat, END_OF_FILE);
+    }
+
+    if (dir_get_size(c->dir_index) > room(c))
+        dir_set_size(c->dir_index, room(c));
+}
+
+/* Returns how many bytes the file can hold. An inline file has no chain
+   and holds what fits in its directory entry. */
+long room(FileCheck *c)
+{
+    if (dir_get_flags(c->dir_index) & DIR_INLINE)
+        return dir_inline_capacity(c->dir_index);
+    return (long)c->nblocks * BLOCK_SIZE;
+}
@@ -0,0 +1,14 @@
+#ifndef __FSCK_H
+#define __FSCK_H
+
+#include "sfs_api.h"
+
+/* Checks that the directory, the FAT chains and the free list agree,
+   walking the chains on [nthreads] threads. The caches must be flushed
+   and no other thread may use them meanwhile. If [repair] is set, bad
+   chains are cut short, leaked entries are freed and the free list and
+   block reference counts are rebuilt. Fills in [report] and returns the number of problems found
+   before any repair. */
+int fsck_run(int repair, int nthreads, SfsFsckReport *report);
+
+#endif
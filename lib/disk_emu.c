@@ -7,7 +7,11 @@
 
 
 FILE* fp = NULL;
-double L, p;
+/*Latency starts at 0 and is kept across inits once set with set_latency*/
+double L = 00000.f, p;
+/*Extra latency for a request that does not start where the last one ended*/
+double S = 0;
+int head = -1;
 double r;
 int BLOCK_SIZE, MAX_BLOCK, MAX_RETRY, lru;
 
@@ -19,6 +23,7 @@ int close_disk()
     if(NULL != fp)
     {
         fclose(fp);
+        fp = NULL;
     }
     return 0;
 }
@@ -30,8 +35,6 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 {
     int i, j;
     
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
     /*Set up failure at 10%*/
     p = -1.f;
     /*Set up max retry attempts after failure to 3*/
@@ -60,6 +63,8 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
             fputc(0, fp);
         }
     }
+    /*Block reads and writes bypass the stream, so push the zeros out now*/
+    fflush(fp);
     return 0;
 }
 /*----------------------------*/
@@ -67,8 +72,6 @@ int init_fresh_disk(char *filename, int block_size, int num_blocks)
 /*----------------------------*/
 int init_disk(char *filename, int block_size, int num_blocks)
 {
-    /*Set up latency at 0.02 second*/
-    L = 00000.f;
     /*Set up failure at 10%*/
     p = -1.f;
     /*Set up max retry attempts after failure to 3*/
@@ -96,13 +99,10 @@ int init_disk(char *filename, int block_size, int num_blocks)
 /*-------------------------------------------------------------------*/
 int read_blocks(int start_address, int nblocks, void *buffer)
 {
-    int i, j, e, s;
+    int i, e, s;
     e = 0;
     s = 0;
 
-    /*Sets up a temporary buffer*/
-    void* blockRead = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -110,27 +110,26 @@ int read_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto the data requested from the disk*/
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Seek if the request is not sequential with the previous one*/
+    if (S > 0 && start_address != head)
+        usleep(S);
+    head = start_address + nblocks;
 
     /*For every block requested*/
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        s++;
-        fread(blockRead, BLOCK_SIZE, 1, fp);
-
-        for (j = 0; j < BLOCK_SIZE; j++)
-        {
-            memcpy(buffer+(i*BLOCK_SIZE), blockRead, BLOCK_SIZE);  
-        }
+        if (L > 0)
+            usleep(L);
+
+        /*Positioned reads keep concurrent requests from racing on the file offset*/
+        if (pread(fileno(fp), buffer + (i * BLOCK_SIZE), BLOCK_SIZE,
+                (off_t) (start_address + i) * BLOCK_SIZE) != BLOCK_SIZE)
+            e--;
+        else
+            s++;
     }
 
-    free(blockRead);
-
-
     /*If no failure return the number of blocks read, else return the negative number of failures*/
     if (e == 0)
         return s;
@@ -147,8 +146,6 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     e = 0;
     s = 0;
 
-    void* blockWrite = (void*) malloc(BLOCK_SIZE);
-
     /*Checks that the data requested is within the range of addresses of the disk*/
     if (start_address + nblocks > MAX_BLOCK)
     {
@@ -156,22 +153,24 @@ int write_blocks(int start_address, int nblocks, void *buffer)
         return -1;
     }
 
-    /*Goto where the data is to be written on the disk*/        
-    fseek(fp, start_address * BLOCK_SIZE, SEEK_SET);
+    /*Seek if the request is not sequential with the previous one*/
+    if (S > 0 && start_address != head)
+        usleep(S);
+    head = start_address + nblocks;
 
     /*For every block requested*/        
     for (i = 0; i < nblocks; ++i)
     {
         /*Pause until the latency duration is elapsed*/
-        usleep(L);
-
-        memcpy(blockWrite, buffer+(i*BLOCK_SIZE), BLOCK_SIZE);
-
-        fwrite(blockWrite, BLOCK_SIZE, 1, fp);
-        fflush(fp);
-        s++;
+        if (L > 0)
+            usleep(L);
+
+        if (pwrite(fileno(fp), buffer + (i * BLOCK_SIZE), BLOCK_SIZE,
+                (off_t) (start_address + i) * BLOCK_SIZE) != BLOCK_SIZE)
+            e--;
+        else
+            s++;
     }
-    free(blockWrite);
 
     /*If no failure return the number of blocks written, else return the negative number of failures*/
     if (e == 0)
@@ -179,3 +178,26 @@ int write_blocks(int start_address, int nblocks, void *buffer)
     else
         return e;
 }
+
+/*--------------------------------------------------------*/
+/*Sets the per-block access latency in microseconds       */
+/*--------------------------------------------------------*/
+int set_latency(double usec)
+{
+    if (usec < 0)
+        return -1;
+    L = usec;
+    return 0;
+}
+
+/*--------------------------------------------------------*/
+/*Sets the latency of a request that is not sequential    */
+/*with the previous one, in microseconds                  */
+/*--------------------------------------------------------*/
+int set_seek_latency(double usec)
+{
+    if (usec < 0)
+        return -1;
+    S = usec;
+    return 0;
+}
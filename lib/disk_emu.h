@@ -3,3 +3,5 @@ int init_disk(char *filename, int block_size, int num_blocks);
 int read_blocks(int start_address, int nblocks, void *buffer);
 int write_blocks(int start_address, int nblocks, void *buffer);
 int close_disk();
+int set_latency(double usec);
+int set_seek_latency(double usec);
@@ -0,0 +1,123 @@
+#include "meta_region.h"
+#include "sfs_constants.h"
+
+#include "lib/disk_emu.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct _MetaRegion
+{
+    int start_block;
+    int num_blocks;
+    int record_size;
+    byte *raw;
+    byte *loaded;
+    byte *dirty;
+    int blocks_read;
+};
+
+static void load_blocks(MetaRegion *r, int first, int last);
+
+MetaRegion *mr_create(int start_block, int num_blocks, int record_size)
+{
+    MetaRegion *r = malloc(sizeof(MetaRegion));
+    r->start_block = start_block;
+    r->num_blocks = num_blocks;
+    r->record_size = record_size;
+    r->raw = calloc(num_blocks, BLOCK_SIZE);
+    r->loaded = calloc(num_blocks, 1);
+    r->dirty = calloc(num_blocks, 1);
+    r->blocks_read = 0;
+    return r;
+}
+
+void mr_reset(MetaRegion *r)
+{
+    memset(r->raw, 0, r->num_blocks * BLOCK_SIZE);
+    memset(r->loaded, 1, r->num_blocks);
+    memset(r->dirty, 1, r->num_blocks);
+    r->blocks_read = 0;
+}
+
+void mr_unload(MetaRegion *r)
+{
+    memset(r->loaded, 0, r->num_blocks);
+    memset(r->dirty, 0, r->num_blocks);
+    r->blocks_read = 0;
+}
+
+void mr_relocate(MetaRegion *r, int start_block)
+{
+    r->start_block = start_block;
+    mr_unload(r);
+}
+
+void mr_load_all(MetaRegion *r)
+{
+    read_blocks(r->start_block, r->num_blocks, r->raw);
+    memset(r->loaded, 1, r->num_blocks);
+    memset(r->dirty, 0, r->num_blocks);
+    r->blocks_read = r->num_blocks;
+}
+
+byte *mr_record(MetaRegion *r, int index)
+{
+    long off = (long) index * r->record_size;
+    load_blocks(r, off / BLOCK_SIZE, (off + r->record_size - 1) / BLOCK_SIZE);
+    return r->raw + off;
+}
+
+void mr_touch(MetaRegion *r, int index)
+{
+    long off = (long) index * r->record_size;
+    int b;
+    for (b = off / BLOCK_SIZE; b <= (off + r->record_size - 1) / BLOCK_SIZE; b++)
+        r->dirty[b] = 1;
+}
+
+void mr_flush(MetaRegion *r, MrStoreFunc store)
+{
+    int b = 0;
+    while (b < r->num_blocks) {
+        if (!r->dirty[b]) {
+            b++;
+            continue;
+        }
+
+        int end = b;
+        while (end < r->num_blocks && r->dirty[end]) end++;
+
+        int first = b * BLOCK_SIZE / r->record_size;
+        int last = (end * BLOCK_SIZE - 1) / r->record_size;
+        int i;
+        for (i = first; i <= last; i++) {
+            // Records hanging over the edge of the region are not stored.
+            if (store != NULL &&
+                    (long) (i + 1) * r->record_size <= (long) r->num_blocks * BLOCK_SIZE)
+                store(i, r->raw + (long) i * r->record_size);
+        }
+
+        write_blocks(r->start_block + b, end - b, r->raw + b * BLOCK_SIZE);
+        memset(r->dirty + b, 0, end - b);
+        b = end;
+    }
+}
+
+int mr_blocks_read(MetaRegion *r)
+{
+    return r->blocks_read;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+void load_blocks(MetaRegion *r, int first, int last)
+{
+    int b;
+    for (b = first; b <= last; b++) {
+        if (r->loaded[b]) continue;
+        read_blocks(r->start_block + b, 1, r->raw + b * BLOCK_SIZE);
+        r->loaded[b] = 1;
+        r->blocks_read++;
+    }
+}
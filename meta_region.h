@@ -0,0 +1,46 @@
+#ifndef __META_REGION_H
+#define __META_REGION_H
+
+#include "sfs_types.h"
+
+/* A fixed-size table of records stored in a contiguous range of disk
+   blocks. Blocks are read in the first time a record in them is needed
+   and only blocks holding changed records are written back. */
+typedef struct _MetaRegion MetaRegion;
+
+/* Called while flushing to copy record [index] into [dst] if the caller
+   holds a newer copy of it. */
+typedef void (*MrStoreFunc)(int index, byte *dst);
+
+MetaRegion *mr_create(int start_block, int num_blocks, int record_size);
+
+/* Forgets everything and treats the region as all zeros and all dirty,
+   for a freshly formatted disk. */
+void mr_reset(MetaRegion *r);
+
+/* Forgets everything. The region is then read on demand. */
+void mr_unload(MetaRegion *r);
+
+/* Points the region at [start_block] instead and forgets everything.
+   The region is then read on demand from there. */
+void mr_relocate(MetaRegion *r, int start_block);
+
+/* Reads the whole region with a single device request. */
+void mr_load_all(MetaRegion *r);
+
+/* Returns a pointer to the on-disk bytes of record [index], reading in
+   the blocks it spans if needed. */
+byte *mr_record(MetaRegion *r, int index);
+
+/* Marks the blocks spanned by record [index] as needing a write. */
+void mr_touch(MetaRegion *r, int index);
+
+/* Writes every dirty block, coalescing consecutive ones. Each record
+   overlapping a dirty block is first passed to [store], which may be
+   NULL if the caller edits the records in place. */
+void mr_flush(MetaRegion *r, MrStoreFunc store);
+
+/* Returns the number of blocks read from disk since the last reset. */
+int mr_blocks_read(MetaRegion *r);
+
+#endif
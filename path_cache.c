@@ -0,0 +1,134 @@
+#include "path_cache.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PC_SLOTS 256
+
+/* A directory met while resolving a path, keyed by its full path. */
+typedef struct
+{
+    char *path;
+    int dir_index;
+} CachedDir;
+
+static int walk(int dir, const char *path, int len);
+static int find_dir(const char *path, int len);
+static void remember(const char *path, int len, int dir_index);
+static uint32_t hash(const char *path, int len);
+
+static CachedDir cache[PC_SLOTS];
+
+int pc_lookup(const char *path)
+{
+    char leaf[MAX_NAME_LEN];
+    int parent = pc_lookup_parent(path, leaf);
+    if (parent == ERR_NOT_FOUND) {
+        // An empty last component is fine here: it names the root.
+        while (*path == '/') path++;
+        return *path == '\0' ? DIR_ROOT : ERR_NOT_FOUND;
+    }
+    return dir_search(parent, leaf);
+}
+
+/**
+ * The longest directory prefix of the path is looked up in the cache
+ * first; the components after it are searched for one at a time and
+ * every directory found is remembered.
+*/
+int pc_lookup_parent(const char *path, char *leaf)
+{
+    while (*path == '/') path++;
+    const char *slash = strrchr(path, '/');
+    const char *last = slash == NULL ? path : slash + 1;
+    int len = strlen(last);
+    if (len == 0 || len >= MAX_NAME_LEN) return ERR_NOT_FOUND;
+    memcpy(leaf, last, len + 1);
+
+    if (slash == NULL) return DIR_ROOT;
+    int plen = slash - path;
+    int dir = find_dir(path, plen);
+    if (dir != ERR_NOT_FOUND) return dir;
+    return walk(DIR_ROOT, path, plen);
+}
+
+void pc_forget(int dir_index)
+{
+    int i;
+    for (i = 0; i < PC_SLOTS; i++) {
+        if (cache[i].path != NULL && cache[i].dir_index == dir_index) {
+            free(cache[i].path);
+            cache[i].path = NULL;
+        }
+    }
+}
+
+void pc_reset()
+{
+    int i;
+    for (i = 0; i < PC_SLOTS; i++) {
+        free(cache[i].path);
+        cache[i].path = NULL;
+    }
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* Resolves the first [len] bytes of the path, all directories, starting
+   in [dir]. */
+int walk(int dir, const char *path, int len)
+{
+    char name[MAX_NAME_LEN];
+    int pos = 0;
+    while (pos < len) {
+        int n = 0;
+        while (pos + n < len && path[pos + n] != '/') n++;
+        if (n >= MAX_NAME_LEN) return ERR_NOT_FOUND;
+        if (n > 0) {
+            memcpy(name, path + pos, n);
+            name[n] = '\0';
+            dir = dir_search(dir, name);
+            if (dir == ERR_NOT_FOUND ||
+                    !(dir_get_flags(dir) & DIR_DIRECTORY))
+                return ERR_NOT_FOUND;
+            remember(path, pos + n, dir);
+        }
+        pos += n + 1;
+    }
+    return dir;
+}
+
+int find_dir(const char *path, int len)
+{
+    CachedDir *c = &cache[hash(path, len) % PC_SLOTS];
+    if (c->path != NULL && strncmp(c->path, path, len) == 0 &&
+            c->path[len] == '\0')
+        return c->dir_index;
+    return ERR_NOT_FOUND;
+}
+
+void remember(const char *path, int len, int dir_index)
+{
+    CachedDir *c = &cache[hash(path, len) % PC_SLOTS];
+    free(c->path);
+    c->path = malloc(len + 1);
+    memcpy(c->path, path, len);
+    c->path[len] = '\0';
+    c->dir_index = dir_index;
+}
+
+/* FNV-1a. */
+uint32_t hash(const char *path, int len)
+{
+    uint32_t h = 2166136261u;
+    int i;
+    for (i = 0; i < len; i++) {
+        h ^= (byte) path[i];
+        h *= 16777619u;
+    }
+    return h;
+}
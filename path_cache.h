@@ -0,0 +1,27 @@
+#ifndef __PATH_CACHE_H
+#define __PATH_CACHE_H
+
+#include "sfs_errors.h"
+
+/* Resolves slash separated paths to directory entries. The directories
+   met along the way are remembered by their path, so that resolving
+   another path in the same directory starts from there instead of
+   searching every component again. */
+
+/* Returns the entry the path names, DIR_ROOT for an empty path or "/",
+   or ERR_NOT_FOUND. */
+int pc_lookup(const char *path);
+
+/* Resolves every component of the path but the last, which is copied
+   into [leaf]. Returns the directory it is in, DIR_ROOT, or
+   ERR_NOT_FOUND if that directory does not exist or the last component
+   is empty or too long. */
+int pc_lookup_parent(const char *path, char *leaf);
+
+/* Forgets whatever path resolves to the entry, before it is removed. */
+void pc_forget(int dir_index);
+
+/* Forgets every path, after the directory was reloaded or repaired. */
+void pc_reset();
+
+#endif
@@ -0,0 +1,103 @@
+#include "refcount.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "meta_region.h"
+
+#include <stdint.h>
+#include <string.h>
+
+static uint16_t *count(int block);
+static void region_create();
+
+static MetaRegion *region;
+
+/* Pins held on each block, and whether its last reference was dropped
+   while pinned. */
+static uint16_t pins[TOTAL_DATA_BLOCKS];
+static byte orphaned[TOTAL_DATA_BLOCKS];
+
+void rc_init()
+{
+    region_create();
+    mr_reset(region);
+    memset(pins, 0, sizeof(pins));
+    memset(orphaned, 0, sizeof(orphaned));
+}
+
+void rc_load()
+{
+    region_create();
+    mr_unload(region);
+    memset(pins, 0, sizeof(pins));
+    memset(orphaned, 0, sizeof(orphaned));
+}
+
+void rc_flush()
+{
+    mr_flush(region, NULL);
+}
+
+int rc_get(int block)
+{
+    return *count(block) + 1;
+}
+
+void rc_set(int block, int refs)
+{
+    uint16_t extra = refs > 1 ? refs - 1 : 0;
+    if (pins[block] > 0)
+        orphaned[block] = refs == 0;
+    if (*count(block) == extra) return;
+    *count(block) = extra;
+    mr_touch(region, block);
+}
+
+void rc_ref(int block)
+{
+    (*count(block))++;
+    mr_touch(region, block);
+}
+
+int rc_unref(int block)
+{
+    if (*count(block) == 0) {
+        if (pins[block] == 0) return 0;
+        orphaned[block] = 1;
+        return pins[block];
+    }
+    (*count(block))--;
+    mr_touch(region, block);
+    return *count(block) + 1;
+}
+
+void rc_pin(int block)
+{
+    pins[block]++;
+}
+
+int rc_unpin(int block)
+{
+    if (pins[block] == 0 || --pins[block] > 0 || !orphaned[block])
+        return 1;
+    orphaned[block] = 0;
+    return 0;
+}
+
+int rc_pinned(int block)
+{
+    return pins[block] > 0;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* The records are edited in place in the region's copy of the disk. */
+uint16_t *count(int block)
+{
+    return (uint16_t*) mr_record(region, block);
+}
+
+void region_create()
+{
+    if (region == NULL)
+        region = mr_create(REFCOUNT_START, REFCOUNT_LEN, sizeof(uint16_t));
+}
@@ -0,0 +1,46 @@
+#ifndef __REFCOUNT_H
+#define __REFCOUNT_H
+
+/* Reference counts of the data blocks, stored on disk right after the
+   free list. Blocks are numbered from the start of the data region, as
+   in the free list. A block in use has at least one reference; only
+   blocks shared by several FAT entries need a count, so what is stored
+   is the number of references beyond the first, and a free block
+   always has zero of those. */
+
+/* Initialize the table for a fresh disk. */
+void rc_init();
+
+/* Prepares the table to be read from disk as counts are needed. */
+void rc_load();
+
+/* Writes the changed parts of the table to disk. */
+void rc_flush();
+
+/* Returns the number of references to the block, counting it as one if
+   the block is free. */
+int rc_get(int block);
+
+/* Sets the number of references to the block, 1 for a free block. */
+void rc_set(int block, int refs);
+
+/* Adds a reference to the block. */
+void rc_ref(int block);
+
+/* Drops a reference to the block. Returns the number left; at 0 the
+   caller frees the block. A pinned block is never left at 0; it is
+   freed by the rc_unpin that drops its last pin instead. */
+int rc_unref(int block);
+
+/* Pins the block for a read in flight, so that it is neither freed nor
+   overwritten in place until unpinned. Pins are kept in memory only. */
+void rc_pin(int block);
+
+/* Drops a pin. Returns 0 if the block lost its last reference while it
+   was pinned, in which case the caller frees it. */
+int rc_unpin(int block);
+
+/* Returns true if the block is pinned. */
+int rc_pinned(int block);
+
+#endif
@@ -1,40 +1,165 @@
 #include "sblock_cache.h"
 #include "sfs_types.h"
 #include "sfs_constants.h"
+#include "sfs_errors.h"
 
 #include "lib/disk_emu.h"
 
+#include <stddef.h>
 #include <string.h>
 
-static struct
+#define SB_MAGIC 0x31534653 /* "SFS1" */
+#define SB_VERSION 8
+
+typedef struct
 {
-    const uint16_t block_size;
-    const uint16_t num_blocks_root;
+    uint32_t magic;
+    uint16_t version;
+    uint16_t block_size;
+    uint16_t num_blocks_root;
     uint16_t num_blocks_fat;
-    const uint32_t num_data_blocks;
+    uint32_t num_data_blocks;
     uint32_t num_free_blocks;
-} super_block = {.block_size = BLOCK_SIZE, .num_blocks_root = DIRECTORY_BLOCKS, 
-    .num_data_blocks = TOTAL_DATA_BLOCKS};
+    uint16_t dir_used;
+    uint16_t fat_free_hint;
+    uint32_t generation;
+    uint32_t clean;
+    /* First block of each snapshot's metadata copy, or 0 if unused. */
+    uint32_t snapshots[MAX_SNAPSHOTS];
+    /* Covers every byte above; must stay last. */
+    uint32_t checksum;
+} SuperBlock;
+
+static uint32_t checksum(SuperBlock *sb);
+
+static SuperBlock super_block;
+
+/* Set whenever the cached super block differs from the one on disk. */
+static int dirty;
 
 void sbc_init()
 {
+    memset(&super_block, 0, sizeof(super_block));
+    super_block.magic = SB_MAGIC;
+    super_block.version = SB_VERSION;
+    super_block.block_size = BLOCK_SIZE;
+    super_block.num_blocks_root = DIRECTORY_BLOCKS;
     super_block.num_blocks_fat = FAT_BLOCKS;
-	super_block.num_free_blocks = TOTAL_DATA_BLOCKS;
+    super_block.num_data_blocks = TOTAL_DATA_BLOCKS;
+    super_block.num_free_blocks = TOTAL_DATA_BLOCKS;
+    super_block.generation = 1;
+    dirty = 1;
 }
 
-void sbc_load()
+int sbc_load()
 {
-	byte buf[BLOCK_SIZE] = {0};
+    byte buf[BLOCK_SIZE] = {0};
+    SuperBlock sb;
     read_blocks(0, 1, buf);
-    memcpy(&super_block, buf, BLOCK_SIZE);
+    memcpy(&sb, buf, sizeof(sb));
+
+    if (sb.magic != SB_MAGIC || sb.version != SB_VERSION
+        || sb.checksum != checksum(&sb))
+        return ERR_UNKNOWN;
+    if (sb.block_size != BLOCK_SIZE || sb.num_blocks_root != DIRECTORY_BLOCKS
+        || sb.num_blocks_fat != FAT_BLOCKS || sb.num_data_blocks != TOTAL_DATA_BLOCKS)
+        return ERR_UNKNOWN;
+
+    super_block = sb;
+    dirty = 0;
+    return 0;
 }
 
 void sbc_flush()
 {
-    write_blocks(0, 1, &super_block);
+    if (!dirty) return;
+    byte buf[BLOCK_SIZE] = {0};
+    super_block.checksum = checksum(&super_block);
+    memcpy(buf, &super_block, sizeof(super_block));
+    write_blocks(0, 1, buf);
+    dirty = 0;
 }
 
 void sbc_set_nfree(uint32_t n)
 {
-	super_block.num_free_blocks = n;
-}
\ No newline at end of file
+    if (super_block.num_free_blocks != n)
+        dirty = 1;
+    super_block.num_free_blocks = n;
+}
+
+uint32_t sbc_get_nfree()
+{
+    return super_block.num_free_blocks;
+}
+
+void sbc_set_hints(uint16_t dir_used, uint16_t fat_hint)
+{
+    if (super_block.dir_used != dir_used
+        || super_block.fat_free_hint != fat_hint)
+        dirty = 1;
+    super_block.dir_used = dir_used;
+    super_block.fat_free_hint = fat_hint;
+}
+
+uint16_t sbc_get_dir_used()
+{
+    return super_block.dir_used;
+}
+
+uint16_t sbc_get_fat_hint()
+{
+    return super_block.fat_free_hint;
+}
+
+int sbc_is_clean()
+{
+    return super_block.clean;
+}
+
+uint32_t sbc_get_generation()
+{
+    return super_block.generation;
+}
+
+void sbc_mark_mounted()
+{
+    super_block.clean = 0;
+    super_block.generation++;
+    dirty = 1;
+    sbc_flush();
+}
+
+void sbc_mark_clean()
+{
+    super_block.clean = 1;
+    dirty = 1;
+    sbc_flush();
+}
+
+uint32_t sbc_get_snapshot(int id)
+{
+    return super_block.snapshots[id];
+}
+
+void sbc_set_snapshot(int id, uint32_t start_block)
+{
+    super_block.snapshots[id] = start_block;
+    dirty = 1;
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+/* CRC-32 (IEEE) of the super block up to the checksum field. */
+uint32_t checksum(SuperBlock *sb)
+{
+    const byte *p = (const byte*) sb;
+    size_t len = offsetof(SuperBlock, checksum), i;
+    uint32_t crc = 0xFFFFFFFF;
+    int k;
+    for (i = 0; i < len; i++) {
+        crc ^= p[i];
+        for (k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
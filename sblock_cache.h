@@ -6,8 +6,10 @@
 /* Initialize the cache. */
 void sbc_init();
 
-/* Load the on-disk super block into memory. */
-void sbc_load();
+/* Load the on-disk super block into memory. Returns ERR_UNKNOWN, leaving
+   the cache untouched, if the block on disk has the wrong magic number,
+   version, geometry or checksum. */
+int sbc_load();
 
 /* Writes the contents of the cached super block to disk. */
 void sbc_flush();
@@ -15,4 +17,34 @@ void sbc_flush();
 /* Set the free block count. */
 void sbc_set_nfree(uint32_t n);
 
+/* Get the free block count. */
+uint32_t sbc_get_nfree();
+
+/* Save the number of directory slots in use and the FAT free entry
+   hint, so that a lazily loaded disk can allocate without scanning. */
+void sbc_set_hints(uint16_t dir_used, uint16_t fat_hint);
+
+uint16_t sbc_get_dir_used();
+
+uint16_t sbc_get_fat_hint();
+
+/* Returns true if the disk was unmounted cleanly the last time. */
+int sbc_is_clean();
+
+/* Returns the number of times the disk has been mounted. */
+uint32_t sbc_get_generation();
+
+/* Marks the disk as in use and bumps the generation, writing the super
+   block right away so that a crash leaves it marked dirty. */
+void sbc_mark_mounted();
+
+/* Marks the disk as cleanly unmounted and writes the super block. */
+void sbc_mark_clean();
+
+/* Returns the first block of snapshot [id]'s metadata, or 0 if there is
+   no such snapshot. */
+uint32_t sbc_get_snapshot(int id);
+
+void sbc_set_snapshot(int id, uint32_t start_block);
+
 #endif
\ No newline at end of file
@@ -4,110 +4,685 @@
 #include "dir_cache.h"
 #include "fat_cache.h"
 #include "free_block_list.h"
+#include "refcount.h"
+#include "dedup.h"
+#include "fragment.h"
+#include "snapshot.h"
 #include "file_descriptor.h"
+#include "file_map.h"
+#include "path_cache.h"
+#include "fsck.h"
+#include "defrag.h"
+#include "aio.h"
 
 #include "lib/disk_emu.h"
 
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #define DISK_FILE "test.disk"
 
 static void flush_caches();
-static void load_all_caches();
-static int create_file(char *name);
+static void write_caches();
+static int load_all_caches(int mode);
+static void recover();
+static int create_file(int parent, char *name);
+static int find_entry(char *path);
+static void fill_stat(int dir_index, SfsStat *st);
+static int first_after(int *slots, int n, char *name, int strict);
 static void init_caches();
+static void fs_lock();
+static void fs_unlock();
+static void init_lock();
+static int async_read(int fileID, long offset, char *buf, int length);
+static int async_write(int fileID, long offset, char *buf, int length);
+
+/* Serializes every API call. It is recursive so that API functions can
+   call each other. The caches below it are not thread safe, so it also
+   covers allocation, even though the free list has a lock per group. */
+static pthread_mutex_t api_lock;
+static pthread_once_t api_lock_once = PTHREAD_ONCE_INIT;
+
+/* Set while a snapshot is mounted. Nothing is written to the disk, and
+   every call that would change it fails with ERR_READ_ONLY. */
+static int read_only;
+
+/* The number of sfs_begin calls not yet matched by sfs_commit. While it
+   is not zero, metadata changes are only written by sfs_commit, sfs_fsync
+   and sfs_unmount. */
+static int batch_depth;
 
 void mksfs(int fresh)
 {
+    aio_drain();
+    fs_lock();
+    read_only = 0;
+    batch_depth = 0;
     init_caches();
-    if (fresh) {
+    if (fresh == 1) {
         init_fresh_disk(DISK_FILE, BLOCK_SIZE, NUM_BLOCKS);
         flush_caches();
     }
     else {
         init_disk(DISK_FILE, BLOCK_SIZE, NUM_BLOCKS);
-        load_all_caches();
+        if (load_all_caches(fresh) != 0)
+            puts("Bad super block, not mounting.");
     }
+    fs_unlock();
+}
+
+void sfs_unmount()
+{
+    aio_drain();
+    fs_lock();
+    fmap_release_all();
+    fdesc_remove_all();
+    batch_depth = 0;
+    flush_caches();
+    if (!read_only)
+        sbc_mark_clean();
+    close_disk();
+    fs_unlock();
 }
 
 void sfs_ls()
 {
+    SfsStat entries[16];
+    SfsDir dir;
+    int n, i;
 
     printf("\nListing files...\n");
-    printf("%-30s%-20s%-10s\n", "Name", "Size (bytes)", "FAT Index");
+    printf("%-30s%-20s%-10s\n", "Name", "Size (bytes)", "Blocks");
 
-    dir_iter_begin();
-    while (!dir_iter_done()) {
-        printf("%-30s%-20ld%-10d\n", 
-            dir_get_name(dir_curr_iter()), 
-            dir_get_size(dir_curr_iter()),
-            dir_get_fat_root(dir_curr_iter()));
-        dir_iter_next();
+    sfs_opendir("", NULL, &dir);
+    while ((n = sfs_readdir_batch(&dir, entries, 16)) > 0) {
+        for (i = 0; i < n; i++) {
+            printf("%-30s%-20ld%-10d\n", entries[i].name, entries[i].size,
+                entries[i].blocks);
+        }
     }
 
     printf("\n");
 }
 
+int sfs_opendir(char *path, char *prefix, SfsDir *dir)
+{
+    fs_lock();
+    int dir_index = pc_lookup(path);
+    if (dir_index == ERR_NOT_FOUND || (dir_index != DIR_ROOT &&
+            !(dir_get_flags(dir_index) & DIR_DIRECTORY))) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    fs_unlock();
+
+    dir->dir = dir_index;
+    dir->last[0] = '\0';
+    dir->prefix[0] = '\0';
+    if (prefix != NULL)
+        strncpy(dir->prefix, prefix, MAX_NAME_LEN - 1);
+    dir->prefix[MAX_NAME_LEN - 1] = '\0';
+    return 0;
+}
+
+/**
+ * The listing resumes after the last name returned, found by binary
+ * search in the directory's sorted entries. Names with the prefix are
+ * next to each other in that order, so the batch ends at the first one
+ * without it.
+*/
+int sfs_readdir_batch(SfsDir *dir, SfsStat *entries, int max)
+{
+    int *slots, n = 0, plen = strlen(dir->prefix);
+    fs_lock();
+    int total = dir_sorted(dir->dir, &slots);
+    int i = first_after(slots, total, dir->prefix, 0);
+    if (dir->last[0] != '\0' && strcmp(dir->last, dir->prefix) >= 0)
+        i = first_after(slots, total, dir->last, 1);
+    for (; i < total && n < max; i++) {
+        if (strncmp(dir_get_name(slots[i]), dir->prefix, plen) != 0) break;
+        fill_stat(slots[i], &entries[n++]);
+    }
+    if (n > 0)
+        strcpy(dir->last, entries[n - 1].name);
+    fs_unlock();
+    return n;
+}
+
+int sfs_stat(char *path, SfsStat *st)
+{
+    fs_lock();
+    int dir_index = pc_lookup(path);
+    if (dir_index == ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    if (dir_index != DIR_ROOT) {
+        fill_stat(dir_index, st);
+        fs_unlock();
+        return 0;
+    }
+
+    // The root has no entry to keep its count in.
+    memset(st, 0, sizeof(SfsStat));
+    strcpy(st->name, "/");
+    st->is_dir = 1;
+    for (dir_index = dir_next(-1); dir_index != ERR_NOT_FOUND;
+            dir_index = dir_next(dir_index))
+        st->size += dir_get_parent(dir_index) == DIR_ROOT;
+    fs_unlock();
+    return 0;
+}
+
 int sfs_fopen(char *name)
 {
-    int fileID = fdesc_search(name);
-    if (fileID == ERR_NOT_FOUND) {
-        int dir_index = dir_search(name);
-        if (dir_index == ERR_NOT_FOUND) {
-            dir_index = create_file(name);
-            if (dir_index == ERR_OUT_OF_SPACE) {
-                puts("No space to create the file.");
-                return ERR_OUT_OF_SPACE;
-            }
+    char leaf[MAX_NAME_LEN];
+    fs_lock();
+    int parent = pc_lookup_parent(name, leaf);
+    if (parent == ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    int dir_index = dir_search(parent, leaf);
+    if (dir_index == ERR_NOT_FOUND) {
+        if (read_only) {
+            fs_unlock();
+            return ERR_READ_ONLY;
+        }
+        dir_index = create_file(parent, leaf);
+        if (dir_index == ERR_OUT_OF_SPACE) {
+            puts("No space to create the file.");
+            fs_unlock();
+            return ERR_OUT_OF_SPACE;
         }
-        fileID = fdesc_create(dir_index);
+    }
+    else if (dir_get_flags(dir_index) & DIR_DIRECTORY) {
+        fs_unlock();
+        return ERR_IS_DIR;
     }
 
+    int fileID = fdesc_search(dir_index);
+    if (fileID == ERR_NOT_FOUND)
+        fileID = fdesc_create(dir_index);
+    fs_unlock();
     return fileID;
 }
 
+int sfs_mkdir(char *path)
+{
+    char leaf[MAX_NAME_LEN];
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    int parent = pc_lookup_parent(path, leaf);
+    if (parent == ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    if (dir_search(parent, leaf) != ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_EXISTS;
+    }
+    int dir_index = dir_create_entry(parent, leaf, DIR_DIRECTORY);
+    flush_caches();
+    fs_unlock();
+    return dir_index == ERR_OUT_OF_SPACE ? ERR_OUT_OF_SPACE : 0;
+}
+
 void sfs_fclose(int fileID)
 {
+    fs_lock();
+    fmap_release_file(fileID);
     int result = fdesc_remove(fileID);
     if (result == ERR_NOT_FOUND) {
         printf("No file open with id %d\n,  not closing.", fileID);
-        return;
     }
+    // Closing commits any buffered writes.
+    flush_caches();
+    fs_unlock();
 }
 
 void sfs_fwrite(int fileID, char *buf, int length)
 {
-    fdesc_write(fileID, buf, length);
+    fs_lock();
+    if (!read_only)
+        fdesc_write(fileID, buf, length);
     flush_caches();
+    fs_unlock();
 }
 
+/* Reads and seeks only move the file's pointers, unless they commit
+   buffered writes, so the caches are only flushed in that case. */
 void sfs_fread(int fileID, char *buf, int length)
 {
+    fs_lock();
+    int pending = fdesc_buffered(fileID);
     fdesc_read(fileID, buf, length);
+    if (pending > 0)
+        flush_caches();
+    fs_unlock();
+}
+
+int sfs_writev(int fileID, SfsIoVec *iov, int iovcnt)
+{
+    fs_lock();
+    int written = read_only ? ERR_READ_ONLY :
+        fdesc_writev(fileID, iov, iovcnt);
+    flush_caches();
+    fs_unlock();
+    return written;
+}
+
+int sfs_readv(int fileID, SfsIoVec *iov, int iovcnt)
+{
+    fs_lock();
+    int pending = fdesc_buffered(fileID);
+    int read = fdesc_readv(fileID, iov, iovcnt);
+    if (pending > 0)
+        flush_caches();
+    fs_unlock();
+    return read;
+}
+
+int sfs_aio_read(int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg)
+{
+    return aio_submit(async_read, fileID, offset, buf, length, cb, arg);
+}
+
+int sfs_aio_write(int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg)
+{
+    return aio_submit(async_write, fileID, offset, buf, length, cb, arg);
+}
+
+int sfs_aio_poll(int token)
+{
+    return aio_poll(token);
+}
+
+int sfs_aio_wait(int token)
+{
+    return aio_wait(token);
+}
+
+void *sfs_mmap(int fileID, int offset, int len, int prot)
+{
+    fs_lock();
+    void *addr = NULL;
+    if (!read_only || !(prot & SFS_PROT_WRITE))
+        addr = fmap_map(fileID, offset, len, prot);
+    fs_unlock();
+    return addr;
+}
+
+int sfs_msync(void *addr)
+{
+    fs_lock();
+    int result = fmap_sync(addr);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+int sfs_munmap(void *addr)
+{
+    fs_lock();
+    int result = fmap_unmap(addr);
+    flush_caches();
+    fs_unlock();
+    return result;
 }
 
 void sfs_fseek(int fileID, int loc)
 {
+    fs_lock();
+    int pending = fdesc_buffered(fileID);
     fdesc_seek(fileID, loc);
+    if (pending > 0)
+        flush_caches();
+    fs_unlock();
+}
+
+int sfs_copy_range(int src, int src_off, int dst, int dst_off, int len)
+{
+    fs_lock();
+    int result = read_only ? ERR_READ_ONLY :
+        fdesc_copy_range(src, src_off, dst, dst_off, len);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+int sfs_fallocate(int fileID, int offset, int len)
+{
+    fs_lock();
+    int result = read_only ? ERR_READ_ONLY :
+        fdesc_allocate(fileID, offset, len);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+int sfs_ftruncate(int fileID, int length)
+{
+    fs_lock();
+    int result = read_only ? ERR_READ_ONLY :
+        fdesc_truncate(fileID, length);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+int sfs_punch_hole(int fileID, int offset, int len)
+{
+    fs_lock();
+    int result = read_only ? ERR_READ_ONLY :
+        fdesc_punch(fileID, offset, len);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+int sfs_set_write_buffer(int fileID, int nblocks)
+{
+    fs_lock();
+    int result = fdesc_set_buffer(fileID, nblocks);
+    flush_caches();
+    fs_unlock();
+    return result < 0 ? result : 0;
+}
+
+int sfs_set_compression(int fileID, int on)
+{
+    fs_lock();
+    int result = read_only ? ERR_READ_ONLY :
+        fdesc_set_compression(fileID, on);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+void sfs_set_dedup(int on)
+{
+    fs_lock();
+    if (!read_only)
+        dd_set_enabled(on);
+    fs_unlock();
+}
+
+void sfs_set_tail_packing(int on)
+{
+    fs_lock();
+    if (!read_only)
+        frag_set_enabled(on);
+    fs_unlock();
+}
+
+int sfs_fsync(int fileID)
+{
+    fs_lock();
+    int result = fdesc_sync(fileID);
+    write_caches();
+    fs_unlock();
+    return result < 0 ? result : 0;
+}
+
+void sfs_begin()
+{
+    fs_lock();
+    batch_depth++;
+    fs_unlock();
+}
+
+int sfs_commit()
+{
+    fs_lock();
+    if (batch_depth == 0) {
+        fs_unlock();
+        return ERR_UNKNOWN;
+    }
+    batch_depth--;
+    flush_caches();
+    fs_unlock();
+    return 0;
+}
+
+int sfs_fsck(int repair, int nthreads, SfsFsckReport *report)
+{
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    fdesc_sync_all();
+    flush_caches();
+    int found = fsck_run(repair, nthreads, report);
+    if (repair) {
+        frag_reset();
+        pc_reset();
+        fdesc_reload_all();
+        flush_caches();
+    }
+    fs_unlock();
+    return found;
+}
+
+int sfs_extents(char *file)
+{
+    fs_lock();
+    int dir_index = find_entry(file);
+    int extents = dir_index < 0 ? dir_index : defrag_extents(dir_index);
+    fs_unlock();
+    return extents;
+}
+
+/**
+ * Each file is moved in steps of at most [step_blocks] blocks, and the
+ * lock is dropped after every step with the caches flushed, so other
+ * threads can keep using the file system (and the file being moved)
+ * while a defragmentation is running.
+*/
+int sfs_defrag(int step_blocks, SfsDefragReport *report)
+{
+    DefragJob job;
+    int nslots = 0, i, d;
+
+    memset(report, 0, sizeof(SfsDefragReport));
+    if (step_blocks < 1) step_blocks = 1;
+
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d))
+        nslots++;
+    int *slots = malloc(sizeof(int) * (nslots + 1));
+    nslots = 0;
+    for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d)) {
+        if (dir_get_flags(d) & DIR_DIRECTORY) continue;
+        slots[nslots++] = d;
+        report->extents_before += defrag_extents(d);
+    }
+    report->files = nslots;
+    fs_unlock();
+
+    for (i = 0; i < nslots; i++) {
+        fs_lock();
+        int moving = 0;
+        if (dir_is_used(slots[i]) && defrag_extents(slots[i]) > 1) {
+            moving = defrag_begin(slots[i], &job);
+            if (!moving) report->skipped_files++;
+        }
+        flush_caches();
+        fs_unlock();
+        if (!moving) continue;
+
+        int moved;
+        do {
+            fs_lock();
+            moved = defrag_step(&job, step_blocks);
+            flush_caches();
+            fs_unlock();
+            report->blocks_moved += moved;
+            report->steps += moved > 0;
+        } while (moved > 0);
+        report->moved_files++;
+    }
+
+    fs_lock();
+    for (i = 0; i < nslots; i++) {
+        if (dir_is_used(slots[i]))
+            report->extents_after += defrag_extents(slots[i]);
+    }
+    fs_unlock();
+    free(slots);
+    return 0;
 }
 
 int sfs_remove(char *file)
 {   
-    int fileID = fdesc_search(file);
-    if (fileID != ERR_NOT_FOUND)
-        sfs_fclose(fileID);
-
-    int dir_index = dir_search(file);
-    if (dir_index == ERR_NOT_FOUND) {
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    int dir_index = pc_lookup(file);
+    if (dir_index == ERR_NOT_FOUND || dir_index == DIR_ROOT) {
         printf("No file exists with name %s\n.", file);
+        fs_unlock();
         return -1;
     }
+    if (dir_get_flags(dir_index) & DIR_DIRECTORY) {
+        // A directory's size is the number of entries in it.
+        if (dir_get_size(dir_index) > 0) {
+            fs_unlock();
+            return ERR_NOT_EMPTY;
+        }
+        pc_forget(dir_index);
+    }
+    int fileID = fdesc_search(dir_index);
+    if (fileID != ERR_NOT_FOUND)
+        sfs_fclose(fileID);
 
     // Free up the fat entries and associated data blocks.
+    frag_release_file(dir_index);
     fat_clean_entry(dir_get_fat_root(dir_index));
     dir_remove(dir_index);
     flush_caches();
 
+    fs_unlock();
+    return 0;
+}
+
+/**
+ * Buffered writes are committed first so the clone sees them. Only the
+ * new entry's metadata is written.
+*/
+int sfs_clone(char *src, char *dst)
+{
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    char leaf[MAX_NAME_LEN];
+    int src_index = find_entry(src);
+    if (src_index < 0) {
+        fs_unlock();
+        return src_index;
+    }
+    int parent = pc_lookup_parent(dst, leaf);
+    if (parent == ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    if (dir_search(parent, leaf) != ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_EXISTS;
+    }
+
+    fdesc_sync_all();
+    int dst_index = dir_create_entry(parent, leaf, 0);
+    if (dst_index == ERR_OUT_OF_SPACE) {
+        fs_unlock();
+        return ERR_OUT_OF_SPACE;
+    }
+    int result = fdesc_clone(src_index, dst_index);
+    if (result != 0) {
+        fat_clean_entry(dir_get_fat_root(dst_index));
+        dir_remove(dst_index);
+    }
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+/**
+ * Open files are synced first so the snapshot sees everything written
+ * so far. Only the directory and FAT are copied; the data blocks are
+ * shared with the live volume until it overwrites them.
+*/
+int sfs_snapshot_create()
+{
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    // The snapshot is copied from the metadata on disk.
+    fdesc_sync_all();
+    write_caches();
+    int id = snap_create();
+    flush_caches();
+    fs_unlock();
+    return id;
+}
+
+int sfs_snapshot_delete(int id)
+{
+    fs_lock();
+    if (read_only) {
+        fs_unlock();
+        return ERR_READ_ONLY;
+    }
+    int result = snap_delete(id);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+/**
+ * The live volume is closed cleanly first, so that mksfs(0) can bring
+ * it back with a lazy mount.
+*/
+int sfs_snapshot_mount(int id)
+{
+    fs_lock();
+    int start = snap_start(id);
+    if (start == ERR_NOT_FOUND) {
+        fs_unlock();
+        return ERR_NOT_FOUND;
+    }
+    fmap_release_all();
+    fdesc_remove_all();
+    batch_depth = 0;
+    flush_caches();
+    if (!read_only)
+        sbc_mark_clean();
+    dir_load_copy(start);
+    fat_load_copy(start + DIRECTORY_BLOCKS);
+    pc_reset();
+    dd_set_enabled(0);
+    frag_set_enabled(0);
+    frag_reset();
+    read_only = 1;
+    fs_unlock();
     return 0;
 }
 
@@ -118,34 +693,182 @@ int sfs_remove(char *file)
  * If there are no slots left in the directory table or there are no free
  * blocks on the disk, and error message is thrown and the create is aborted.
 */
-int create_file(char *name)
+int create_file(int parent, char *name)
 {
-    int dir_index = dir_create_entry(name);
+    int dir_index = dir_create_entry(parent, name, 0);
     if (dir_index == ERR_OUT_OF_SPACE) return ERR_OUT_OF_SPACE;
     
     flush_caches();
     return dir_index;
 }
 
+/* Returns the entry of the file at [path], ERR_NOT_FOUND, or ERR_IS_DIR
+   if it is a directory. */
+int find_entry(char *path)
+{
+    int dir_index = pc_lookup(path);
+    if (dir_index == ERR_NOT_FOUND) return ERR_NOT_FOUND;
+    if (dir_index == DIR_ROOT || dir_get_flags(dir_index) & DIR_DIRECTORY)
+        return ERR_IS_DIR;
+    return dir_index;
+}
+
+/* Returns the first of the [n] sorted [slots] whose name comes after
+   [name], or is equal to it unless [strict] is set. */
+int first_after(int *slots, int n, char *name, int strict)
+{
+    int lo = 0, hi = n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        int cmp = strcmp(dir_get_name(slots[mid]), name);
+        if (cmp < 0 || (strict && cmp == 0))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void fill_stat(int dir_index, SfsStat *st)
+{
+    strncpy(st->name, dir_get_name(dir_index), MAX_NAME_LEN - 1);
+    st->name[MAX_NAME_LEN - 1] = '\0';
+    st->size = dir_get_size(dir_index);
+    st->is_dir = (dir_get_flags(dir_index) & DIR_DIRECTORY) != 0;
+    st->blocks = fat_count_blocks(dir_get_fat_root(dir_index));
+}
+
+/* Writes the caches out after a change, unless a batch is open. */
 void flush_caches()
 {
+    if (batch_depth == 0)
+        write_caches();
+}
+
+void write_caches()
+{
+    if (read_only) return;
     sbc_set_nfree(fbl_get_num_free());
+    sbc_set_hints(dir_get_used(), fat_get_free_hint());
     sbc_flush();
     dir_flush();
     fat_flush();
     fbl_flush();
+    rc_flush();
 }
 
-void load_all_caches()
+/**
+ * Mounts the disk. If it was unmounted cleanly the on-disk metadata is
+ * trusted as is, and a lazy load only reads the super block and free
+ * list; directory and FAT blocks are faulted in by their caches on
+ * first access. Otherwise everything is read and checked by recover(),
+ * unless [mode] is SFS_CHECK_MOUNT.
+*/
+int load_all_caches(int mode)
 {
-    sbc_load();
-    dir_load();
-    fat_load();
+    if (sbc_load() != 0) return ERR_UNKNOWN;
+
+    int clean = sbc_is_clean();
+    if (mode == SFS_LAZY_MOUNT && clean) {
+        dir_load_lazy(sbc_get_dir_used());
+        fat_load_lazy(sbc_get_fat_hint());
+    }
+    else {
+        dir_load();
+        fat_load();
+    }
     fbl_load();
+    rc_load();
+    dd_reset();
+    frag_reset();
+
+    if (!clean && mode != SFS_CHECK_MOUNT)
+        recover();
+    sbc_mark_mounted();
+    return 0;
+}
+
+/* Brings the allocator state back in line with the FAT after an unclean
+   shutdown. The saved free count and hints cannot be trusted either. */
+void recover()
+{
+    static int refs[TOTAL_DATA_BLOCKS];
+    memset(refs, 0, sizeof(refs));
+    snap_count_refs(refs);
+    fat_rebuild_free_list(refs);
+    flush_caches();
 }
 
 void init_caches()
 {
     sbc_init();
+    dir_init();
+    fat_init();
     fbl_init();
+    rc_init();
+    dd_reset();
+    frag_reset();
+    pc_reset();
+}
+
+/**
+ * Worker side of sfs_aio_read. The blocks are resolved under the lock,
+ * but the device reads are done after releasing it so that reads from
+ * several workers overlap their device latency. The planned blocks stay
+ * pinned until then, so a concurrent write copies them instead of
+ * writing in place, and a remove or truncate cannot hand them to
+ * another file.
+*/
+int async_read(int fileID, long offset, char *buf, int length)
+{
+    ReadPlan plan;
+    fs_lock();
+    int pending = fdesc_buffered(fileID);
+    int result = fdesc_plan_read_at(fileID, offset, length, &plan);
+    if (pending > 0)
+        flush_caches();
+    fs_unlock();
+
+    if (result <= 0) return result;
+    SfsIoVec iov = {buf, length};
+    result = fdesc_exec_read(&plan, &iov, 1);
+
+    fs_lock();
+    fdesc_unpin_read(&plan);
+    flush_caches();
+    fs_unlock();
+    return result;
+}
+
+/* Worker side of sfs_aio_write. Writes allocate and update metadata,
+   so they run entirely under the lock. */
+int async_write(int fileID, long offset, char *buf, int length)
+{
+    fs_lock();
+    int written = read_only ? ERR_READ_ONLY :
+        fdesc_write_at(fileID, offset, (byte*) buf, length);
+    if (written > 0)
+        flush_caches();
+    fs_unlock();
+    return written;
+}
+
+void fs_lock()
+{
+    pthread_once(&api_lock_once, init_lock);
+    pthread_mutex_lock(&api_lock);
+}
+
+void fs_unlock()
+{
+    pthread_mutex_unlock(&api_lock);
+}
+
+void init_lock()
+{
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&api_lock, &attr);
+    pthread_mutexattr_destroy(&attr);
 }
\ No newline at end of file
@@ -1,15 +1,111 @@
 #ifndef __SFS_API_H
 #define __SFS_API_H
 
-/* Creates the file system. */
+#include "sfs_errors.h"
+#include "sfs_constants.h"
+
+/* One buffer of a scatter/gather request. */
+typedef struct
+{
+    char *base;
+    int len;
+} SfsIoVec;
+
+/* Called on a worker thread when an asynchronous request started with
+   a callback finishes. [result] is what the synchronous call returns. */
+typedef void (*SfsAioCallback)(int token, int result, void *arg);
+
+/* Pass to mksfs to mount an existing disk without reading its directory
+   and FAT up front; their blocks are read as they are first needed. */
+#define SFS_LAZY_MOUNT 2
+
+/* Pass to mksfs to mount an existing disk as it is, without repairing
+   it after an unclean shutdown, so that sfs_fsck sees the damage. */
+#define SFS_CHECK_MOUNT 3
+
+/* Access flags for sfs_mmap. */
+#define SFS_PROT_READ 0x01
+#define SFS_PROT_WRITE 0x02
+
+/* A directory entry, as returned by sfs_readdir_batch and sfs_stat. */
+typedef struct
+{
+    char name[MAX_NAME_LEN];
+    long size;              /* bytes, or entries for a directory */
+    int blocks;             /* data blocks in use, 0 for inline files */
+    int is_dir;
+} SfsStat;
+
+/* A position in a directory listing. It belongs to the caller, so any
+   number of listings can be under way at once. [last] is the last name
+   listed, empty before the first batch. */
+typedef struct
+{
+    int dir;
+    char last[MAX_NAME_LEN];
+    char prefix[MAX_NAME_LEN];
+} SfsDir;
+
+/* What sfs_fsck found. Counts are taken before any repair. */
+typedef struct
+{
+    int files;              /* files checked */
+    int bad_dirs;           /* entries outside any directory, and
+                               directories with a wrong entry count */
+    int entries;            /* FAT entries checked */
+    int bad_chains;         /* chains with a bad link, block or a loop */
+    int cross_linked;       /* chains sharing an entry */
+    int bad_sizes;          /* files longer than their chain */
+    int leaked_entries;     /* FAT entries in use but in no chain */
+    int leaked_blocks;      /* blocks marked used but in no chain */
+    int unmarked_blocks;    /* blocks in a chain but marked free */
+    int bad_refcounts;      /* blocks whose reference count is off */
+    int remaining;          /* problems left after repairing */
+    double seconds;
+} SfsFsckReport;
+
+/* Creates the file system if [fresh] is 1, or else mounts the one
+   already on disk. Asynchronous requests still in flight are finished
+   first. */
 void mksfs(int fresh);
 
-/* Lists files in the root directory. */
+/* Closes every open file, writes out all cached state and marks the disk
+   as cleanly unmounted, so that the next mount can trust the on-disk
+   metadata without checking it. Asynchronous requests still in flight
+   are finished first; ones started after that fail with ERR_NOT_FOUND,
+   as their files are closed. Neither this nor mksfs may be called from
+   an aio callback. */
+void sfs_unmount();
+
+/* Prints a table of the files in the root directory. */
 void sfs_ls();
 
-/* Opens the given file and returns a file descriptor id. */
+/* Starts a listing of the directory at [path], "" or "/" for the root,
+   in [dir]. Only names starting with [prefix] are listed, every name if
+   it is NULL. Returns 0, or ERR_NOT_FOUND if there is no such
+   directory. */
+int sfs_opendir(char *path, char *prefix, SfsDir *dir);
+
+/* Fills in up to [max] entries of the listing and moves past them.
+   Entries come in name order, as compared by strcmp. Returns how many
+   were filled in, 0 at the end. Entries created or removed while
+   listing may or may not be seen, but no entry is seen twice. */
+int sfs_readdir_batch(SfsDir *dir, SfsStat *entries, int max);
+
+/* Fills in [st] for the file or directory at [path]. Returns 0 or
+   ERR_NOT_FOUND. */
+int sfs_stat(char *path, SfsStat *st);
+
+/* Opens the file at the given path, such as "DIR/SUB/FILE", creating
+   it if it does not exist, and returns a file descriptor id. Returns
+   ERR_NOT_FOUND if a directory on the path does not exist, or
+   ERR_IS_DIR if the path names a directory. */
 int sfs_fopen(char *name);
 
+/* Creates an empty directory at the given path. Returns 0, ERR_NOT_FOUND
+   if its parent does not exist, ERR_EXISTS, or ERR_OUT_OF_SPACE. */
+int sfs_mkdir(char *path);
+
 /* Closes the given file. */
 void sfs_fclose(int fileID);
 
@@ -19,10 +115,179 @@ void sfs_fwrite(int fileID, char *buf, int length);
 /* Reads characters from disk into [buf]. */
 void sfs_fread(int fileID, char *buf, int length);
 
+/* Writes the [iovcnt] buffers of [iov] back to back as a single write,
+   updating the file system metadata once. Returns the number of bytes
+   written. */
+int sfs_writev(int fileID, SfsIoVec *iov, int iovcnt);
+
+/* Reads into the [iovcnt] buffers of [iov] in order as a single read.
+   Returns the number of bytes read. */
+int sfs_readv(int fileID, SfsIoVec *iov, int iovcnt);
+
+/* Starts an asynchronous read of [length] bytes at [offset] into [buf],
+   which must stay valid until the request finishes. The read pointer is
+   not used or moved, so several reads can be outstanding on one file.
+   The data read is what the file held when the request started, even if
+   the file is written, truncated or removed before it finishes. Returns
+   a request token, or a negative error. If [cb] is not NULL it is called
+   on completion and the token cannot be polled or waited on. */
+int sfs_aio_read(int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg);
+
+/* Starts an asynchronous write of [length] bytes from [buf] at [offset],
+   with the same rules for [buf] and [cb] as sfs_aio_read. The write
+   pointer is not used or moved, so several writes can be outstanding on
+   one file; writes to overlapping ranges land in no particular order. */
+int sfs_aio_write(int fileID, long offset, char *buf, int length,
+    SfsAioCallback cb, void *arg);
+
+/* Returns ERR_PENDING while the request is in flight, or else the number
+   of bytes transferred (or a negative error) and releases the token. */
+int sfs_aio_poll(int token);
+
+/* Waits for the request to finish, then returns like sfs_aio_poll. */
+int sfs_aio_wait(int token);
+
+/* Maps [len] bytes at [offset] of the file into memory, stopping at the
+   end of the file, and returns a page aligned pointer to them, or NULL.
+   [prot] is SFS_PROT_READ, optionally with SFS_PROT_WRITE; writing to a
+   read-only mapping faults. The data is read in when the mapping is
+   made. Changes are written back by sfs_msync and sfs_munmap, and when
+   the file is closed, which also unmaps it. The file's pointers do not
+   move, and the mapping does not see later writes made through them. */
+void *sfs_mmap(int fileID, int offset, int len, int prot);
+
+/* Writes the changed parts of a mapping back to the file. Returns 0, or
+   ERR_NOT_FOUND if [addr] is not a mapping. */
+int sfs_msync(void *addr);
+
+/* Writes back and releases a mapping. Returns 0 or ERR_NOT_FOUND. */
+int sfs_munmap(void *addr);
+
 /* Seek to [loc] bytes from the beginning. */
 void sfs_fseek(int fileID, int loc);
 
-/* Removes the given file from the file system. */
+/* Copies [len] bytes at [src_off] of the open file [src] to [dst_off] of
+   the open file [dst] inside the file system, streaming the data from
+   block to block without a caller's buffer and updating the metadata
+   once. Neither file's pointers move. Within one file the two ranges
+   must not overlap. Returns the number of bytes copied, which is short
+   if the source ends first or the disk fills up, or a negative error. */
+int sfs_copy_range(int src, int src_off, int dst, int dst_off, int len);
+
+/* Reserves disk space for [offset, offset + len) of the file in one
+   contiguous run without writing it; the reserved range reads as zeros
+   until it is written. The file size is unchanged, so later appends
+   fill the reservation without allocating. Returns 0 on success or
+   ERR_OUT_OF_SPACE. */
+int sfs_fallocate(int fileID, int offset, int len);
+
+/* Sets the size of the file to [length] bytes. Shrinking frees the
+   blocks past the new end; growing leaves a hole that reads as zeros
+   and uses no data blocks. Returns 0 on success. */
+int sfs_ftruncate(int fileID, int length);
+
+/* Turns [offset, offset + len) of the file into a hole that reads as
+   zeros, freeing the data blocks it fully covers. The file size does
+   not change. Returns 0 on success. */
+int sfs_punch_hole(int fileID, int offset, int len);
+
+/* Buffers up to [nblocks] blocks of writes to the file in memory. They
+   are committed when the buffer fills, and on seek, read, close and
+   sfs_fsync. Zero turns buffering off. Returns 0 on success. */
+int sfs_set_write_buffer(int fileID, int nblocks);
+
+/* Stores the file's data compressed if [on] is set. Data is compressed
+   in clusters of a few blocks, each rewritten whole when any part of it
+   changes, so small appends are best combined with a write buffer.
+   sfs_fallocate is not supported on compressed files. Only allowed
+   while the file is empty; returns 0, or ERR_UNKNOWN if it is not. */
+int sfs_set_compression(int fileID, int on);
+
+/* Turns block-level deduplication on or off for every file. While on,
+   a block written with the same contents as one written earlier since
+   mounting shares that block instead of taking a new one. Shared blocks
+   are copied before being changed. Off by default. */
+void sfs_set_dedup(int on);
+
+/* Turns tail packing on or off for every file. While on, closing a file
+   packs its partial last block together with those of other files into
+   shared fragment blocks. A packed tail moves back to a block of its own
+   the next time the file is changed. Off by default. */
+void sfs_set_tail_packing(int on);
+
+/* Creates the file [dst] as a copy of [src] that shares its data blocks
+   instead of copying them. A shared block is copied the first time
+   either file changes it. Returns 0, ERR_NOT_FOUND if there is no
+   [src], ERR_EXISTS if [dst] already exists, or ERR_OUT_OF_SPACE. */
+int sfs_clone(char *src, char *dst);
+
+/* Takes a copy-on-write snapshot of the whole volume. Only metadata is
+   copied; from then on blocks shared with the snapshot are copied before
+   the live volume changes them. Returns the snapshot's id, or
+   ERR_OUT_OF_SPACE if there are already MAX_SNAPSHOTS of them or not
+   enough contiguous free space for the copy. */
+int sfs_snapshot_create();
+
+/* Deletes a snapshot, freeing the blocks only it was using. Returns 0 or
+   ERR_NOT_FOUND. */
+int sfs_snapshot_delete(int id);
+
+/* Closes every open file and mounts the snapshot read-only in place of
+   the live volume. Calls that would change the disk then fail with
+   ERR_READ_ONLY, or do nothing. Remounting with mksfs goes back to the
+   live volume. Returns 0 or ERR_NOT_FOUND. */
+int sfs_snapshot_mount(int id);
+
+/* Commits any buffered writes and file system metadata to disk. Returns
+   0 on success. */
+int sfs_fsync(int fileID);
+
+/* Starts a batch of changes. Until the matching sfs_commit, changes to
+   the directory, FAT and free list are kept in memory and written once
+   at the end instead of after every call, which makes creating or
+   removing many files much cheaper. Batches nest; only the outermost
+   sfs_commit writes. sfs_fsync and sfs_unmount still write everything.
+   After a crash the disk is as it was at the last write, and files
+   changed in the batch may hold data written during it. */
+void sfs_begin();
+
+/* Ends a batch started by sfs_begin. Returns 0, or ERR_UNKNOWN if no
+   batch was open. */
+int sfs_commit();
+
+/* Checks that the directory, the FAT chains, the free list and the block
+   reference counts agree, using [nthreads] threads. If [repair] is set,
+   broken and cross-linked chains are cut short (the file with the lower
+   directory slot keeps a shared entry), leaked entries are freed and the
+   free list and reference counts are rebuilt.
+   Fills in [report] and returns the number of problems found. */
+int sfs_fsck(int repair, int nthreads, SfsFsckReport *report);
+
+/* What sfs_defrag did. */
+typedef struct
+{
+    int files;              /* files looked at */
+    int moved_files;        /* files moved into a single run */
+    int skipped_files;      /* fragmented, but no free run big enough */
+    int blocks_moved;
+    int steps;
+    int extents_before;     /* contiguous runs of data, over all files */
+    int extents_after;
+} SfsDefragReport;
+
+/* Returns the number of physically contiguous runs of data blocks in
+   the file, 1 for an unfragmented file, or ERR_NOT_FOUND. */
+int sfs_extents(char *file);
+
+/* Moves each fragmented file into one contiguous run of free blocks,
+   copying at most [step_blocks] blocks per step. Other calls, including
+   reads and writes to the files being moved, can run between steps.
+   Fills in [report] and returns 0. */
+int sfs_defrag(int step_blocks, SfsDefragReport *report);
+
+/* Removes the given file, or empty directory, from the file system.
+   Returns 0, or ERR_NOT_EMPTY for a directory that still has entries. */
 int sfs_remove(char *file);
 
 #endif
\ No newline at end of file
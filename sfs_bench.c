@@ -0,0 +1,1281 @@
+/* sfs_bench.c
+ *
+ * Micro benchmarks for the file system API. Run with no arguments to
+ * run every benchmark, or pass the names of the ones to run.
+ */
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "sfs_api.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+#include "fat_cache.h"
+#include "free_block_list.h"
+#include "slab.h"
+#include "lib/disk_emu.h"
+
+#define HEADER_BYTES 16
+#define PAYLOAD_BYTES 240
+#define NUM_RECORDS 1000
+
+#define AIO_FILES 64
+#define AIO_FILE_BYTES (4 * 512)
+#define AIO_LATENCY_USEC 500
+
+#define APPEND_BYTES (256 * 1024)
+#define APPEND_MAX_OPS 4000
+#define APPEND_BUFFER_BLOCKS 16
+
+#define INTERLEAVE_FILES 8
+#define INTERLEAVE_BLOCKS 64
+
+#define MOUNT_LATENCY_USEC 200
+
+#define DEFRAG_SEEK_USEC 500
+#define DEFRAG_BLOCK_USEC 20
+#define DEFRAG_STEP_BLOCKS 16
+
+#define LOG_BYTES (256 * 1024)
+#define LOG_BLOCK_USEC 50
+
+#define TINY_FILES 150
+#define TINY_BLOCK_USEC 50
+
+#define TAIL_FILES 150
+#define TAIL_MIN_BYTES 300
+#define TAIL_MAX_BYTES 1300
+
+#define DEDUP_FILES 12
+#define DEDUP_FILE_BLOCKS 256
+#define DEDUP_UNIQUE_EVERY 16
+#define DEDUP_BLOCK_USEC 20
+
+#define CLONE_FILE_BLOCKS 1024
+#define CLONE_BLOCK_USEC 20
+
+#define COPY_FILE_BLOCKS 1024
+#define COPY_BLOCK_USEC 20
+
+#define MMAP_FILE_BLOCKS 2048
+#define MMAP_BLOCK_USEC 20
+
+#define RANDOM_READS 5000
+#define RANDOM_RUNS 5
+
+#define SNAP_FILE_BLOCKS 250
+#define SNAP_BLOCK_USEC 20
+
+#define LOOKUP_FILES 150
+#define LOOKUP_BLOCK_USEC 200
+
+#define SCAN_BLOCK_USEC 200
+
+#define READDIR_FILES 1000
+#define READDIR_BATCH 64
+
+#define STORM_FILES 500
+#define STORM_BLOCK_USEC 20
+
+#define ALLOC_FILES 150
+#define ALLOC_FILE_BLOCKS 24
+#define ALLOC_ROUNDS 10
+
+#define GROUP_ALLOCS 64
+#define GROUP_ROUNDS 200
+#define GROUP_WRITE_BLOCKS 48
+
+#define FSCK_FILES 150
+#define FSCK_FILE_BLOCKS 26
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Appends header + payload records, once with two sfs_fwrite calls
+   per record and once with a single two-buffer sfs_writev. */
+static void bench_writev()
+{
+    char header[HEADER_BYTES], payload[PAYLOAD_BYTES];
+    SfsIoVec iov[2] = {{header, HEADER_BYTES}, {payload, PAYLOAD_BYTES}};
+    double t0, single, vector;
+    int i;
+
+    memset(header, 'H', HEADER_BYTES);
+    memset(payload, 'P', PAYLOAD_BYTES);
+    mksfs(1);
+
+    int fd = sfs_fopen("SINGLE.DAT");
+    t0 = now();
+    for (i = 0; i < NUM_RECORDS; i++) {
+        sfs_fwrite(fd, header, HEADER_BYTES);
+        sfs_fwrite(fd, payload, PAYLOAD_BYTES);
+    }
+    single = now() - t0;
+    sfs_fclose(fd);
+
+    fd = sfs_fopen("VECTOR.DAT");
+    t0 = now();
+    for (i = 0; i < NUM_RECORDS; i++)
+        sfs_writev(fd, iov, 2);
+    vector = now() - t0;
+    sfs_fclose(fd);
+
+    printf("writev: %d records of %d+%d bytes\n", NUM_RECORDS,
+        HEADER_BYTES, PAYLOAD_BYTES);
+    printf("  2 x sfs_fwrite  %10.0f records/s\n", NUM_RECORDS / single);
+    printf("  1 x sfs_writev  %10.0f records/s  (%.2fx)\n",
+        NUM_RECORDS / vector, single / vector);
+}
+
+static void open_aio_files(int *fds, char names[][16])
+{
+    int i;
+    for (i = 0; i < AIO_FILES; i++) {
+        sfs_fclose(fds[i]);
+        fds[i] = sfs_fopen(names[i]);
+    }
+}
+
+/* Reads a set of small files with device latency switched on, first
+   one at a time with sfs_fread and then with up to [depth] requests
+   in flight through the asynchronous API. */
+static void bench_aio()
+{
+    static char bufs[AIO_FILES][AIO_FILE_BYTES];
+    char names[AIO_FILES][16];
+    int fds[AIO_FILES], tokens[AIO_FILES];
+    int depths[] = {1, 2, 4, 8, 16};
+    double t0, sync;
+    int i, d;
+
+    mksfs(1);
+    memset(bufs, 'a', sizeof(bufs));
+    for (i = 0; i < AIO_FILES; i++) {
+        sprintf(names[i], "AIO%03d.DAT", i);
+        fds[i] = sfs_fopen(names[i]);
+        sfs_fwrite(fds[i], bufs[i], AIO_FILE_BYTES);
+    }
+
+    set_latency(AIO_LATENCY_USEC);
+    printf("aio: %d files of %d bytes, %d us per block\n", AIO_FILES,
+        AIO_FILE_BYTES, AIO_LATENCY_USEC);
+
+    open_aio_files(fds, names);
+    t0 = now();
+    for (i = 0; i < AIO_FILES; i++)
+        sfs_fread(fds[i], bufs[i], AIO_FILE_BYTES);
+    sync = now() - t0;
+    printf("  sync             %8.1f files/s\n", AIO_FILES / sync);
+
+    for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+        int depth = depths[d], issued = 0, done = 0;
+        open_aio_files(fds, names);
+        t0 = now();
+        while (done < AIO_FILES) {
+            while (issued < AIO_FILES && issued - done < depth) {
+                tokens[issued] = sfs_aio_read(fds[issued], 0, bufs[issued],
+                    AIO_FILE_BYTES, NULL, NULL);
+                issued++;
+            }
+            sfs_aio_wait(tokens[done++]);
+        }
+        double t = now() - t0;
+        printf("  async depth %-4d %8.1f files/s  (%.2fx)\n", depth,
+            AIO_FILES / t, sync / t);
+    }
+
+    set_latency(0);
+    for (i = 0; i < AIO_FILES; i++)
+        sfs_fclose(fds[i]);
+}
+
+/* Appends [size] byte records to a fresh file, returning ops/sec. */
+static double run_appends(int size, int buffer_blocks)
+{
+    char *buf = malloc(size);
+    int ops = APPEND_BYTES / size, i;
+    if (ops > APPEND_MAX_OPS) ops = APPEND_MAX_OPS;
+    memset(buf, 'x', size);
+
+    int fd = sfs_fopen("APPEND.DAT");
+    sfs_set_write_buffer(fd, buffer_blocks);
+    double t0 = now();
+    for (i = 0; i < ops; i++)
+        sfs_fwrite(fd, buf, size);
+    sfs_fclose(fd);
+    double t = now() - t0;
+
+    sfs_remove("APPEND.DAT");
+    free(buf);
+    return ops / t;
+}
+
+/* Small appends with and without a per-descriptor write buffer. The
+   buffered time includes the final commit on close. */
+static void bench_append()
+{
+    int sizes[] = {16, 64, 256, 1024, 4096}, i;
+
+    mksfs(1);
+    printf("append: ops/s, unbuffered vs %d block write buffer\n",
+        APPEND_BUFFER_BLOCKS);
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        double plain = run_appends(sizes[i], 0);
+        double buffered = run_appends(sizes[i], APPEND_BUFFER_BLOCKS);
+        printf("  %5d bytes  %10.0f  %10.0f  (%.1fx)\n", sizes[i], plain,
+            buffered, buffered / plain);
+    }
+}
+
+/* Round-robin appends of one block to several files at once. Reports
+   the average number of physically contiguous extents per file. */
+static void run_interleaved(int buffer_blocks)
+{
+    char block[512], name[16];
+    int fds[INTERLEAVE_FILES], i, j, extents = 0;
+
+    mksfs(1);
+    memset(block, 'i', sizeof(block));
+    for (i = 0; i < INTERLEAVE_FILES; i++) {
+        sprintf(name, "PAR%d.DAT", i);
+        fds[i] = sfs_fopen(name);
+        sfs_set_write_buffer(fds[i], buffer_blocks);
+    }
+
+    double t0 = now();
+    for (j = 0; j < INTERLEAVE_BLOCKS; j++)
+        for (i = 0; i < INTERLEAVE_FILES; i++)
+            sfs_fwrite(fds[i], block, sizeof(block));
+    for (i = 0; i < INTERLEAVE_FILES; i++)
+        sfs_fclose(fds[i]);
+    double t = now() - t0;
+
+    for (i = 0; i < INTERLEAVE_FILES; i++) {
+        sprintf(name, "PAR%d.DAT", i);
+        extents += fat_count_extents(dir_get_fat_root(dir_search(DIR_ROOT, name)));
+    }
+    printf("  buffer %3d blocks  %6.1f extents/file  %8.0f blocks/s\n",
+        buffer_blocks, (double) extents / INTERLEAVE_FILES,
+        INTERLEAVE_FILES * INTERLEAVE_BLOCKS / t);
+}
+
+/* Parallel writers with allocation at write time versus allocation
+   delayed until the buffered range is committed. */
+static void bench_delalloc()
+{
+    printf("delalloc: %d files, %d blocks each, written round robin\n",
+        INTERLEAVE_FILES, INTERLEAVE_BLOCKS);
+    run_interleaved(0);
+    run_interleaved(16);
+    run_interleaved(INTERLEAVE_BLOCKS);
+}
+
+/* Mounts the disk, then opens and reads from the first file created,
+   with device latency on so that block reads show up in the time. */
+static void time_first_open(int mode, const char *label)
+{
+    char c;
+    set_latency(MOUNT_LATENCY_USEC);
+    double t0 = now();
+    mksfs(mode);
+    int fd = sfs_fopen("VOL000.DAT");
+    sfs_fread(fd, &c, 1);
+    double t = now() - t0;
+    set_latency(0);
+    sfs_fclose(fd);
+    printf("    %-6s %8.2f ms, %3d metadata blocks read\n", label,
+        t * 1000, dir_blocks_read() + fat_blocks_read());
+}
+
+/* Time to first open as the volume fills up, after an unclean shutdown
+   (which pays for recovery) and after clean unmounts, eager and lazy. */
+static void bench_mount()
+{
+    int counts[] = {10, 50, 150}, c, i;
+    char name[16], block[512];
+
+    memset(block, 'm', sizeof(block));
+    printf("mount: %d us per block\n", MOUNT_LATENCY_USEC);
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        mksfs(1);
+        for (i = 0; i < counts[c]; i++) {
+            sprintf(name, "VOL%03d.DAT", i % 1000);
+            int fd = sfs_fopen(name);
+            sfs_fwrite(fd, block, sizeof(block));
+            sfs_fclose(fd);
+        }
+        printf("  %d files, mount to first read\n", counts[c]);
+        time_first_open(0, "dirty");
+        sfs_unmount();
+        time_first_open(0, "eager");
+        sfs_unmount();
+        time_first_open(SFS_LAZY_MOUNT, "lazy");
+    }
+}
+
+/* Reads each of the interleaved files back in one call. Returns KB/s. */
+static double read_interleaved()
+{
+    char *buf = malloc(INTERLEAVE_BLOCKS * 512), name[16];
+    int i;
+
+    set_latency(DEFRAG_BLOCK_USEC);
+    set_seek_latency(DEFRAG_SEEK_USEC);
+    double t0 = now();
+    for (i = 0; i < INTERLEAVE_FILES; i++) {
+        sprintf(name, "PAR%d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fread(fd, buf, INTERLEAVE_BLOCKS * 512);
+        sfs_fclose(fd);
+    }
+    double t = now() - t0;
+    set_latency(0);
+    set_seek_latency(0);
+    free(buf);
+    return INTERLEAVE_FILES * INTERLEAVE_BLOCKS * 512 / 1024 / t;
+}
+
+/* Sequential reads of files written round robin, before and after an
+   online defragmentation. */
+static void bench_defrag()
+{
+    char block[512], name[16];
+    int fds[INTERLEAVE_FILES], i, j;
+    SfsDefragReport r;
+
+    mksfs(1);
+    memset(block, 'd', sizeof(block));
+    for (i = 0; i < INTERLEAVE_FILES; i++) {
+        sprintf(name, "PAR%d.DAT", i);
+        fds[i] = sfs_fopen(name);
+    }
+    for (j = 0; j < INTERLEAVE_BLOCKS; j++)
+        for (i = 0; i < INTERLEAVE_FILES; i++)
+            sfs_fwrite(fds[i], block, sizeof(block));
+    for (i = 0; i < INTERLEAVE_FILES; i++)
+        sfs_fclose(fds[i]);
+
+    printf("defrag: %d files of %d blocks written round robin, "
+        "%d us per seek, %d us per block\n", INTERLEAVE_FILES,
+        INTERLEAVE_BLOCKS, DEFRAG_SEEK_USEC, DEFRAG_BLOCK_USEC);
+    double before = read_interleaved();
+    double t0 = now();
+    sfs_defrag(DEFRAG_STEP_BLOCKS, &r);
+    double t = now() - t0;
+    double after = read_interleaved();
+    printf("  extents  %5d -> %d, %d blocks moved in %d steps, %.1f ms\n",
+        r.extents_before, r.extents_after, r.blocks_moved, r.steps, t * 1000);
+    printf("  read     %5.0f -> %.0f KB/s (%.1fx)\n", before, after,
+        after / before);
+}
+
+/* Fills [buf] with log lines much like the ones our services write. */
+static void make_log(char *buf, int n)
+{
+    char line[128];
+    int pos = 0, i = 0;
+    while (pos < n) {
+        int len = sprintf(line, "2026-10-19 12:%02d:%02d INFO request %d "
+            "served in %d ms\n", i / 60 % 60, i % 60, i, i * 7 % 300);
+        memcpy(buf + pos, line, len < n - pos ? len : n - pos);
+        pos += len;
+        i++;
+    }
+}
+
+/* Writes and reads back a log file, once plain and once compressed. */
+static void run_log(int compressed, char *log)
+{
+    char *back = malloc(LOG_BYTES);
+    int blocks = 0, fat;
+
+    mksfs(1);
+    int fd = sfs_fopen("APP.LOG");
+    sfs_set_compression(fd, compressed);
+    sfs_set_write_buffer(fd, 16);
+    double t0 = now();
+    sfs_fwrite(fd, log, LOG_BYTES);
+    sfs_fsync(fd);
+    double tw = now() - t0;
+
+    for (fat = dir_get_fat_root(dir_search(DIR_ROOT, "APP.LOG")); fat != END_OF_FILE;
+            fat = fat_get_next_index(fat))
+        blocks += fat_get_data_block(fat) != NO_DATA;
+
+    set_latency(LOG_BLOCK_USEC);
+    sfs_fseek(fd, 0);
+    t0 = now();
+    sfs_fread(fd, back, LOG_BYTES);
+    double tr = now() - t0;
+    set_latency(0);
+    sfs_fclose(fd);
+
+    printf("  %-10s %4d blocks  %5.2f blocks/KB  write %6.0f KB/s  "
+        "read %6.0f KB/s%s\n", compressed ? "compressed" : "plain",
+        blocks, blocks / (LOG_BYTES / 1024.0), LOG_BYTES / 1024 / tw,
+        LOG_BYTES / 1024 / tr, memcmp(log, back, LOG_BYTES) ? "  MISMATCH" : "");
+    free(back);
+}
+
+/* Space and read cost of a text log with and without compression. */
+static void bench_compress()
+{
+    char *log = malloc(LOG_BYTES);
+    make_log(log, LOG_BYTES);
+    printf("compress: %d KB log, reads at %d us per block\n",
+        LOG_BYTES / 1024, LOG_BLOCK_USEC);
+    run_log(0, log);
+    run_log(1, log);
+    free(log);
+}
+
+/* Writes small files of assorted sizes with tail packing off or on, then
+   reads each back once after a lazy mount. */
+static void run_tails(int on)
+{
+    char name[16], data[TAIL_MAX_BYTES];
+    long bytes = 0;
+    int i;
+
+    memset(data, 'p', sizeof(data));
+    mksfs(1);
+    sfs_set_tail_packing(on);
+    int free0 = fbl_get_num_free();
+    for (i = 0; i < TAIL_FILES; i++) {
+        int len = TAIL_MIN_BYTES +
+            (i * 97) % (TAIL_MAX_BYTES - TAIL_MIN_BYTES);
+        sprintf(name, "TAIL%03d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, len);
+        sfs_fclose(fd);
+        bytes += len;
+    }
+    int used = free0 - fbl_get_num_free();
+    sfs_set_tail_packing(0);
+    sfs_unmount();
+
+    mksfs(SFS_LAZY_MOUNT);
+    set_latency(TINY_BLOCK_USEC);
+    double t0 = now();
+    for (i = 0; i < TAIL_FILES; i++) {
+        sprintf(name, "TAIL%03d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fread(fd, data, sizeof(data));
+        sfs_fclose(fd);
+    }
+    double t = now() - t0;
+    set_latency(0);
+    printf("  %-7s %4d data blocks  %5.1f%% full  %7.1f us per file\n",
+        on ? "packed" : "plain", used, 100.0 * bytes / (used * 512.0),
+        t * 1e6 / TAIL_FILES);
+}
+
+/* Space efficiency and read time of small files with tail packing. */
+static void bench_tailpack()
+{
+    printf("tailpack: %d files of %d to %d bytes, reads at %d us per "
+        "block\n", TAIL_FILES, TAIL_MIN_BYTES, TAIL_MAX_BYTES,
+        TINY_BLOCK_USEC);
+    run_tails(0);
+    run_tails(1);
+}
+
+/* Writes copies of one image that each differ in every
+   DEDUP_UNIQUE_EVERY-th block, like a set of backups. */
+static void run_dedup(int on)
+{
+    int bytes = DEDUP_FILE_BLOCKS * 512, i, j;
+    char name[16], *data = malloc(bytes), *back = malloc(bytes);
+    int bad = 0;
+
+    mksfs(1);
+    sfs_set_dedup(on);
+    int free0 = fbl_get_num_free();
+    set_latency(DEDUP_BLOCK_USEC);
+    double t0 = now();
+    for (i = 0; i < DEDUP_FILES; i++) {
+        for (j = 0; j < bytes; j++)
+            data[j] = (j / 512) % DEDUP_UNIQUE_EVERY ? j / 512 + j % 7 : i;
+        sprintf(name, "IMG%03d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, bytes);
+        sfs_fclose(fd);
+    }
+    double t = now() - t0;
+    set_latency(0);
+    int used = free0 - fbl_get_num_free();
+
+    // Read the last image back to make sure sharing kept it intact.
+    int fd = sfs_fopen(name);
+    sfs_fread(fd, back, bytes);
+    sfs_fclose(fd);
+    bad = memcmp(data, back, bytes) != 0;
+    sfs_set_dedup(0);
+
+    printf("  %-6s %5d blocks for %5d written  write %6.0f KB/s%s\n",
+        on ? "dedup" : "plain", used, DEDUP_FILES * DEDUP_FILE_BLOCKS,
+        DEDUP_FILES * bytes / 1024 / t, bad ? "  MISMATCH" : "");
+    free(data);
+    free(back);
+}
+
+/* Space used by near-identical files with and without deduplication. */
+static void bench_dedup()
+{
+    printf("dedup: %d files of %d blocks, 1 in %d blocks unique, "
+        "%d us per block\n", DEDUP_FILES, DEDUP_FILE_BLOCKS,
+        DEDUP_UNIQUE_EVERY, DEDUP_BLOCK_USEC);
+    run_dedup(0);
+    run_dedup(1);
+}
+
+/* Space and read time of many tiny files, at sizes that fit in the
+   directory entry and one that does not. Each file is opened and read
+   once after a lazy mount. */
+static void bench_tiny()
+{
+    int sizes[] = {20, 200, 300}, s, i;
+    char name[16], data[512];
+
+    memset(data, 't', sizeof(data));
+    printf("tiny: %d files, reads at %d us per block\n", TINY_FILES,
+        TINY_BLOCK_USEC);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        mksfs(1);
+        int free0 = fbl_get_num_free();
+        for (i = 0; i < TINY_FILES; i++) {
+            sprintf(name, "TINY%03d.CFG", i);
+            int fd = sfs_fopen(name);
+            sfs_fwrite(fd, data, sizes[s]);
+            sfs_fclose(fd);
+        }
+        int used = free0 - fbl_get_num_free();
+        sfs_unmount();
+
+        mksfs(SFS_LAZY_MOUNT);
+        set_latency(TINY_BLOCK_USEC);
+        double t0 = now();
+        for (i = 0; i < TINY_FILES; i++) {
+            sprintf(name, "TINY%03d.CFG", i);
+            int fd = sfs_fopen(name);
+            sfs_fread(fd, data, sizes[s]);
+            sfs_fclose(fd);
+        }
+        double t = now() - t0;
+        set_latency(0);
+        printf("  %3d bytes  %4d data blocks  %4d FAT blocks read  "
+            "%7.1f us per file\n", sizes[s], used, fat_blocks_read(),
+            t * 1e6 / TINY_FILES);
+    }
+}
+
+/* Duplicating a large file by reading it and writing it back out,
+   against cloning it. */
+static void bench_clone()
+{
+    int bytes = CLONE_FILE_BLOCKS * 512;
+    char *data = malloc(bytes);
+
+    memset(data, 'c', bytes);
+    mksfs(1);
+    int fd = sfs_fopen("ORIG.DAT");
+    sfs_fwrite(fd, data, bytes);
+    sfs_fclose(fd);
+    printf("clone: file of %d blocks, %d us per block\n", CLONE_FILE_BLOCKS,
+        CLONE_BLOCK_USEC);
+
+    int free0 = fbl_get_num_free();
+    set_latency(CLONE_BLOCK_USEC);
+    double t0 = now();
+    fd = sfs_fopen("ORIG.DAT");
+    sfs_fread(fd, data, bytes);
+    sfs_fclose(fd);
+    fd = sfs_fopen("COPY.DAT");
+    sfs_fwrite(fd, data, bytes);
+    sfs_fclose(fd);
+    double t = now() - t0;
+    set_latency(0);
+    printf("  read+write  %8.2f ms  %5d blocks used\n", t * 1000,
+        free0 - fbl_get_num_free());
+
+    free0 = fbl_get_num_free();
+    set_latency(CLONE_BLOCK_USEC);
+    t0 = now();
+    sfs_clone("ORIG.DAT", "CLONE.DAT");
+    t = now() - t0;
+    set_latency(0);
+    printf("  sfs_clone   %8.2f ms  %5d blocks used\n", t * 1000,
+        free0 - fbl_get_num_free());
+    free(data);
+}
+
+/* Copies COPY_FILE_BLOCKS blocks from one file to another through the
+   caller's buffer, [chunk] bytes at a time. */
+static double copy_loop(int src, int dst, int chunk)
+{
+    int bytes = COPY_FILE_BLOCKS * 512, done;
+    char *buf = malloc(chunk);
+    sfs_fseek(src, 0);
+    sfs_fseek(dst, 0);
+    double t0 = now();
+    for (done = 0; done < bytes; done += chunk) {
+        sfs_fread(src, buf, chunk);
+        sfs_fwrite(dst, buf, chunk);
+    }
+    double t = now() - t0;
+    free(buf);
+    return bytes / 1024 / t;
+}
+
+/* Copying between files with sfs_copy_range against a read and write
+   loop in user space. */
+static void bench_copyrange()
+{
+    int bytes = COPY_FILE_BLOCKS * 512;
+    char *data = malloc(bytes);
+
+    memset(data, 'r', bytes);
+    mksfs(1);
+    int src = sfs_fopen("SRC.DAT");
+    sfs_fwrite(src, data, bytes);
+    free(data);
+    printf("copyrange: %d blocks, %d us per block\n", COPY_FILE_BLOCKS,
+        COPY_BLOCK_USEC);
+
+    int chunks[] = {512, 16 * 512}, c;
+    set_latency(COPY_BLOCK_USEC);
+    for (c = 0; c < 2; c++) {
+        int dst = sfs_fopen("DST.DAT");
+        printf("  user loop, %5d byte chunks  %7.0f KB/s\n", chunks[c],
+            copy_loop(src, dst, chunks[c]));
+        sfs_fclose(dst);
+        sfs_remove("DST.DAT");
+    }
+    int dst = sfs_fopen("DST.DAT");
+    double t0 = now();
+    sfs_copy_range(src, 0, dst, 0, bytes);
+    double t = now() - t0;
+    printf("  sfs_copy_range              %7.0f KB/s\n", bytes / 1024 / t);
+    set_latency(0);
+    sfs_fclose(dst);
+    sfs_fclose(src);
+}
+
+/* Counts the newlines in a file read [chunk] bytes at a time. */
+static int scan_reads(int fd, int chunk)
+{
+    char *buf = malloc(chunk);
+    int lines = 0, done, i;
+    sfs_fseek(fd, 0);
+    for (done = 0; done < MMAP_FILE_BLOCKS * 512; done += chunk) {
+        sfs_fread(fd, buf, chunk);
+        for (i = 0; i < chunk; i++)
+            lines += buf[i] == '\n';
+    }
+    free(buf);
+    return lines;
+}
+
+/* Scanning a file in place through sfs_mmap against reading it. */
+static void bench_mmap()
+{
+    int bytes = MMAP_FILE_BLOCKS * 512, i, lines;
+    char *data = malloc(bytes);
+
+    for (i = 0; i < bytes; i++)
+        data[i] = i % 64 == 63 ? '\n' : 'm';
+    mksfs(1);
+    int fd = sfs_fopen("SCAN.DAT");
+    sfs_fwrite(fd, data, bytes);
+    free(data);
+    printf("mmap: scan of %d blocks\n", MMAP_FILE_BLOCKS);
+
+    int chunks[] = {512, 64 * 512}, latency[] = {0, MMAP_BLOCK_USEC}, c, l;
+    for (l = 0; l < 2; l++) {
+        printf("  %d us per block\n", latency[l]);
+        set_latency(latency[l]);
+        for (c = 0; c < 2; c++) {
+            double t0 = now();
+            lines = scan_reads(fd, chunks[c]);
+            double t = now() - t0;
+            printf("    sfs_fread, %5d byte chunks  %8.2f ms  %d lines\n",
+                chunks[c], t * 1000, lines);
+        }
+        double t0 = now();
+        char *map = sfs_mmap(fd, 0, bytes, SFS_PROT_READ);
+        double t_map = now() - t0;
+        for (i = 0, lines = 0; i < bytes; i++)
+            lines += map[i] == '\n';
+        double t = now() - t0;
+        printf("    sfs_mmap                     %8.2f ms  %d lines "
+            "(%.2f ms to map)\n", t * 1000, lines, t_map * 1000);
+        sfs_munmap(map);
+    }
+    set_latency(0);
+    sfs_fclose(fd);
+}
+
+/* Reads RANDOM_READS random blocks of the file. With [reopen] set the
+   file is opened afresh for every read, so that the block has to be
+   found by walking the chain; with [near] set every read is of the
+   first block instead. Returns the time per read in us, the best of
+   RANDOM_RUNS runs. */
+static double random_reads(char *name, int nblocks, int reopen, int near)
+{
+    char buf[512];
+    int fd = sfs_fopen(name), i, run;
+    double best = 0;
+    for (run = 0; run < RANDOM_RUNS; run++) {
+        srand(7);
+        double t0 = now();
+        for (i = 0; i < RANDOM_READS; i++) {
+            int block = near ? 0 : rand() % nblocks;
+            if (reopen) {
+                sfs_fclose(fd);
+                fd = sfs_fopen(name);
+            }
+            sfs_fseek(fd, block * 512);
+            sfs_fread(fd, buf, 512);
+        }
+        double t = now() - t0;
+        if (run == 0 || t < best) best = t;
+    }
+    sfs_fclose(fd);
+    return best * 1e6 / RANDOM_READS;
+}
+
+/* Random reads across file sizes, finding each block by walking the
+   FAT chain from the root against an open file's block map. */
+static void bench_random()
+{
+    int sizes[] = {64, 512, 3072}, s;
+    char *data = malloc(3072 * 512);
+
+    memset(data, 'r', 3072 * 512);
+    printf("random: %d random block reads per file, us per read\n",
+        RANDOM_READS);
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        mksfs(1);
+        int fd = sfs_fopen("RAND.DAT");
+        sfs_fwrite(fd, data, sizes[s] * 512);
+        sfs_fclose(fd);
+
+        // Reading block 0 takes no walk either way, which shows what
+        // the rest of a read costs.
+        printf("  %5d blocks  chain walk %6.2f us (block 0: %6.2f us)  "
+            "block map %6.2f us (block 0: %6.2f us)\n", sizes[s],
+            random_reads("RAND.DAT", sizes[s], 1, 0),
+            random_reads("RAND.DAT", sizes[s], 1, 1),
+            random_reads("RAND.DAT", sizes[s], 0, 0),
+            random_reads("RAND.DAT", sizes[s], 0, 1));
+    }
+    free(data);
+}
+
+/* Rewrites a file of SNAP_FILE_BLOCKS blocks in place. */
+static double overwrite(char *data, char fill)
+{
+    int fd = sfs_fopen("SNAP0.DAT");
+    memset(data, fill, SNAP_FILE_BLOCKS * 512);
+    set_latency(SNAP_BLOCK_USEC);
+    double t0 = now();
+    sfs_fwrite(fd, data, SNAP_FILE_BLOCKS * 512);
+    double t = now() - t0;
+    set_latency(0);
+    sfs_fclose(fd);
+    return SNAP_FILE_BLOCKS * 512 / 1024 / t;
+}
+
+/* Time to take a snapshot as the volume fills up, and what the copying
+   it causes costs a later overwrite. */
+static void bench_snapshot()
+{
+    char name[16], *data = malloc(SNAP_FILE_BLOCKS * 512);
+    int i;
+
+    printf("snapshot: files of %d blocks, %d us per block\n",
+        SNAP_FILE_BLOCKS, SNAP_BLOCK_USEC);
+    memset(data, 's', SNAP_FILE_BLOCKS * 512);
+    mksfs(1);
+    for (i = 0; i < 12; i++) {
+        sprintf(name, "SNAP%d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, SNAP_FILE_BLOCKS * 512);
+        sfs_fclose(fd);
+        if (i % 4 != 0 && i != 11) continue;
+
+        set_latency(SNAP_BLOCK_USEC);
+        double t0 = now();
+        int id = sfs_snapshot_create();
+        double t = now() - t0;
+        set_latency(0);
+        printf("  %5d blocks in use  create %7.2f ms\n",
+            TOTAL_DATA_BLOCKS - fbl_get_num_free(), t * 1000);
+        sfs_snapshot_delete(id);
+    }
+
+    mksfs(1);
+    int fd = sfs_fopen("SNAP0.DAT");
+    sfs_fwrite(fd, data, SNAP_FILE_BLOCKS * 512);
+    sfs_fclose(fd);
+    printf("  overwrite, no snapshot     %7.0f KB/s\n", overwrite(data, 'a'));
+    int id = sfs_snapshot_create();
+    printf("  overwrite, after snapshot  %7.0f KB/s\n", overwrite(data, 'b'));
+    printf("  overwrite again            %7.0f KB/s\n", overwrite(data, 'c'));
+    sfs_snapshot_delete(id);
+    free(data);
+}
+
+/* Opens [count] of the files made by bench_lookup with the device slowed
+   down, right after a lazy mount. */
+static void time_lookups(int nested, int count)
+{
+    char name[32];
+    int i;
+
+    mksfs(SFS_LAZY_MOUNT);
+    set_latency(LOOKUP_BLOCK_USEC);
+    double t0 = now();
+    for (i = 0; i < count; i++) {
+        sprintf(name, "D%d/SUB/F%03d", i % 3, i);
+        if (!nested) sprintf(name, "F%03d", i);
+        sfs_fclose(sfs_fopen(name));
+    }
+    double t = now() - t0;
+    set_latency(0);
+    printf("  %-7s %3d opens  %8.2f ms  %3d directory blocks read\n",
+        nested ? "nested" : "flat", count, t * 1000, dir_blocks_read());
+    sfs_unmount();
+}
+
+/* Opening files by path after a lazy mount, in the root and three
+   directories deep, on a volume whose directory is mostly full. */
+static void bench_lookup()
+{
+    char name[32];
+    int nested, i;
+
+    printf("lookup: %d files, %d us per block\n", LOOKUP_FILES,
+        LOOKUP_BLOCK_USEC);
+    for (nested = 0; nested < 2; nested++) {
+        mksfs(1);
+        for (i = 0; nested && i < 3; i++) {
+            sprintf(name, "D%d", i);
+            sfs_mkdir(name);
+            sprintf(name, "D%d/SUB", i);
+            sfs_mkdir(name);
+        }
+        for (i = 0; i < LOOKUP_FILES; i++) {
+            sprintf(name, "D%d/SUB/F%03d", i % 3, i);
+            if (!nested) sprintf(name, "F%03d", i);
+            sfs_fclose(sfs_fopen(name));
+        }
+        sfs_unmount();
+        time_lookups(nested, 1);
+        time_lookups(nested, 10);
+        time_lookups(nested, LOOKUP_FILES);
+    }
+}
+
+/* Lists every name in the directory after a lazy mount, as the number
+   of files grows, and how much a flush of one changed entry writes. */
+static void bench_dirscan()
+{
+    int counts[] = {150, 500, 1000}, c, i;
+    char name[24];
+
+    printf("dirscan: %d us per block\n", SCAN_BLOCK_USEC);
+    for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++) {
+        mksfs(1);
+        for (i = 0; i < counts[c]; i++) {
+            sprintf(name, "SCAN%05d.DAT", i);
+            int fd = sfs_fopen(name);
+            if (fd < 0) break;
+            sfs_fclose(fd);
+        }
+        sfs_unmount();
+
+        mksfs(SFS_LAZY_MOUNT);
+        set_latency(SCAN_BLOCK_USEC);
+        double t0 = now();
+        int n = 0, chars = 0, d;
+        for (d = dir_next(-1); d != ERR_NOT_FOUND; d = dir_next(d), n++)
+            chars += strlen(dir_get_name(d));
+        double t = now() - t0;
+        set_latency(0);
+        printf("  %5d files  scan %8.2f ms  %3d directory blocks read\n",
+            n, t * 1000, dir_blocks_read());
+        sfs_unmount();
+    }
+}
+
+/* Lists the whole directory [runs] times in batches, with [prefix] as
+   the filter. Returns the ms per listing; [found] is set to the number
+   of entries in one. */
+static double time_readdir(char *prefix, int runs, int *found)
+{
+    SfsStat *entries = malloc(sizeof(SfsStat) * READDIR_BATCH);
+    SfsDir dir;
+    int r, n;
+
+    double t0 = now();
+    for (r = 0; r < runs; r++) {
+        *found = 0;
+        sfs_opendir("", prefix, &dir);
+        while ((n = sfs_readdir_batch(&dir, entries, READDIR_BATCH)) > 0)
+            *found += n;
+    }
+    double t = now() - t0;
+    free(entries);
+    return t * 1000 / runs;
+}
+
+/* Enumerating a full directory through sfs_ls, with its output thrown
+   away, against sfs_readdir_batch and sfs_stat. */
+static void bench_readdir()
+{
+    char name[16];
+    SfsStat st;
+    int i, found, runs = 20;
+
+    mksfs(1);
+    for (i = 0; i < READDIR_FILES; i++) {
+        sprintf(name, "LIST%04d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, name, i % 3 == 0 ? 600 : 12);
+        sfs_fclose(fd);
+    }
+    printf("readdir: %d files, batches of %d\n", READDIR_FILES,
+        READDIR_BATCH);
+
+    fflush(stdout);
+    int saved = dup(1), null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    double t0 = now();
+    for (i = 0; i < runs; i++)
+        sfs_ls();
+    fflush(stdout);
+    double ls = (now() - t0) * 1000 / runs;
+    dup2(saved, 1);
+    close(null);
+    close(saved);
+    printf("  sfs_ls to /dev/null      %8.3f ms\n", ls);
+
+    double t = time_readdir(NULL, runs, &found);
+    printf("  readdir, all             %8.3f ms  %4d entries\n", t, found);
+    t = time_readdir("LIST00", runs, &found);
+    printf("  readdir, prefix LIST00   %8.3f ms  %4d entries\n", t, found);
+
+    t0 = now();
+    for (i = 0; i < READDIR_FILES; i++) {
+        sprintf(name, "LIST%04d.DAT", i);
+        sfs_stat(name, &st);
+    }
+    printf("  sfs_stat each file       %8.3f ms\n", (now() - t0) * 1000);
+}
+
+/* Creates STORM_FILES small files and removes them again, one metadata
+   write per call or in one batch. Returns the ms taken for each half. */
+static void storm(int batched, double *create_ms, double *remove_ms)
+{
+    char name[16];
+    int i;
+
+    mksfs(1);
+    set_latency(STORM_BLOCK_USEC);
+    double t0 = now();
+    if (batched) sfs_begin();
+    for (i = 0; i < STORM_FILES; i++) {
+        sprintf(name, "STORM%04d", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, name, 9);
+        sfs_fclose(fd);
+    }
+    if (batched) sfs_commit();
+    double t1 = now();
+    if (batched) sfs_begin();
+    for (i = 0; i < STORM_FILES; i++) {
+        sprintf(name, "STORM%04d", i);
+        sfs_remove(name);
+    }
+    if (batched) sfs_commit();
+    *create_ms = (t1 - t0) * 1000;
+    *remove_ms = (now() - t1) * 1000;
+    set_latency(0);
+}
+
+/* A create/delete storm with and without sfs_begin and sfs_commit. */
+static void bench_storm()
+{
+    double c, r;
+    int batched;
+
+    printf("storm: %d files created then removed, %d us per block\n",
+        STORM_FILES, STORM_BLOCK_USEC);
+    for (batched = 0; batched < 2; batched++) {
+        storm(batched, &c, &r);
+        printf("  %-9s create %8.2f ms (%6.0f/s)  "
+            "remove %8.2f ms (%6.0f/s)\n", batched ? "batched" : "unbatched",
+            c, STORM_FILES / c * 1000, r, STORM_FILES / r * 1000);
+    }
+}
+
+/* Prints the cache objects and chunk allocations since [objects] and
+   [chunks] were taken. */
+static void print_allocs(char *label, double ms, long objects, long chunks)
+{
+    long o, c;
+    slab_counts(&o, &c);
+    printf("  %-22s %8.2f ms  %6ld objects  %4ld allocations\n", label, ms,
+        o - objects, c - chunks);
+}
+
+/* Cache objects allocated by an eager mount of a nearly full volume, and
+   by opening, reading and closing every file and a create/remove storm
+   afterwards. Before the pools each object was an allocation. */
+static void bench_alloc()
+{
+    char name[16], *data = malloc(ALLOC_FILE_BLOCKS * 512);
+    long objects, chunks;
+    int r, i;
+
+    memset(data, 'a', ALLOC_FILE_BLOCKS * 512);
+    mksfs(1);
+    for (i = 0; i < ALLOC_FILES; i++) {
+        sprintf(name, "POOL%03d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, ALLOC_FILE_BLOCKS * 512);
+        sfs_fclose(fd);
+    }
+    sfs_unmount();
+    printf("alloc: %d files of %d blocks\n", ALLOC_FILES, ALLOC_FILE_BLOCKS);
+
+    slab_counts(&objects, &chunks);
+    double t0 = now();
+    mksfs(0);
+    print_allocs("eager mount", (now() - t0) * 1000, objects, chunks);
+
+    slab_counts(&objects, &chunks);
+    t0 = now();
+    for (r = 0; r < ALLOC_ROUNDS; r++) {
+        for (i = 0; i < ALLOC_FILES; i++) {
+            sprintf(name, "POOL%03d.DAT", i);
+            int fd = sfs_fopen(name);
+            sfs_fread(fd, data, ALLOC_FILE_BLOCKS * 512);
+            sfs_fclose(fd);
+        }
+    }
+    print_allocs("open, read, close", (now() - t0) * 1000, objects, chunks);
+
+    slab_counts(&objects, &chunks);
+    t0 = now();
+    for (r = 0; r < ALLOC_ROUNDS; r++) {
+        sfs_begin();
+        for (i = 0; i < ALLOC_FILES; i++) {
+            sprintf(name, "TEMP%03d.DAT", i);
+            int fd = sfs_fopen(name);
+            sfs_fwrite(fd, data, 2 * 512);
+            sfs_fclose(fd);
+        }
+        for (i = 0; i < ALLOC_FILES; i++) {
+            sprintf(name, "TEMP%03d.DAT", i);
+            sfs_remove(name);
+        }
+        sfs_commit();
+    }
+    print_allocs("create/remove storm", (now() - t0) * 1000, objects,
+        chunks);
+    sfs_unmount();
+    free(data);
+}
+
+/* One allocating thread of the groups bench. */
+typedef struct
+{
+    pthread_t thread;
+    int home;
+    int blocks[GROUP_ALLOCS];
+} GroupWorker;
+
+/* Allocates and frees single blocks, keeping those of the last round.
+   A negative home takes every block from the whole volume. */
+static void *group_worker(void *arg)
+{
+    GroupWorker *w = arg;
+    int r, i, got;
+    for (r = 0; r < GROUP_ROUNDS; r++) {
+        for (i = 0; i < GROUP_ALLOCS; i++) {
+            w->blocks[i] = w->home < 0 ? fbl_alloc_run(1, &got) :
+                fbl_alloc_run_in(w->home, 1, &got);
+        }
+        if (r == GROUP_ROUNDS - 1) break;
+        for (i = 0; i < GROUP_ALLOCS; i++)
+            fbl_set_free_index(w->blocks[i]);
+    }
+    return NULL;
+}
+
+/* One writing thread of the groups bench, appending to a file of its own
+   through sfs_fwrite one block at a time. */
+static void *group_writer(void *arg)
+{
+    GroupWorker *w = arg;
+    char name[MAX_NAME_LEN], buf[BLOCK_SIZE];
+    int i;
+    sprintf(name, "GROUP%02d.DAT", w->home);
+    memset(buf, w->home, BLOCK_SIZE);
+    int fd = sfs_fopen(name);
+    for (i = 0; i < GROUP_WRITE_BLOCKS; i++)
+        sfs_fwrite(fd, buf, BLOCK_SIZE);
+    sfs_fclose(fd);
+    return NULL;
+}
+
+/* Allocates from a growing number of threads, either each in a group of
+   its own or all by first fit on the whole volume, and counts how many
+   separate runs the threads' blocks ended up in. */
+static void bench_groups()
+{
+    static int owner[TOTAL_DATA_BLOCKS];
+    int threads[] = {1, 2, 4, 8, 16, 32}, t, mode, i, j;
+    GroupWorker *w = malloc(32 * sizeof(GroupWorker));
+
+    mksfs(1);
+    printf("groups: %d groups of %d blocks, %d x %d allocations per thread\n",
+        FBL_GROUPS, FBL_GROUP_BLOCKS, GROUP_ROUNDS, GROUP_ALLOCS);
+    for (mode = 0; mode < 2; mode++) {
+        printf("  %s\n", mode ? "home groups" : "whole volume first fit");
+        for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+            double t0 = now();
+            for (i = 0; i < threads[t]; i++) {
+                w[i].home = mode ? i % FBL_GROUPS : -1;
+                pthread_create(&w[i].thread, NULL, group_worker, &w[i]);
+            }
+            for (i = 0; i < threads[t]; i++)
+                pthread_join(w[i].thread, NULL);
+            double secs = now() - t0;
+
+            int runs = 0, prev = -1;
+            memset(owner, -1, sizeof(owner));
+            for (i = 0; i < threads[t]; i++) {
+                for (j = 0; j < GROUP_ALLOCS; j++)
+                    owner[w[i].blocks[j]] = i;
+            }
+            for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+                if (owner[i] >= 0 && owner[i] != prev)
+                    runs++;
+                prev = owner[i];
+            }
+            for (i = 0; i < threads[t]; i++) {
+                for (j = 0; j < GROUP_ALLOCS; j++)
+                    fbl_set_free_index(w[i].blocks[j]);
+            }
+
+            printf("    %2d threads  %8.2f ms  %10.0f allocs/s  %4d runs\n",
+                threads[t], secs * 1000,
+                threads[t] * GROUP_ROUNDS * GROUP_ALLOCS / secs, runs);
+        }
+    }
+
+    /* The same through the API, where every call holds the API lock, so
+       the threads take turns however many groups there are. */
+    printf("  sfs_fwrite, one file per thread\n");
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        char name[MAX_NAME_LEN];
+        double t0 = now();
+        for (i = 0; i < threads[t]; i++) {
+            w[i].home = i;
+            pthread_create(&w[i].thread, NULL, group_writer, &w[i]);
+        }
+        for (i = 0; i < threads[t]; i++)
+            pthread_join(w[i].thread, NULL);
+        double secs = now() - t0;
+
+        int runs = 0;
+        for (i = 0; i < threads[t]; i++) {
+            sprintf(name, "GROUP%02d.DAT", i);
+            runs += sfs_extents(name);
+            sfs_remove(name);
+        }
+        printf("    %2d threads  %8.2f ms  %10.0f blocks/s  %4d runs\n",
+            threads[t], secs * 1000,
+            threads[t] * GROUP_WRITE_BLOCKS / secs, runs);
+    }
+    sfs_unmount();
+    free(w);
+}
+
+/* Checks a nearly full volume with a growing number of threads. */
+static void bench_fsck()
+{
+    int threads[] = {1, 2, 4, 8}, t, i;
+    char name[16], *data = malloc(FSCK_FILE_BLOCKS * 512);
+    SfsFsckReport r;
+
+    memset(data, 'f', FSCK_FILE_BLOCKS * 512);
+    mksfs(1);
+    for (i = 0; i < FSCK_FILES; i++) {
+        sprintf(name, "CHK%03d.DAT", i);
+        int fd = sfs_fopen(name);
+        sfs_fwrite(fd, data, FSCK_FILE_BLOCKS * 512);
+        sfs_fclose(fd);
+    }
+    free(data);
+
+    printf("fsck: %d files of %d blocks\n", FSCK_FILES, FSCK_FILE_BLOCKS);
+    for (t = 0; t < sizeof(threads) / sizeof(threads[0]); t++) {
+        sfs_fsck(0, threads[t], &r);
+        printf("  %d threads  %8.2f ms  %10.0f entries/s\n", threads[t],
+            r.seconds * 1000, (r.files + r.entries) / r.seconds);
+    }
+}
+
+static struct
+{
+    const char *name;
+    void (*run)();
+} benches[] = {
+    {"writev", bench_writev},
+    {"aio", bench_aio},
+    {"append", bench_append},
+    {"delalloc", bench_delalloc},
+    {"mount", bench_mount},
+    {"defrag", bench_defrag},
+    {"compress", bench_compress},
+    {"dedup", bench_dedup},
+    {"tiny", bench_tiny},
+    {"tailpack", bench_tailpack},
+    {"clone", bench_clone},
+    {"copyrange", bench_copyrange},
+    {"mmap", bench_mmap},
+    {"random", bench_random},
+    {"snapshot", bench_snapshot},
+    {"lookup", bench_lookup},
+    {"dirscan", bench_dirscan},
+    {"readdir", bench_readdir},
+    {"storm", bench_storm},
+    {"alloc", bench_alloc},
+    {"groups", bench_groups},
+    {"fsck", bench_fsck},
+};
+
+int main(int argc, char **argv)
+{
+    int n = sizeof(benches) / sizeof(benches[0]), i, j;
+    for (i = 0; i < n; i++) {
+        int selected = (argc < 2);
+        for (j = 1; j < argc; j++)
+            if (strcmp(argv[j], benches[i].name) == 0) selected = 1;
+        if (selected)
+            benches[i].run();
+    }
+    return 0;
+}
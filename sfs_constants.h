@@ -9,7 +9,10 @@
 #define FAT_START (DIR_START + DIRECTORY_BLOCKS)
 #define FREE_LIST_START (FAT_START + FAT_BLOCKS)
 #define FREE_LIST_LEN 1
-#define NUM_BLOCKS (FREE_LIST_START + FREE_LIST_LEN + TOTAL_DATA_BLOCKS)
+#define REFCOUNT_START (FREE_LIST_START + FREE_LIST_LEN)
+#define REFCOUNT_LEN (TOTAL_DATA_BLOCKS * 2 / BLOCK_SIZE)
+#define NUM_BLOCKS (REFCOUNT_START + REFCOUNT_LEN + TOTAL_DATA_BLOCKS)
+#define MAX_SNAPSHOTS 4
 #define MAX_NAME_LEN 256
 #define END_OF_FILE -1
 #define NO_DATA -2
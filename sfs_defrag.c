@@ -0,0 +1,115 @@
+/* sfs_defrag.c
+ *
+ * Defragments the file system image in test.disk.
+ *
+ *   sfs_defrag [-s step_blocks] [-l seek_usec]
+ *
+ * Sequential read throughput over every file is measured before and
+ * after, charging the given latency for every device request that does
+ * not continue where the previous one ended.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sfs_api.h"
+#include "lib/disk_emu.h"
+
+#define DEFAULT_STEP_BLOCKS 32
+#define DEFAULT_SEEK_USEC 500
+#define READ_CHUNK (64 * 1024)
+#define READDIR_BATCH 64
+#define PATH_LEN 1024
+
+static void usage()
+{
+    fprintf(stderr, "usage: sfs_defrag [-s step_blocks] [-l seek_usec]\n");
+    exit(1);
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Reads every file below the directory at [path] from start to end,
+   adding the bytes read to [total]. */
+static void read_tree(char *path, char *buf, long *total)
+{
+    SfsStat entries[READDIR_BATCH];
+    SfsDir dir;
+    char child[PATH_LEN];
+    int n, i;
+
+    if (sfs_opendir(path, NULL, &dir) != 0) return;
+    while ((n = sfs_readdir_batch(&dir, entries, READDIR_BATCH)) > 0) {
+        for (i = 0; i < n; i++) {
+            if (snprintf(child, PATH_LEN, "%s/%s", path, entries[i].name)
+                    >= PATH_LEN)
+                continue;
+            if (entries[i].is_dir) {
+                read_tree(child, buf, total);
+                continue;
+            }
+
+            int fd = sfs_fopen(child);
+            long size = entries[i].size, done;
+            for (done = 0; done < size; done += READ_CHUNK) {
+                int len = size - done < READ_CHUNK ? size - done : READ_CHUNK;
+                sfs_fread(fd, buf, len);
+            }
+            sfs_fclose(fd);
+            *total += size;
+        }
+    }
+}
+
+/* Reads every file from start to end. Returns bytes per second. */
+static double read_all(int seek)
+{
+    char *buf = malloc(READ_CHUNK);
+    long total = 0;
+
+    set_seek_latency(seek);
+    double t0 = now();
+    read_tree("", buf, &total);
+    double t = now() - t0;
+    set_seek_latency(0);
+    free(buf);
+    return total / t;
+}
+
+int main(int argc, char **argv)
+{
+    SfsDefragReport r;
+    int step = DEFAULT_STEP_BLOCKS, seek = DEFAULT_SEEK_USEC, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+            step = atoi(argv[++i]);
+        else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc)
+            seek = atoi(argv[++i]);
+        else
+            usage();
+    }
+
+    mksfs(0);
+    double before = read_all(seek);
+    double t0 = now();
+    sfs_defrag(step, &r);
+    double t = now() - t0;
+    double after = read_all(seek);
+
+    printf("%d files, %d moved in %d steps (%d blocks) in %.1f ms, "
+        "%d skipped\n", r.files, r.moved_files, r.steps, r.blocks_moved,
+        t * 1000, r.skipped_files);
+    printf("  extents     %8d -> %d\n", r.extents_before, r.extents_after);
+    printf("  read KB/s   %8.0f -> %.0f at %d us per seek\n",
+        before / 1024, after / 1024, seek);
+
+    sfs_unmount();
+    return 0;
+}
@@ -5,5 +5,10 @@
 #define ERR_OUT_OF_SPACE -98
 #define ERR_MAX_OPEN -97
 #define ERR_UNKNOWN -96
+#define ERR_PENDING -95
+#define ERR_READ_ONLY -94
+#define ERR_EXISTS -93
+#define ERR_IS_DIR -92
+#define ERR_NOT_EMPTY -91
 
 #endif
\ No newline at end of file
@@ -0,0 +1,65 @@
+/* sfs_fsck.c
+ *
+ * Checks the file system image in test.disk.
+ *
+ *   sfs_fsck [-r] [-j threads]
+ *
+ * -r repairs what it finds. Exits with 0 if the image is consistent, 1
+ * if problems were found and repaired, or 4 if problems are left.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sfs_api.h"
+
+#define DEFAULT_THREADS 4
+
+static void usage()
+{
+    fprintf(stderr, "usage: sfs_fsck [-r] [-j threads]\n");
+    exit(8);
+}
+
+int main(int argc, char **argv)
+{
+    SfsFsckReport r;
+    int repair = 0, nthreads = DEFAULT_THREADS, i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-r") == 0)
+            repair = 1;
+        else if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            nthreads = atoi(argv[++i]);
+        else
+            usage();
+    }
+
+    mksfs(SFS_CHECK_MOUNT);
+    int found = sfs_fsck(repair, nthreads, &r);
+
+    printf("%d files, %d FAT entries checked on %d threads in %.2f ms "
+        "(%.0f entries/s)\n", r.files, r.entries, nthreads, r.seconds * 1000,
+        (r.files + r.entries) / r.seconds);
+    printf("  bad directories   %d\n", r.bad_dirs);
+    printf("  bad chains        %d\n", r.bad_chains);
+    printf("  cross-linked      %d\n", r.cross_linked);
+    printf("  bad sizes         %d\n", r.bad_sizes);
+    printf("  leaked entries    %d\n", r.leaked_entries);
+    printf("  leaked blocks     %d\n", r.leaked_blocks);
+    printf("  unmarked blocks   %d\n", r.unmarked_blocks);
+    printf("  bad refcounts     %d\n", r.bad_refcounts);
+
+    if (found == 0) {
+        puts("clean");
+        sfs_unmount();
+        return 0;
+    }
+    if (repair && r.remaining == 0) {
+        printf("%d problems repaired\n", found);
+        sfs_unmount();
+        return 1;
+    }
+    printf("%d problems, %d left\n", found, r.remaining);
+    return 4;
+}
@@ -1,8 +1,16 @@
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "sfs_api.h"
+#include "sfs_constants.h"
+#include "dir_cache.h"
+#include "defrag.h"
+#include "fat_cache.h"
+#include "file_descriptor.h"
+#include "free_block_list.h"
+#include "lib/disk_emu.h"
 
 /* The maximum file name length. We assume that filenames can contain
  * upper-case letters and periods ('.') characters. Feel free to
@@ -55,6 +63,90 @@ char *rand_name()
     return (strdup(fname));
 }
 
+/* alloc_worker() - allocate single blocks from one allocation group.
+ *
+ * Used by the allocation group test. [arg] points to the group, and
+ * the blocks are stored after it.
+ */
+
+void *alloc_worker(void *arg)
+{
+    int *blocks = arg, got, i;
+
+    for (i = 1; i <= 32; i++)
+        blocks[i] = fbl_alloc_run_in(blocks[0], 1, &got);
+    return NULL;
+}
+
+/* write_and_remove() - write one block to a new file and remove it.
+ *
+ * Returns the data block the file had, which is free again after.
+ */
+
+int write_and_remove(char *name, char *block)
+{
+    int fd = sfs_fopen(name);
+    sfs_fwrite(fd, block, 512);
+    sfs_fclose(fd);
+    int db = fat_get_data_block(dir_get_fat_root(dir_search(DIR_ROOT, name)));
+    sfs_remove(name);
+    return db;
+}
+
+/* zero_copy_offset() - find where a metadata copy could put a zero block.
+ *
+ * Returns the smallest k such that block k of the [len] blocks from
+ * DIR_START is all zeros and a run of [len] free blocks can start k
+ * blocks before data block [block], or -1.
+ */
+
+int zero_copy_offset(int block, int len)
+{
+    byte *image = malloc(len * 512);
+    int k, i, found = -1;
+
+    read_blocks(DIR_START, len, image);
+    for (k = 0; k < len && k <= block && found < 0; k++) {
+        for (i = 0; i < 512 && image[k * 512 + i] == 0; i++)
+            ;
+        if (i < 512 || block - k + len > TOTAL_DATA_BLOCKS) continue;
+        for (i = block - k; i < block - k + len && fbl_is_free(i); i++)
+            ;
+        if (i == block - k + len) found = k;
+    }
+    free(image);
+    return found;
+}
+
+/* hold_free_below() - mark every free block before [block] as used.
+ *
+ * Makes the next first fit allocation start at [block]. The blocks
+ * taken are flagged in [held] for release_held().
+ */
+
+void hold_free_below(int block, byte *held)
+{
+    int i;
+
+    memset(held, 0, TOTAL_DATA_BLOCKS);
+    for (i = 0; i < block; i++) {
+        held[i] = fbl_is_free(i);
+        if (held[i]) fbl_mark_used(i);
+    }
+}
+
+/* release_held() - free the blocks taken by hold_free_below().
+ */
+
+void release_held(byte *held)
+{
+    int i;
+
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+        if (held[i]) fbl_set_free_index(i);
+    }
+}
+
 /* The main testing program
 */
     int
@@ -326,6 +418,1368 @@ main(int argc, char **argv)
 
     //free(buffer);
 
+    //-------- The following part tests sfs_writev and sfs_readv
+
+    printf("Tests sfs_writev and sfs_readv\n");
+
+    char* v_name = rand_name();
+    int v_id = sfs_fopen(v_name);
+    char head[8], body[600];
+    memset(head, 'h', sizeof(head));
+    memset(body, 'b', sizeof(body));
+    SfsIoVec wv[2] = {{head, sizeof(head)}, {body, sizeof(body)}};
+
+    for (i = 0; i < 3; i++) {
+        if (sfs_writev(v_id, wv, 2) != sizeof(head) + sizeof(body)) {
+            fprintf(stderr, "ERROR: short sfs_writev\n");
+            error_count++;
+        }
+    }
+
+    for (i = 0; i < 3; i++) {
+        char rhead[8], rbody[600];
+        SfsIoVec rv[2] = {{rhead, sizeof(rhead)}, {rbody, sizeof(rbody)}};
+        if (sfs_readv(v_id, rv, 2) != sizeof(rhead) + sizeof(rbody)
+            || memcmp(rhead, head, sizeof(head)) != 0
+            || memcmp(rbody, body, sizeof(body)) != 0) {
+            fprintf(stderr, "ERROR: record %d read back wrong\n", i);
+            error_count++;
+        }
+    }
+    sfs_fclose(v_id);
+    sfs_remove(v_name);
+
+    //-------- The following part tests the asynchronous API
+
+    printf("Tests sfs_aio_read and sfs_aio_write\n");
+
+    char* a_name = rand_name();
+    int a_id = sfs_fopen(a_name);
+    char a_buf[1000];
+    int token = sfs_aio_write(a_id, 0, body, sizeof(body), NULL, NULL);
+    if (sfs_aio_wait(token) != sizeof(body)) {
+        fprintf(stderr, "ERROR: asynchronous write failed\n");
+        error_count++;
+    }
+
+    token = sfs_aio_read(a_id, 0, a_buf, sizeof(a_buf), NULL, NULL);
+    while ((tmp = sfs_aio_poll(token)) == ERR_PENDING)
+        ;
+    if (tmp != sizeof(body) || memcmp(a_buf, body, sizeof(body)) != 0) {
+        fprintf(stderr, "ERROR: asynchronous read returned %d\n", tmp);
+        error_count++;
+    }
+    sfs_fclose(a_id);
+    sfs_remove(a_name);
+
+    // Reads outstanding together each get their own offset.
+    a_id = sfs_fopen(a_name);
+    char a_blocks[4][512];
+    int a_tokens[4];
+    for (i = 0; i < 4; i++) {
+        memset(a_blocks[i], 'p' + i, 512);
+        sfs_fwrite(a_id, a_blocks[i], 512);
+    }
+    for (i = 0; i < 4; i++)
+        a_tokens[i] = sfs_aio_read(a_id, (3 - i) * 512, a_blocks[i], 512,
+            NULL, NULL);
+    for (i = 0; i < 4; i++) {
+        if (sfs_aio_wait(a_tokens[i]) != 512 || a_blocks[i][0] != 's' - i ||
+                a_blocks[i][511] != 's' - i) {
+            fprintf(stderr, "ERROR: asynchronous read %d used the wrong offset\n", i);
+            error_count++;
+        }
+    }
+
+    // Writes outstanding together each land at their own offset.
+    for (i = 0; i < 4; i++) {
+        memset(a_blocks[i], 'w' - i, 512);
+        a_tokens[i] = sfs_aio_write(a_id, (3 - i) * 512, a_blocks[i], 512,
+            NULL, NULL);
+    }
+    for (i = 0; i < 4; i++) {
+        if (sfs_aio_wait(a_tokens[i]) != 512) {
+            fprintf(stderr, "ERROR: asynchronous write %d failed\n", i);
+            error_count++;
+        }
+    }
+    sfs_fseek(a_id, 0);
+    for (i = 0; i < 4; i++) {
+        sfs_fread(a_id, a_blocks[i], 512);
+        if (a_blocks[i][0] != 't' + i || a_blocks[i][511] != 't' + i) {
+            fprintf(stderr, "ERROR: asynchronous write %d used the wrong offset\n",
+                3 - i);
+            error_count++;
+        }
+    }
+    // Put back what the pinning test below expects.
+    sfs_fseek(a_id, 0);
+    for (i = 0; i < 4; i++) {
+        memset(a_blocks[i], 'p' + i, 512);
+        sfs_fwrite(a_id, a_blocks[i], 512);
+    }
+
+    // A planned read still sees the old data after the file is
+    // overwritten, removed and its blocks reused.
+    ReadPlan a_plan;
+    if (fdesc_plan_read_at(a_id, 512, 1024, &a_plan) != 1024) {
+        fprintf(stderr, "ERROR: could not plan a read\n");
+        error_count++;
+    }
+    memset(a_blocks[0], 'z', 512);
+    sfs_fseek(a_id, 512);
+    sfs_fwrite(a_id, a_blocks[0], 512);
+    sfs_fclose(a_id);
+    sfs_remove(a_name);
+    a_id = sfs_fopen(a_name);
+    for (i = 0; i < 8; i++)
+        sfs_fwrite(a_id, a_blocks[0], 512);
+    SfsIoVec a_iov = {a_blocks[1], 1024};
+    fdesc_exec_read(&a_plan, &a_iov, 1);
+    fdesc_unpin_read(&a_plan);
+    if (a_blocks[1][0] != 'q' || a_blocks[1][1023] != 'r') {
+        fprintf(stderr, "ERROR: pinned blocks were reused before the read\n");
+        error_count++;
+    }
+    sfs_fclose(a_id);
+    sfs_remove(a_name);
+    SfsFsckReport a_report;
+    if (sfs_fsck(0, 2, &a_report) != 0) {
+        fprintf(stderr, "ERROR: unpinning left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests write buffering
+
+    printf("Tests sfs_set_write_buffer\n");
+
+    char* b_name = rand_name();
+    int b_id = sfs_fopen(b_name);
+    sfs_set_write_buffer(b_id, 2);
+    for (i = 0; i < 100; i++)
+        sfs_fwrite(b_id, test_str, strlen(test_str));
+    sfs_fclose(b_id);
+
+    b_id = sfs_fopen(b_name);
+    for (i = 0; i < 100; i++) {
+        sfs_fread(b_id, fixedbuf, strlen(test_str));
+        if (strncmp(fixedbuf, test_str, strlen(test_str)) != 0) {
+            fprintf(stderr, "ERROR: buffered append %d read back wrong\n", i);
+            error_count++;
+            break;
+        }
+    }
+
+    // A read commits the buffer, so it sees the data just written.
+    sfs_set_write_buffer(b_id, 4);
+    sfs_fwrite(b_id, "tail", 4);
+    sfs_fread(b_id, fixedbuf, 4);
+    if (strncmp(fixedbuf, "tail", 4) != 0) {
+        fprintf(stderr, "ERROR: read did not see buffered write\n");
+        error_count++;
+    }
+    sfs_fclose(b_id);
+    sfs_remove(b_name);
+
+    //-------- The following part tests sfs_fallocate
+
+    printf("Tests sfs_fallocate\n");
+
+    char* p_name = rand_name();
+    int p_id = sfs_fopen(p_name);
+    if (sfs_fallocate(p_id, 0, 4 * 512) != 0) {
+        fprintf(stderr, "ERROR: sfs_fallocate failed\n");
+        error_count++;
+    }
+    sfs_fwrite(p_id, "abc", 3);
+    sfs_fseek(p_id, 1500);
+    sfs_fwrite(p_id, "xyz", 3);
+    sfs_fseek(p_id, 0);
+    buffer = malloc(1503);
+    sfs_fread(p_id, buffer, 1503);
+    if (strncmp(buffer, "abc", 3) != 0 || strncmp(buffer + 1500, "xyz", 3) != 0) {
+        fprintf(stderr, "ERROR: wrong data around preallocated range\n");
+        error_count++;
+    }
+    for (i = 3; i < 1500; i++) {
+        if (buffer[i] != 0) {
+            fprintf(stderr, "ERROR: unwritten byte %d is not zero\n", i);
+            error_count++;
+            break;
+        }
+    }
+    free(buffer);
+    sfs_fclose(p_id);
+    sfs_remove(p_name);
+
+    //-------- The following part tests sfs_ftruncate and sparse files
+
+    printf("Tests sfs_ftruncate and sparse files\n");
+
+    char* t_name = rand_name();
+    int t_id = sfs_fopen(t_name);
+    for (i = 0; i < 20; i++)
+        sfs_fwrite(t_id, test_str, strlen(test_str));
+    sfs_ftruncate(t_id, 10);
+    sfs_ftruncate(t_id, 600);
+    buffer = malloc(600);
+    sfs_fread(t_id, buffer, 600);
+    if (strncmp(buffer, test_str, 10) != 0) {
+        fprintf(stderr, "ERROR: truncate lost the data it kept\n");
+        error_count++;
+    }
+    for (i = 10; i < 600; i++) {
+        if (buffer[i] != 0) {
+            fprintf(stderr, "ERROR: byte %d past truncation is not zero\n", i);
+            error_count++;
+            break;
+        }
+    }
+
+    // Writing far past the end leaves a hole in between.
+    sfs_fseek(t_id, 5000);
+    sfs_fwrite(t_id, "end", 3);
+    sfs_fseek(t_id, 4000);
+    sfs_fread(t_id, buffer, 600);
+    for (i = 0; i < 600; i++) {
+        if (buffer[i] != 0) {
+            fprintf(stderr, "ERROR: hole byte %d is not zero\n", 4000 + i);
+            error_count++;
+            break;
+        }
+    }
+    sfs_fseek(t_id, 5000);
+    sfs_fread(t_id, buffer, 3);
+    if (strncmp(buffer, "end", 3) != 0) {
+        fprintf(stderr, "ERROR: data after hole read back wrong\n");
+        error_count++;
+    }
+
+    sfs_punch_hole(t_id, 0, 5000);
+    sfs_fseek(t_id, 0);
+    sfs_fread(t_id, buffer, 10);
+    if (buffer[0] != 0 || buffer[9] != 0) {
+        fprintf(stderr, "ERROR: punched range does not read as zeros\n");
+        error_count++;
+    }
+    free(buffer);
+    sfs_fclose(t_id);
+    sfs_remove(t_name);
+
+    //-------- The following part tests lazy mounting
+
+    printf("Tests mksfs(SFS_LAZY_MOUNT)\n");
+
+    char* l_names[2] = {rand_name(), rand_name()};
+    int l_id = sfs_fopen(l_names[0]);
+    sfs_fwrite(l_id, test_str, strlen(test_str));
+    sfs_fclose(l_id);
+
+    mksfs(SFS_LAZY_MOUNT);
+    l_id = sfs_fopen(l_names[0]);
+    sfs_fread(l_id, fixedbuf, strlen(test_str));
+    if (strncmp(fixedbuf, test_str, strlen(test_str)) != 0) {
+        fprintf(stderr, "ERROR: wrong data after lazy mount\n");
+        error_count++;
+    }
+    sfs_fclose(l_id);
+    l_id = sfs_fopen(l_names[1]);
+    sfs_fwrite(l_id, "lazy", 4);
+    sfs_fclose(l_id);
+
+    mksfs(0);
+    l_id = sfs_fopen(l_names[1]);
+    sfs_fread(l_id, fixedbuf, 4);
+    if (strncmp(fixedbuf, "lazy", 4) != 0) {
+        fprintf(stderr, "ERROR: file created after lazy mount was lost\n");
+        error_count++;
+    }
+    sfs_fclose(l_id);
+    sfs_remove(l_names[0]);
+    sfs_remove(l_names[1]);
+
+    //-------- The following part tests clean unmounting
+
+    printf("Tests sfs_unmount\n");
+
+    // mksfs() reseeds rand(), so a random name could collide with an
+    // earlier file; use a fixed one.
+    char* u_name = "UNMOUNT.TST";
+    int u_id = sfs_fopen(u_name);
+    sfs_set_write_buffer(u_id, 1);
+    sfs_fwrite(u_id, "unmounted", 9);
+    // Unmounting closes the file, committing the buffered write.
+    sfs_unmount();
+
+    mksfs(SFS_LAZY_MOUNT);
+    u_id = sfs_fopen(u_name);
+    sfs_fread(u_id, fixedbuf, 9);
+    if (strncmp(fixedbuf, "unmounted", 9) != 0) {
+        fprintf(stderr, "ERROR: data lost across clean unmount\n");
+        error_count++;
+    }
+    sfs_fclose(u_id);
+    sfs_remove(u_name);
+
+    // Unmounting waits for the requests still in flight, and what they
+    // wrote is on disk when the volume comes back.
+    char *u_read = malloc(16 * 512);
+    a_id = sfs_fopen(u_name);
+    memset(u_read, 'u', 16 * 512);
+    sfs_fwrite(a_id, u_read, 16 * 512);
+    memset(u_read, 0, 16 * 512);
+    memset(a_blocks[3], 'v', 512);
+    set_latency(200);
+    for (i = 0; i < 2; i++)
+        a_tokens[i] = sfs_aio_read(a_id, i * 8 * 512, u_read + i * 8 * 512,
+            8 * 512, NULL, NULL);
+    a_tokens[2] = sfs_aio_write(a_id, 16 * 512, a_blocks[3], 512, NULL,
+        NULL);
+    sfs_unmount();
+    set_latency(0);
+    mksfs(SFS_LAZY_MOUNT);
+    for (i = 0; i < 3; i++) {
+        if (sfs_aio_poll(a_tokens[i]) != (i < 2 ? 8 * 512 : 512)) {
+            fprintf(stderr, "ERROR: request %d did not finish before unmount\n", i);
+            error_count++;
+        }
+    }
+    for (j = 0; j < 16 * 512 && u_read[j] == 'u'; j++)
+        ;
+    if (j < 16 * 512) {
+        fprintf(stderr, "ERROR: reads in flight at unmount read the wrong data\n");
+        error_count++;
+    }
+    free(u_read);
+    a_id = sfs_fopen(u_name);
+    sfs_fseek(a_id, 16 * 512);
+    memset(a_blocks[0], 0, 512);
+    sfs_fread(a_id, a_blocks[0], 512);
+    if (a_blocks[0][0] != 'v' || a_blocks[0][511] != 'v') {
+        fprintf(stderr, "ERROR: write in flight at unmount was lost\n");
+        error_count++;
+    }
+    sfs_fclose(a_id);
+    sfs_remove(u_name);
+    if (sfs_fsck(0, 2, &a_report) != 0) {
+        fprintf(stderr, "ERROR: unmounting with requests in flight left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests sfs_fsck
+
+    printf("Tests sfs_fsck\n");
+
+    SfsFsckReport report;
+    if (sfs_fsck(0, 4, &report) != 0) {
+        fprintf(stderr, "ERROR: sfs_fsck found problems on a healthy disk\n");
+        error_count++;
+    }
+
+    char* k_names[2] = {"FSCKA.TST", "FSCKB.TST"};
+    int k_ids[2];
+    buffer = malloc(3 * 512);
+    memset(buffer, 'k', 3 * 512);
+    for (i = 0; i < 2; i++) {
+        k_ids[i] = sfs_fopen(k_names[i]);
+        sfs_fwrite(k_ids[i], buffer, 3 * 512);
+    }
+
+    // Leak an entry and point the tail of the second file into the
+    // middle of the first.
+    fat_create_entry();
+    int k_root = dir_get_fat_root(dir_search(DIR_ROOT, k_names[0]));
+    fat_set_next_index(fat_get_tail(dir_get_fat_root(dir_search(DIR_ROOT, k_names[1]))),
+        fat_get_next_index(k_root));
+
+    if (sfs_fsck(1, 4, &report) == 0 || report.cross_linked != 1 ||
+            report.leaked_entries != 1 || report.remaining != 0) {
+        fprintf(stderr, "ERROR: sfs_fsck missed or failed to repair damage\n");
+        error_count++;
+    }
+    if (sfs_fsck(0, 4, &report) != 0) {
+        fprintf(stderr, "ERROR: sfs_fsck repair left problems\n");
+        error_count++;
+    }
+    for (i = 0; i < 2; i++) {
+        sfs_fseek(k_ids[i], 0);
+        memset(buffer, 0, 3 * 512);
+        sfs_fread(k_ids[i], buffer, 3 * 512);
+        if (buffer[0] != 'k' || buffer[3 * 512 - 1] != 'k') {
+            fprintf(stderr, "ERROR: sfs_fsck repair damaged %s\n", k_names[i]);
+            error_count++;
+        }
+        sfs_fclose(k_ids[i]);
+        sfs_remove(k_names[i]);
+    }
+    free(buffer);
+
+    //-------- The following part tests sfs_defrag
+
+    printf("Tests sfs_defrag\n");
+
+    char g_second[24];
+    char* g_names[2] = {"DEFRAGA.TST", g_second};
+    int g_ids[2];
+    buffer = malloc(8 * 512);
+    g_ids[0] = sfs_fopen(g_names[0]);
+    // Files in different allocation groups never interleave, so find a
+    // name whose home group is the first file's.
+    for (j = 0; ; j++) {
+        sprintf(g_second, "DEFRAG%02d.TST", j);
+        g_ids[1] = sfs_fopen(g_second);
+        if (fbl_home_group(dir_search(DIR_ROOT, g_second)) ==
+                fbl_home_group(dir_search(DIR_ROOT, g_names[0])))
+            break;
+        sfs_fclose(g_ids[1]);
+        sfs_remove(g_second);
+    }
+    // Alternate single blocks between the files to fragment both.
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 2; i++) {
+            memset(buffer, 'a' + j + i * 8, 512);
+            sfs_fwrite(g_ids[i], buffer, 512);
+        }
+    }
+    if (sfs_extents(g_names[0]) < 2) {
+        fprintf(stderr, "ERROR: interleaved writes did not fragment the file\n");
+        error_count++;
+    }
+
+    // Punching out a block the job already moved must not shift the
+    // blocks still to come.
+    DefragJob g_job;
+    if (!defrag_begin(dir_search(DIR_ROOT, g_second), &g_job) ||
+            defrag_step(&g_job, 2) != 2) {
+        fprintf(stderr, "ERROR: could not start defragmenting %s\n", g_second);
+        error_count++;
+    }
+    sfs_punch_hole(g_ids[1], 0, 512);
+    while (defrag_step(&g_job, 2) > 0)
+        ;
+    if (sfs_extents(g_second) != 1) {
+        fprintf(stderr, "ERROR: a punched block shifted the defrag job\n");
+        error_count++;
+    }
+
+    // A job must not write over a block of its run that something else
+    // has taken a reference to.
+    char* g_taken = "TAKEN.TST";
+    int g_id = sfs_fopen(g_taken);
+    memset(buffer, 'T', 512);
+    sfs_fwrite(g_id, buffer, 512);
+    if (!defrag_begin(dir_search(DIR_ROOT, g_names[0]), &g_job)) {
+        fprintf(stderr, "ERROR: could not start defragmenting %s\n", g_names[0]);
+        error_count++;
+    }
+    write_blocks(g_job.target + DATA_BLOCK_OFFSET, 1, buffer);
+    fat_link_block(dir_get_fat_root(dir_search(DIR_ROOT, g_taken)),
+        g_job.target + DATA_BLOCK_OFFSET);
+    if (defrag_step(&g_job, 8) != 0) {
+        fprintf(stderr, "ERROR: defrag wrote to a block it no longer owned\n");
+        error_count++;
+    }
+    sfs_fseek(g_id, 0);
+    memset(buffer, 0, 512);
+    sfs_fread(g_id, buffer, 512);
+    if (buffer[0] != 'T' || buffer[511] != 'T') {
+        fprintf(stderr, "ERROR: defrag overwrote a block of another file\n");
+        error_count++;
+    }
+    sfs_fclose(g_id);
+    sfs_remove(g_taken);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: an ended defrag job left the disk inconsistent\n");
+        error_count++;
+    }
+
+    SfsDefragReport d_report;
+    sfs_defrag(3, &d_report);
+    for (i = 0; i < 2; i++) {
+        if (sfs_extents(g_names[i]) != 1) {
+            fprintf(stderr, "ERROR: %s is still fragmented after sfs_defrag\n",
+                g_names[i]);
+            error_count++;
+        }
+        // The files stayed open through the move.
+        sfs_fwrite(g_ids[i], "tail", 4);
+        sfs_fseek(g_ids[i], 0);
+        sfs_fread(g_ids[i], buffer, 8 * 512);
+        for (j = 0; j < 8; j++) {
+            char g_want = (i == 1 && j == 0) ? 0 : 'a' + j + i * 8;
+            if (buffer[j * 512] != g_want || buffer[j * 512 + 511] != g_want) {
+                fprintf(stderr, "ERROR: sfs_defrag corrupted block %d of %s\n",
+                    j, g_names[i]);
+                error_count++;
+                break;
+            }
+        }
+        sfs_fread(g_ids[i], fixedbuf, 4);
+        if (strncmp(fixedbuf, "tail", 4) != 0) {
+            fprintf(stderr, "ERROR: write after sfs_defrag was lost\n");
+            error_count++;
+        }
+        sfs_fclose(g_ids[i]);
+        sfs_remove(g_names[i]);
+    }
+    free(buffer);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: sfs_defrag left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests compressed files
+
+    printf("Tests sfs_set_compression\n");
+
+    char* z_name = "COMPRESS.TST";
+    int z_id = sfs_fopen(z_name);
+    int z_len = strlen(test_str);
+    if (sfs_set_compression(z_id, 1) != 0) {
+        fprintf(stderr, "ERROR: could not turn on compression\n");
+        error_count++;
+    }
+    for (i = 0; i < 200; i++)
+        sfs_fwrite(z_id, test_str, z_len);
+    if (sfs_set_compression(z_id, 0) == 0) {
+        fprintf(stderr, "ERROR: compression changed on a non-empty file\n");
+        error_count++;
+    }
+
+    int z_blocks = 0;
+    for (k = dir_get_fat_root(dir_search(DIR_ROOT, z_name)); k != END_OF_FILE;
+            k = fat_get_next_index(k))
+        z_blocks += fat_get_data_block(k) != NO_DATA;
+    if (z_blocks * 512 >= 200 * z_len / 2) {
+        fprintf(stderr, "ERROR: compressed file uses %d blocks\n", z_blocks);
+        error_count++;
+    }
+
+    // Overwrite the middle of a cluster, then read across clusters.
+    sfs_fseek(z_id, 100 * z_len);
+    sfs_fwrite(z_id, "XYZ", 3);
+    buffer = malloc(200 * z_len);
+    sfs_fseek(z_id, 0);
+    sfs_fread(z_id, buffer, 200 * z_len);
+    for (i = 0; i < 200 * z_len; i++) {
+        char expect = test_str[i % z_len];
+        if (i >= 100 * z_len && i < 100 * z_len + 3)
+            expect = "XYZ"[i - 100 * z_len];
+        if (buffer[i] != expect) {
+            fprintf(stderr, "ERROR: compressed file has wrong byte at %d\n", i);
+            error_count++;
+            break;
+        }
+    }
+
+    sfs_ftruncate(z_id, 5000);
+    sfs_punch_hole(z_id, 10, 20);
+    sfs_fseek(z_id, 0);
+    memset(buffer, 1, 5000);
+    sfs_fread(z_id, buffer, 5000);
+    if (buffer[9] != test_str[9] || buffer[10] != 0 || buffer[29] != 0 ||
+            buffer[4999] != test_str[4999 % z_len]) {
+        fprintf(stderr, "ERROR: wrong data after truncating compressed file\n");
+        error_count++;
+    }
+    free(buffer);
+    sfs_fclose(z_id);
+    sfs_remove(z_name);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: compressed file left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests deduplication
+
+    printf("Tests sfs_set_dedup\n");
+
+    char* e_names[2] = {"DEDUPA.TST", "DEDUPB.TST"};
+    int e_ids[2], e_len = 8 * 512 + 100;
+    buffer = malloc(e_len + 4);
+    for (j = 0; j < e_len; j++)
+        buffer[j] = 'a' + j / 512;
+    sfs_set_dedup(1);
+    for (i = 0; i < 2; i++) {
+        e_ids[i] = sfs_fopen(e_names[i]);
+        sfs_fwrite(e_ids[i], buffer, e_len);
+    }
+    int e_roots[2] = {dir_get_fat_root(dir_search(DIR_ROOT, e_names[0])),
+        dir_get_fat_root(dir_search(DIR_ROOT, e_names[1]))};
+    for (j = 0; j < 9; j++) {
+        if (fat_get_data_block(e_roots[0]) != fat_get_data_block(e_roots[1])) {
+            fprintf(stderr, "ERROR: identical block %d was not shared\n", j);
+            error_count++;
+            break;
+        }
+        e_roots[0] = fat_get_next_index(e_roots[0]);
+        e_roots[1] = fat_get_next_index(e_roots[1]);
+    }
+
+    // Changing a shared block, or appending to a shared partial one,
+    // must leave the other file alone.
+    sfs_fseek(e_ids[1], 10);
+    sfs_fwrite(e_ids[1], "XYZ", 3);
+    sfs_fseek(e_ids[1], e_len);
+    sfs_fwrite(e_ids[1], "tail", 4);
+    sfs_fseek(e_ids[0], 0);
+    memset(buffer, 0, e_len);
+    sfs_fread(e_ids[0], buffer, e_len + 4);
+    for (j = 0; j < e_len; j++) {
+        if (buffer[j] != 'a' + j / 512) {
+            fprintf(stderr, "ERROR: write to a shared block changed %s\n",
+                e_names[0]);
+            error_count++;
+            break;
+        }
+    }
+    sfs_fclose(e_ids[0]);
+    sfs_remove(e_names[0]);
+    sfs_fseek(e_ids[1], 0);
+    sfs_fread(e_ids[1], buffer, e_len + 4);
+    if (strncmp(buffer + 10, "XYZ", 3) != 0 || buffer[13] != 'a' ||
+            buffer[4000] != 'h' || strncmp(buffer + e_len, "tail", 4) != 0) {
+        fprintf(stderr, "ERROR: wrong data in %s after copy on write\n",
+            e_names[1]);
+        error_count++;
+    }
+    sfs_set_dedup(0);
+    free(buffer);
+    sfs_fclose(e_ids[1]);
+    sfs_remove(e_names[1]);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: shared blocks left the disk inconsistent\n");
+        error_count++;
+    }
+
+    // A write must not be deduplicated into a run reserved for a
+    // snapshot or a defrag job, since no file references it yet. Each
+    // run is lined up on a freed zero block by holding every free block
+    // before it, at a zero block of the copy in the snapshot's case.
+    char* e_zero = "DDZERO.TST";
+    byte *e_held = malloc(TOTAL_DATA_BLOCKS);
+    int e_db;
+    buffer = calloc(512, 1);
+    sfs_set_dedup(1);
+    e_db = write_and_remove(e_zero, buffer);
+    int e_at = zero_copy_offset(e_db - DATA_BLOCK_OFFSET,
+        DIRECTORY_BLOCKS + FAT_BLOCKS);
+    if (e_at < 0) {
+        fprintf(stderr, "ERROR: no room to line up a snapshot at block %d\n",
+            e_db);
+        error_count++;
+    }
+    hold_free_below(e_db - DATA_BLOCK_OFFSET - e_at, e_held);
+    int e_snap = sfs_snapshot_create();
+    release_held(e_held);
+    e_ids[0] = sfs_fopen(e_zero);
+    sfs_fwrite(e_ids[0], buffer, 512);
+    sfs_fclose(e_ids[0]);
+    sfs_snapshot_delete(e_snap);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: a write was deduplicated into a snapshot\n");
+        error_count++;
+    }
+    sfs_remove(e_zero);
+
+    char e_frag[24];
+    e_ids[0] = sfs_fopen(e_names[0]);
+    for (j = 0; ; j++) {
+        sprintf(e_frag, "DDFRAG%02d.TST", j);
+        e_ids[1] = sfs_fopen(e_frag);
+        if (fbl_home_group(dir_search(DIR_ROOT, e_frag)) ==
+                fbl_home_group(dir_search(DIR_ROOT, e_names[0])))
+            break;
+        sfs_fclose(e_ids[1]);
+        sfs_remove(e_frag);
+    }
+    for (j = 0; j < 4; j++) {
+        for (i = 0; i < 2; i++) {
+            memset(buffer, 'A' + j + i * 4, 512);
+            sfs_fwrite(e_ids[i], buffer, 512);
+        }
+    }
+    sfs_fclose(e_ids[0]);
+    sfs_remove(e_names[0]);
+    memset(buffer, 0, 512);
+    e_db = write_and_remove(e_zero, buffer);
+    hold_free_below(e_db - DATA_BLOCK_OFFSET, e_held);
+    DefragJob e_job;
+    if (!defrag_begin(dir_search(DIR_ROOT, e_frag), &e_job) ||
+            e_job.target != e_db - DATA_BLOCK_OFFSET) {
+        fprintf(stderr, "ERROR: could not reserve a defrag run at block %d\n",
+            e_db);
+        error_count++;
+    }
+    release_held(e_held);
+    e_ids[0] = sfs_fopen(e_zero);
+    sfs_fwrite(e_ids[0], buffer, 512);
+    while (defrag_step(&e_job, 1) > 0)
+        ;
+    sfs_fseek(e_ids[0], 0);
+    memset(buffer, 'x', 512);
+    sfs_fread(e_ids[0], buffer, 512);
+    for (j = 0; j < 512 && buffer[j] == 0; j++)
+        ;
+    if (j < 512 || sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: a write was deduplicated into a defrag run\n");
+        error_count++;
+    }
+    sfs_set_dedup(0);
+    sfs_fclose(e_ids[0]);
+    sfs_remove(e_zero);
+    sfs_fclose(e_ids[1]);
+    sfs_remove(e_frag);
+    free(e_held);
+    free(buffer);
+
+    //-------- The following part tests inline files
+
+    printf("Tests inline files\n");
+
+    char* n_name = "INLINE.TST";
+    int n_id = sfs_fopen(n_name);
+    sfs_fwrite(n_id, "key=value\n", 10);
+    sfs_fclose(n_id);
+    if (dir_get_fat_root(dir_search(DIR_ROOT, n_name)) != END_OF_FILE) {
+        fprintf(stderr, "ERROR: tiny file was given a FAT chain\n");
+        error_count++;
+    }
+
+    // Reading it back after a lazy mount needs no FAT block.
+    sfs_unmount();
+    mksfs(SFS_LAZY_MOUNT);
+    n_id = sfs_fopen(n_name);
+    memset(fixedbuf, 0, 10);
+    sfs_fread(n_id, fixedbuf, 10);
+    if (strncmp(fixedbuf, "key=value\n", 10) != 0 || fat_blocks_read() != 0) {
+        fprintf(stderr, "ERROR: inline file read back wrong or from the FAT\n");
+        error_count++;
+    }
+
+    // Growing past the directory entry moves the data out to blocks.
+    buffer = malloc(600);
+    memset(buffer, 'n', 600);
+    sfs_fwrite(n_id, buffer, 600);
+    sfs_fseek(n_id, 0);
+    memset(buffer, 0, 600);
+    sfs_fread(n_id, buffer, 600);
+    if (dir_get_fat_root(dir_search(DIR_ROOT, n_name)) == END_OF_FILE ||
+            strncmp(buffer, "key=value\n", 10) != 0 || buffer[599] != 'n') {
+        fprintf(stderr, "ERROR: inline file did not spill to blocks intact\n");
+        error_count++;
+    }
+    free(buffer);
+    sfs_fclose(n_id);
+    sfs_remove(n_name);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: inline files left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests tail packing
+
+    printf("Tests sfs_set_tail_packing\n");
+
+    char* t_names[3] = {"TAILA.TST", "TAILB.TST", "TAILC.TST"};
+    int t_ids[3], t_tails[3];
+    buffer = malloc(512 + 100 + 4);
+    sfs_set_tail_packing(1);
+    for (i = 0; i < 3; i++) {
+        memset(buffer, 'A' + i, 512 + 100);
+        t_ids[i] = sfs_fopen(t_names[i]);
+        sfs_fwrite(t_ids[i], buffer, 512 + 100);
+        sfs_fclose(t_ids[i]);
+        t_tails[i] = fat_get_data_block(fat_get_tail(
+            dir_get_fat_root(dir_search(DIR_ROOT, t_names[i]))));
+    }
+    if (t_tails[0] != t_tails[1] || t_tails[1] != t_tails[2]) {
+        fprintf(stderr, "ERROR: file tails were not packed together\n");
+        error_count++;
+    }
+
+    // Appending to the middle file unpacks its tail; the others stay.
+    t_ids[1] = sfs_fopen(t_names[1]);
+    sfs_fwrite(t_ids[1], "tail", 4);
+    sfs_fclose(t_ids[1]);
+    for (i = 0; i < 3; i++) {
+        t_ids[i] = sfs_fopen(t_names[i]);
+        memset(buffer, 0, 512 + 100 + 4);
+        sfs_fread(t_ids[i], buffer, 512 + 100 + 4);
+        if (buffer[0] != 'A' + i || buffer[511] != 'A' + i ||
+                buffer[512] != 'A' + i || buffer[611] != 'A' + i ||
+                (i == 1 && strncmp(buffer + 612, "tail", 4) != 0)) {
+            fprintf(stderr, "ERROR: wrong data in packed file %s\n",
+                t_names[i]);
+            error_count++;
+        }
+        sfs_fclose(t_ids[i]);
+    }
+    sfs_remove(t_names[0]);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: packed tails left the disk inconsistent\n");
+        error_count++;
+    }
+    sfs_set_tail_packing(0);
+    sfs_remove(t_names[1]);
+    sfs_remove(t_names[2]);
+    free(buffer);
+
+    //-------- The following part tests cloning
+
+    printf("Tests sfs_clone\n");
+
+    char* c_names[2] = {"CLONEA.TST", "CLONEB.TST"};
+    int c_ids[2], c_len = 3 * 512 + 100;
+    buffer = malloc(c_len);
+    for (j = 0; j < c_len; j++)
+        buffer[j] = 'a' + j / 512;
+    c_ids[0] = sfs_fopen(c_names[0]);
+    sfs_fwrite(c_ids[0], buffer, c_len);
+    if (sfs_clone(c_names[0], c_names[1]) != 0 ||
+            sfs_clone(c_names[0], c_names[1]) != ERR_EXISTS ||
+            sfs_clone("NOSUCH.TST", "CLONEC.TST") != ERR_NOT_FOUND) {
+        fprintf(stderr, "ERROR: sfs_clone returned the wrong result\n");
+        error_count++;
+    }
+    if (fat_get_data_block(dir_get_fat_root(dir_search(DIR_ROOT, c_names[0]))) !=
+            fat_get_data_block(dir_get_fat_root(dir_search(DIR_ROOT, c_names[1])))) {
+        fprintf(stderr, "ERROR: clone did not share its data blocks\n");
+        error_count++;
+    }
+
+    // Changing the clone leaves the source alone, and the other way round.
+    c_ids[1] = sfs_fopen(c_names[1]);
+    sfs_fseek(c_ids[1], 600);
+    sfs_fwrite(c_ids[1], "XYZ", 3);
+    sfs_fseek(c_ids[0], 0);
+    sfs_fwrite(c_ids[0], "abc", 3);
+    sfs_fseek(c_ids[0], 0);
+    sfs_fread(c_ids[0], buffer, c_len);
+    if (strncmp(buffer, "abc", 3) != 0 || buffer[600] != 'b') {
+        fprintf(stderr, "ERROR: write to a clone changed %s\n", c_names[0]);
+        error_count++;
+    }
+    sfs_fclose(c_ids[0]);
+    sfs_remove(c_names[0]);
+    sfs_fseek(c_ids[1], 0);
+    sfs_fread(c_ids[1], buffer, c_len);
+    if (buffer[0] != 'a' || strncmp(buffer + 600, "XYZ", 3) != 0 ||
+            buffer[c_len - 1] != 'd') {
+        fprintf(stderr, "ERROR: wrong data in %s\n", c_names[1]);
+        error_count++;
+    }
+    sfs_fclose(c_ids[1]);
+    sfs_remove(c_names[1]);
+    free(buffer);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: clones left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests copying ranges
+
+    printf("Tests sfs_copy_range\n");
+
+    int r_len = 40 * 512 + 37, r_src, r_dst, r_copied;
+    buffer = malloc(r_len);
+    for (j = 0; j < r_len; j++)
+        buffer[j] = j % 251;
+    r_src = sfs_fopen("COPYSRC.TST");
+    sfs_fwrite(r_src, buffer, r_len);
+    sfs_fseek(r_src, 0);
+    r_dst = sfs_fopen("COPYDST.TST");
+    sfs_fwrite(r_dst, "0123456789", 10);
+    r_copied = sfs_copy_range(r_src, 300, r_dst, 10, r_len);
+    if (r_copied != r_len - 300 ||
+            sfs_copy_range(r_src, 0, r_src, 100, 200) != ERR_UNKNOWN) {
+        fprintf(stderr, "ERROR: sfs_copy_range returned %d\n", r_copied);
+        error_count++;
+    }
+
+    // The copy leaves the file pointers where they were.
+    sfs_fread(r_src, fixedbuf, 1);
+    sfs_fwrite(r_dst, "!", 1);
+    memset(buffer, 0, r_len);
+    sfs_fseek(r_dst, 0);
+    sfs_fread(r_dst, buffer, r_len);
+    if (fixedbuf[0] != 0 || buffer[9] != '9' || buffer[10] != '!') {
+        fprintf(stderr, "ERROR: sfs_copy_range moved a file pointer\n");
+        error_count++;
+    }
+    for (j = 11; j < r_copied + 10; j++) {
+        if (buffer[j] != (char) ((j - 10 + 300) % 251)) {
+            fprintf(stderr, "ERROR: wrong data at %d of copied range\n", j);
+            error_count++;
+            break;
+        }
+    }
+    sfs_fclose(r_src);
+    sfs_fclose(r_dst);
+    sfs_remove("COPYSRC.TST");
+    sfs_remove("COPYDST.TST");
+    free(buffer);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: copying a range left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests memory mapping
+
+    printf("Tests sfs_mmap\n");
+
+    int m_len = 3 * 512, m_id;
+    char *m_ro, *m_rw;
+    buffer = malloc(m_len);
+    for (j = 0; j < m_len; j++)
+        buffer[j] = 'a' + j % 26;
+    m_id = sfs_fopen("MMAP.TST");
+    sfs_fwrite(m_id, buffer, m_len);
+    m_ro = sfs_mmap(m_id, 100, 1000, SFS_PROT_READ);
+    if (m_ro == NULL || m_ro[0] != 'a' + 100 % 26 ||
+            m_ro[999] != 'a' + 1099 % 26) {
+        fprintf(stderr, "ERROR: read-only mapping has the wrong data\n");
+        error_count++;
+    }
+    sfs_munmap(m_ro);
+
+    // Changes reach the file on sync, and again on close.
+    m_rw = sfs_mmap(m_id, 0, m_len + 100, SFS_PROT_READ | SFS_PROT_WRITE);
+    m_rw[10] = '#';
+    m_rw[1200] = '#';
+    sfs_msync(m_rw);
+    sfs_fseek(m_id, 0);
+    sfs_fread(m_id, buffer, m_len);
+    if (buffer[10] != '#' || buffer[1200] != '#' || buffer[11] != 'l') {
+        fprintf(stderr, "ERROR: sfs_msync did not write the mapping back\n");
+        error_count++;
+    }
+    m_rw[m_len - 1] = '$';
+    sfs_fclose(m_id);
+    m_id = sfs_fopen("MMAP.TST");
+    sfs_fread(m_id, buffer, m_len);
+    if (buffer[m_len - 1] != '$' || sfs_munmap(m_rw) != ERR_NOT_FOUND) {
+        fprintf(stderr, "ERROR: closing did not write back and unmap\n");
+        error_count++;
+    }
+    sfs_fclose(m_id);
+    sfs_remove("MMAP.TST");
+    free(buffer);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: mapping left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests snapshots
+
+    printf("Tests sfs_snapshot_create\n");
+
+    char* q_name = "SNAP.TST";
+    buffer = malloc(1024);
+    memset(buffer, 'o', 1024);
+    int q_id = sfs_fopen(q_name);
+    sfs_fwrite(q_id, buffer, 1024);
+    int q_snap = sfs_snapshot_create();
+    if (q_snap < 0) {
+        fprintf(stderr, "ERROR: could not take a snapshot\n");
+        error_count++;
+    }
+
+    // The live file is changed after the snapshot, and a file is added.
+    memset(buffer, 'n', 1024);
+    sfs_fseek(q_id, 0);
+    sfs_fwrite(q_id, buffer, 1024);
+    sfs_fclose(q_id);
+    q_id = sfs_fopen("SNAPNEW.TST");
+    sfs_fwrite(q_id, "new", 3);
+    sfs_fclose(q_id);
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: snapshot left the disk inconsistent\n");
+        error_count++;
+    }
+
+    // The snapshot still has the old data and cannot be changed.
+    sfs_snapshot_mount(q_snap);
+    q_id = sfs_fopen(q_name);
+    memset(buffer, 0, 1024);
+    sfs_fread(q_id, buffer, 1024);
+    if (buffer[0] != 'o' || buffer[1023] != 'o') {
+        fprintf(stderr, "ERROR: snapshot did not keep the old data\n");
+        error_count++;
+    }
+    sfs_fwrite(q_id, "x", 1);
+    if (sfs_fopen("SNAPNEW.TST") != ERR_READ_ONLY ||
+            sfs_remove(q_name) != ERR_READ_ONLY) {
+        fprintf(stderr, "ERROR: snapshot was not mounted read-only\n");
+        error_count++;
+    }
+    sfs_fseek(q_id, 0);
+    sfs_fread(q_id, buffer, 1);
+    if (buffer[0] != 'o') {
+        fprintf(stderr, "ERROR: write to a read-only snapshot went through\n");
+        error_count++;
+    }
+    sfs_unmount();
+
+    mksfs(SFS_LAZY_MOUNT);
+    q_id = sfs_fopen(q_name);
+    sfs_fread(q_id, buffer, 1024);
+    if (buffer[0] != 'n' || buffer[1023] != 'n') {
+        fprintf(stderr, "ERROR: live volume lost writes made after snapshot\n");
+        error_count++;
+    }
+    sfs_fclose(q_id);
+    if (sfs_snapshot_delete(q_snap) != 0 || sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: deleting a snapshot left the disk inconsistent\n");
+        error_count++;
+    }
+    sfs_remove(q_name);
+    sfs_remove("SNAPNEW.TST");
+    free(buffer);
+
+    //-------- The following part tests directories
+
+    printf("Tests sfs_mkdir\n");
+
+    if (sfs_mkdir("DIRA") != 0 || sfs_mkdir("DIRA/SUB") != 0 ||
+            sfs_mkdir("DIRB") != 0) {
+        fprintf(stderr, "ERROR: could not create directories\n");
+        error_count++;
+    }
+    if (sfs_mkdir("DIRA") != ERR_EXISTS ||
+            sfs_mkdir("NODIR/SUB") != ERR_NOT_FOUND ||
+            sfs_fopen("NODIR/FILE") != ERR_NOT_FOUND ||
+            sfs_fopen("DIRA/SUB") != ERR_IS_DIR) {
+        fprintf(stderr, "ERROR: bad paths were not refused\n");
+        error_count++;
+    }
+
+    // The same name in different directories names different files.
+    int h_a = sfs_fopen("DIRA/SUB/SAME.TXT");
+    int h_b = sfs_fopen("DIRB/SAME.TXT");
+    int h_c = sfs_fopen("SAME.TXT");
+    sfs_fwrite(h_a, "aaaa", 4);
+    sfs_fwrite(h_b, "bb", 2);
+    sfs_fclose(h_a);
+    sfs_fclose(h_b);
+    sfs_fclose(h_c);
+    sfs_unmount();
+
+    // After a lazy mount a lookup only reads the blocks its names hash
+    // to, not the whole directory.
+    mksfs(SFS_LAZY_MOUNT);
+    h_a = sfs_fopen("/DIRA/SUB/SAME.TXT");
+    if (dir_blocks_read() > 6) {
+        fprintf(stderr, "ERROR: path lookup read %d directory blocks\n",
+            dir_blocks_read());
+        error_count++;
+    }
+    char h_buf[8] = {0};
+    sfs_fread(h_a, h_buf, 8);
+    sfs_fclose(h_a);
+    h_b = sfs_fopen("DIRB/SAME.TXT");
+    sfs_fread(h_b, h_buf + 4, 4);
+    sfs_fclose(h_b);
+    if (strcmp(h_buf, "aaaabb") != 0) {
+        fprintf(stderr, "ERROR: files in directories mixed up: %s\n", h_buf);
+        error_count++;
+    }
+
+    if (sfs_remove("DIRA/SUB") != ERR_NOT_EMPTY) {
+        fprintf(stderr, "ERROR: removed a directory that was not empty\n");
+        error_count++;
+    }
+    sfs_remove("DIRA/SUB/SAME.TXT");
+    if (sfs_remove("DIRA/SUB") != 0 || sfs_remove("DIRA") != 0 ||
+            sfs_fopen("DIRA/SUB/SAME.TXT") != ERR_NOT_FOUND) {
+        fprintf(stderr, "ERROR: could not remove empty directories\n");
+        error_count++;
+    }
+    sfs_remove("DIRB/SAME.TXT");
+    sfs_remove("DIRB");
+    sfs_remove("SAME.TXT");
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: directories left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests a large directory
+
+    printf("Tests a large directory\n");
+
+    // Far more short names than fixed 256 byte entries had room for.
+    char w_name[MAX_FNAME_LENGTH + 8];
+    int w_made = 0, w_lost = 0, w_before = dir_get_used();
+    for (i = 0; i < 600; i++) {
+        sprintf(w_name, "MANY%04d.TXT", i);
+        int w_id = sfs_fopen(w_name);
+        if (w_id < 0) break;
+        if (i % 50 == 0) sfs_fwrite(w_id, w_name, strlen(w_name));
+        sfs_fclose(w_id);
+        w_made++;
+    }
+    sfs_unmount();
+    mksfs(SFS_LAZY_MOUNT);
+    for (i = 0; i < w_made; i++) {
+        sprintf(w_name, "MANY%04d.TXT", i);
+        int w_index = dir_search(DIR_ROOT, w_name);
+        if (w_index < 0 || dir_get_size(w_index) != (i % 50 == 0 ? 12 : 0))
+            w_lost++;
+    }
+    if (w_made != 600 || w_lost != 0) {
+        fprintf(stderr, "ERROR: made %d of 600 files, %d lost\n", w_made,
+            w_lost);
+        error_count++;
+    }
+    for (i = 0; i < w_made; i++) {
+        sprintf(w_name, "MANY%04d.TXT", i);
+        sfs_remove(w_name);
+    }
+    if (dir_get_used() != w_before || sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: large directory left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests listing directories
+
+    printf("Tests sfs_readdir_batch and sfs_stat\n");
+
+    char* y_names[4] = {"LS/ALPHA", "LS/ALSO", "LS/BETA", "LS/ADIR"};
+    SfsStat y_st[4];
+    SfsDir y_all, y_al;
+    sfs_mkdir("LS");
+    for (i = 0; i < 3; i++) {
+        int y_id = sfs_fopen(y_names[i]);
+        buffer = malloc(1000 * (i + 1));
+        memset(buffer, 'y', 1000 * (i + 1));
+        sfs_fwrite(y_id, buffer, 1000 * (i + 1));
+        free(buffer);
+        sfs_fclose(y_id);
+    }
+    sfs_mkdir(y_names[3]);
+
+    // Two listings of the same directory, read one entry at a time in
+    // turn, do not disturb each other, and both come in name order.
+    char* y_sorted[4] = {"ADIR", "ALPHA", "ALSO", "BETA"};
+    int y_total = 0, y_prefixed = 0, y_n, y_m;
+    sfs_opendir("LS", NULL, &y_all);
+    sfs_opendir("/LS", "AL", &y_al);
+    do {
+        y_n = sfs_readdir_batch(&y_all, y_st, 1);
+        if (y_n > 0 && (y_total >= 4 ||
+                strcmp(y_st[0].name, y_sorted[y_total]) != 0)) {
+            fprintf(stderr, "ERROR: listed %s out of order\n", y_st[0].name);
+            error_count++;
+        }
+        y_total += y_n;
+        y_m = sfs_readdir_batch(&y_al, y_st + 1, 1);
+        // The names starting with AL follow ADIR in the sorted list.
+        if (y_m > 0 && (y_prefixed >= 2 ||
+                strcmp(y_st[1].name, y_sorted[1 + y_prefixed]) != 0)) {
+            fprintf(stderr, "ERROR: listed %s, not matching the prefix\n",
+                y_st[1].name);
+            error_count++;
+        }
+        y_prefixed += y_m;
+    } while (y_n > 0 || y_m > 0);
+    if (y_total != 4 || y_prefixed != 2) {
+        fprintf(stderr, "ERROR: listed %d and %d entries, not 4 and 2\n",
+            y_total, y_prefixed);
+        error_count++;
+    }
+
+    // An entry created behind the cursor is not listed, one ahead of it is.
+    sfs_opendir("LS", NULL, &y_all);
+    sfs_readdir_batch(&y_all, y_st, 2);
+    sfs_fclose(sfs_fopen("LS/AARDVARK"));
+    sfs_fclose(sfs_fopen("LS/AZ"));
+    y_n = sfs_readdir_batch(&y_all, y_st, 4);
+    if (y_n != 3 || strcmp(y_st[0].name, "ALSO") != 0 ||
+            strcmp(y_st[1].name, "AZ") != 0 ||
+            strcmp(y_st[2].name, "BETA") != 0) {
+        fprintf(stderr, "ERROR: listing missed a change to the directory\n");
+        error_count++;
+    }
+    sfs_remove("LS/AARDVARK");
+    sfs_remove("LS/AZ");
+
+    if (sfs_stat("LS/BETA", &y_st[0]) != 0 || y_st[0].size != 3000 ||
+            y_st[0].blocks != 6 || y_st[0].is_dir ||
+            strcmp(y_st[0].name, "BETA") != 0) {
+        fprintf(stderr, "ERROR: wrong stat for a file\n");
+        error_count++;
+    }
+    if (sfs_stat("LS", &y_st[0]) != 0 || !y_st[0].is_dir ||
+            y_st[0].size != 4 || sfs_stat("LS/GAMMA", &y_st[0]) !=
+            ERR_NOT_FOUND || sfs_opendir("LS/BETA", NULL, &y_all) !=
+            ERR_NOT_FOUND) {
+        fprintf(stderr, "ERROR: wrong stat for a directory or missing path\n");
+        error_count++;
+    }
+    for (i = 3; i >= 0; i--)
+        sfs_remove(y_names[i]);
+    sfs_remove("LS");
+
+    //-------- The following part tests batches
+
+    printf("Tests sfs_begin and sfs_commit\n");
+
+    char x_name[MAX_FNAME_LENGTH + 8];
+    byte *x_before = malloc(DIRECTORY_BLOCKS * BLOCK_SIZE);
+    byte *x_during = malloc(DIRECTORY_BLOCKS * BLOCK_SIZE);
+    read_blocks(DIR_START, DIRECTORY_BLOCKS, x_before);
+
+    // Nothing reaches the directory on disk until the outer commit.
+    sfs_begin();
+    sfs_begin();
+    for (i = 0; i < 40; i++) {
+        sprintf(x_name, "BATCH%02d.TXT", i);
+        int x_id = sfs_fopen(x_name);
+        sfs_fwrite(x_id, x_name, strlen(x_name));
+        sfs_fclose(x_id);
+    }
+    for (i = 0; i < 40; i += 2) {
+        sprintf(x_name, "BATCH%02d.TXT", i);
+        sfs_remove(x_name);
+    }
+    sfs_commit();
+    read_blocks(DIR_START, DIRECTORY_BLOCKS, x_during);
+    if (memcmp(x_before, x_during, DIRECTORY_BLOCKS * BLOCK_SIZE) != 0) {
+        fprintf(stderr, "ERROR: directory written inside a batch\n");
+        error_count++;
+    }
+    if (sfs_commit() != 0 || sfs_commit() != ERR_UNKNOWN) {
+        fprintf(stderr, "ERROR: batches did not nest\n");
+        error_count++;
+    }
+    read_blocks(DIR_START, DIRECTORY_BLOCKS, x_during);
+    if (memcmp(x_before, x_during, DIRECTORY_BLOCKS * BLOCK_SIZE) == 0) {
+        fprintf(stderr, "ERROR: commit did not write the directory\n");
+        error_count++;
+    }
+    free(x_before);
+    free(x_during);
+
+    // A lazy mount sees exactly what the batch left.
+    sfs_unmount();
+    mksfs(SFS_LAZY_MOUNT);
+    int x_found = 0;
+    for (i = 0; i < 40; i++) {
+        sprintf(x_name, "BATCH%02d.TXT", i);
+        if (dir_search(DIR_ROOT, x_name) >= 0)
+            x_found += i % 2 ? 1 : 100;
+    }
+    if (x_found != 20) {
+        fprintf(stderr, "ERROR: batched creates and removes were lost\n");
+        error_count++;
+    }
+    sfs_begin();
+    for (i = 1; i < 40; i += 2) {
+        sprintf(x_name, "BATCH%02d.TXT", i);
+        sfs_remove(x_name);
+    }
+    sfs_commit();
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: batches left the disk inconsistent\n");
+        error_count++;
+    }
+
+    //-------- The following part tests allocation groups
+
+    printf("Tests allocation groups\n");
+
+    // Two files in different groups written in turn stay contiguous.
+    char v_names[2][24];
+    int v_ids[2];
+    buffer = malloc(512);
+    sprintf(v_names[0], "GROUPA.TST");
+    v_ids[0] = sfs_fopen(v_names[0]);
+    for (j = 0; ; j++) {
+        sprintf(v_names[1], "GROUP%02d.TST", j);
+        v_ids[1] = sfs_fopen(v_names[1]);
+        if (fbl_home_group(dir_search(DIR_ROOT, v_names[1])) !=
+                fbl_home_group(dir_search(DIR_ROOT, v_names[0])))
+            break;
+        sfs_fclose(v_ids[1]);
+        sfs_remove(v_names[1]);
+    }
+    for (j = 0; j < 8; j++) {
+        for (i = 0; i < 2; i++) {
+            memset(buffer, 'a' + j + i * 8, 512);
+            sfs_fwrite(v_ids[i], buffer, 512);
+        }
+    }
+    for (i = 0; i < 2; i++) {
+        if (sfs_extents(v_names[i]) != 1) {
+            fprintf(stderr, "ERROR: %s interleaved with another group\n",
+                v_names[i]);
+            error_count++;
+        }
+        sfs_fclose(v_ids[i]);
+        sfs_remove(v_names[i]);
+    }
+
+    // Copying a shared block on write also keeps to the file's group.
+    v_ids[0] = sfs_fopen(v_names[0]);
+    memset(buffer, 'x', 512);
+    sfs_fwrite(v_ids[0], buffer, 512);
+    sfs_fclose(v_ids[0]);
+    int v_dir;
+    for (j = 0; ; j++) {
+        sprintf(v_names[1], "COPY%02d.TST", j);
+        sfs_clone(v_names[0], v_names[1]);
+        v_dir = dir_search(DIR_ROOT, v_names[1]);
+        if (fbl_home_group(v_dir) !=
+                fbl_home_group(dir_search(DIR_ROOT, v_names[0])))
+            break;
+        sfs_remove(v_names[1]);
+    }
+    v_ids[1] = sfs_fopen(v_names[1]);
+    sfs_punch_hole(v_ids[1], 0, 16);
+    sfs_fclose(v_ids[1]);
+    int v_db = fat_get_data_block(dir_get_fat_root(v_dir)) - DATA_BLOCK_OFFSET;
+    if (v_db / FBL_GROUP_BLOCKS != fbl_home_group(v_dir)) {
+        fprintf(stderr, "ERROR: copy on write left the home group\n");
+        error_count++;
+    }
+    for (i = 0; i < 2; i++)
+        sfs_remove(v_names[i]);
+    free(buffer);
+
+    // Threads allocating at once each stay in their own group.
+    pthread_t v_threads[4];
+    int v_blocks[4][33];
+    int v_free = fbl_get_num_free();
+    for (i = 0; i < 4; i++) {
+        v_blocks[i][0] = FBL_GROUPS - 1 - i;
+        pthread_create(&v_threads[i], NULL, alloc_worker, v_blocks[i]);
+    }
+    for (i = 0; i < 4; i++)
+        pthread_join(v_threads[i], NULL);
+    for (i = 0; i < 4; i++) {
+        for (j = 1; j <= 32; j++) {
+            if (v_blocks[i][j] / FBL_GROUP_BLOCKS != v_blocks[i][0] ||
+                    fbl_is_free(v_blocks[i][j])) {
+                fprintf(stderr, "ERROR: block %d allocated outside group %d\n",
+                    v_blocks[i][j], v_blocks[i][0]);
+                error_count++;
+                break;
+            }
+        }
+    }
+    if (fbl_get_num_free() != v_free - 4 * 32) {
+        fprintf(stderr, "ERROR: group free counts are wrong\n");
+        error_count++;
+    }
+    for (i = 0; i < 4; i++) {
+        for (j = 1; j <= 32; j++)
+            fbl_set_free_index(v_blocks[i][j]);
+    }
+    if (sfs_fsck(0, 2, &report) != 0) {
+        fprintf(stderr, "ERROR: allocation groups left the disk inconsistent\n");
+        error_count++;
+    }
+
     fprintf(stderr, "Test program exiting with %d errors\n", error_count);
     return (error_count);
 }
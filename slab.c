@@ -0,0 +1,93 @@
+#include "slab.h"
+
+#include <stdlib.h>
+
+/* The header of each chunk. The objects follow it. */
+typedef union _Chunk
+{
+    union _Chunk *next;
+    /* Keeps the objects after the header aligned for any type. */
+    long double align;
+} Chunk;
+
+struct _Slab
+{
+    int object_size;
+    int chunk_objects;
+    Chunk *chunks;
+    /* Objects freed since they were handed out, linked through their
+       first bytes. */
+    void *free_list;
+    /* The part of the newest chunk not handed out yet. */
+    char *fresh;
+    int nfresh;
+};
+
+static long total_objects;
+static long total_chunks;
+
+Slab *slab_create(int object_size, int chunk_objects)
+{
+    Slab *s = malloc(sizeof(Slab));
+    // Room for the free list link, rounded up to keep objects aligned.
+    if (object_size < sizeof(void*))
+        object_size = sizeof(void*);
+    s->object_size = (object_size + sizeof(void*) - 1) &
+        ~(sizeof(void*) - 1);
+    s->chunk_objects = chunk_objects;
+    s->chunks = NULL;
+    s->free_list = NULL;
+    s->fresh = NULL;
+    s->nfresh = 0;
+    return s;
+}
+
+void *slab_alloc(Slab *s)
+{
+    void *obj;
+    total_objects++;
+    if (s->free_list != NULL) {
+        obj = s->free_list;
+        s->free_list = *(void**) obj;
+        return obj;
+    }
+
+    if (s->nfresh == 0) {
+        Chunk *c = malloc(sizeof(Chunk) +
+            (size_t) s->object_size * s->chunk_objects);
+        c->next = s->chunks;
+        s->chunks = c;
+        s->fresh = (char*) (c + 1);
+        s->nfresh = s->chunk_objects;
+        total_chunks++;
+    }
+    obj = s->fresh;
+    s->fresh += s->object_size;
+    s->nfresh--;
+    return obj;
+}
+
+void slab_free(Slab *s, void *obj)
+{
+    if (obj == NULL) return;
+    *(void**) obj = s->free_list;
+    s->free_list = obj;
+}
+
+void slab_release(Slab *s)
+{
+    while (s->chunks != NULL) {
+        Chunk *next = s->chunks->next;
+        free(s->chunks);
+        s->chunks = next;
+    }
+    s->free_list = NULL;
+    s->fresh = NULL;
+    s->nfresh = 0;
+}
+
+void slab_counts(long *objects, long *chunks)
+{
+    *objects = total_objects;
+    *chunks = total_chunks;
+}
@@ -0,0 +1,24 @@
+#ifndef __SLAB_H
+#define __SLAB_H
+
+/* A pool of objects of one size, carved out of chunks of many objects
+   at a time. Freed objects go on a free list for reuse, and releasing
+   the pool frees every chunk at once. */
+typedef struct _Slab Slab;
+
+/* Creates an empty pool of [object_size] byte objects, allocating
+   [chunk_objects] of them at a time. */
+Slab *slab_create(int object_size, int chunk_objects);
+
+void *slab_alloc(Slab *s);
+
+void slab_free(Slab *s, void *obj);
+
+/* Frees every object in the pool at once. The pool stays usable. */
+void slab_release(Slab *s);
+
+/* Returns the number of objects handed out and of chunks allocated, over
+   every pool since the program started. */
+void slab_counts(long *objects, long *chunks);
+
+#endif
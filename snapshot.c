@@ -0,0 +1,100 @@
+#include "snapshot.h"
+#include "sfs_types.h"
+#include "sfs_constants.h"
+#include "sblock_cache.h"
+#include "fat_cache.h"
+#include "free_block_list.h"
+#include "refcount.h"
+
+#include "lib/disk_emu.h"
+
+#include <stdlib.h>
+
+#define SNAP_LEN (DIRECTORY_BLOCKS + FAT_BLOCKS)
+
+static byte *read_fat_copy(int start);
+
+/**
+ * The directory and FAT regions sit next to each other on disk, so the
+ * copy is one read and one write. Only the FAT is walked after that,
+ * to take the references; no data block is touched.
+*/
+int snap_create()
+{
+    int id, got, i;
+    for (id = 0; id < MAX_SNAPSHOTS; id++) {
+        if (sbc_get_snapshot(id) == 0) break;
+    }
+    if (id == MAX_SNAPSHOTS) return ERR_OUT_OF_SPACE;
+
+    int run = fbl_alloc_run(SNAP_LEN, &got);
+    if (run < 0) return ERR_OUT_OF_SPACE;
+    if (got < SNAP_LEN) {
+        for (i = 0; i < got; i++)
+            fbl_set_free_index(run + i);
+        return ERR_OUT_OF_SPACE;
+    }
+
+    byte *buf = malloc(SNAP_LEN * BLOCK_SIZE);
+    read_blocks(DIR_START, SNAP_LEN, buf);
+    write_blocks(run + DATA_BLOCK_OFFSET, SNAP_LEN, buf);
+    free(buf);
+
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+        if (fat_is_used(i) && fat_get_data_block(i) != NO_DATA)
+            rc_ref(fat_get_data_block(i) - DATA_BLOCK_OFFSET);
+    }
+    sbc_set_snapshot(id, run + DATA_BLOCK_OFFSET);
+    return id;
+}
+
+int snap_delete(int id)
+{
+    int start = snap_start(id), i;
+    if (start == ERR_NOT_FOUND) return ERR_NOT_FOUND;
+
+    byte *fat = read_fat_copy(start);
+    for (i = 0; i < TOTAL_DATA_BLOCKS; i++)
+        fat_unref_block(fat_image_data_block(fat, i));
+    free(fat);
+
+    for (i = 0; i < SNAP_LEN; i++)
+        fbl_set_free_index(start - DATA_BLOCK_OFFSET + i);
+    sbc_set_snapshot(id, 0);
+    return 0;
+}
+
+int snap_start(int id)
+{
+    if (id < 0 || id >= MAX_SNAPSHOTS || sbc_get_snapshot(id) == 0)
+        return ERR_NOT_FOUND;
+    return sbc_get_snapshot(id);
+}
+
+void snap_count_refs(int *refs)
+{
+    int id, i;
+    for (id = 0; id < MAX_SNAPSHOTS; id++) {
+        int start = snap_start(id);
+        if (start == ERR_NOT_FOUND) continue;
+
+        byte *fat = read_fat_copy(start);
+        for (i = 0; i < TOTAL_DATA_BLOCKS; i++) {
+            int db = fat_image_data_block(fat, i);
+            if (db != NO_DATA)
+                refs[db - DATA_BLOCK_OFFSET]++;
+        }
+        free(fat);
+        for (i = 0; i < SNAP_LEN; i++)
+            refs[start - DATA_BLOCK_OFFSET + i]++;
+    }
+}
+
+/*** PRIVATE HELPER FUNCTIONS ***/
+
+byte *read_fat_copy(int start)
+{
+    byte *fat = malloc(FAT_BLOCKS * BLOCK_SIZE);
+    read_blocks(start + DIRECTORY_BLOCKS, FAT_BLOCKS, fat);
+    return fat;
+}
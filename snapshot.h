@@ -0,0 +1,28 @@
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+/* Point-in-time copies of the whole volume. A snapshot is a copy of the
+   directory and FAT regions, stored in a run of data blocks, plus one
+   reference on every data block the FAT pointed at when it was taken.
+   Those references make the blocks shared, so the live volume copies
+   them before changing them and the snapshot keeps the old contents. */
+
+/* Takes a snapshot of the on-disk directory and FAT, which must be
+   flushed. Returns its id, or ERR_OUT_OF_SPACE if every snapshot slot
+   is taken or there is no run of free blocks to hold the copy. */
+int snap_create();
+
+/* Drops the snapshot and every block only it was using. Returns 0, or
+   ERR_NOT_FOUND. */
+int snap_delete(int id);
+
+/* Returns the first block of the snapshot's directory copy, which is
+   followed by its FAT copy, or ERR_NOT_FOUND. */
+int snap_start(int id);
+
+/* Adds to [refs], indexed from the start of the data region, the
+   references every snapshot holds, including those on the blocks
+   holding its own copy of the metadata. */
+void snap_count_refs(int *refs);
+
+#endif